@@ -0,0 +1,210 @@
+/* Benchmark of tree build and query throughput.
+ *
+ * Builds trees over uniform, clustered and anisotropic point sets of 10^3
+ * points up to a maximum (default 10^7, or the first argument), and times
+ * kdtree_build(), kdtree_search_radius() at several radii and
+ * kdtree_search_space() with boxes of the same volume. Each is run with a
+ * k-d tree, a grid and the automatic choice between them (see
+ * kdtree_options.index), on the same points and queries. Results are
+ * written to stdout as JSON.
+ *
+ * Radii are chosen so that a query in uniform points of the same density
+ * would find about 10, 100 and 1000 points, so hits/s are comparable across
+ * sizes and distributions.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "kd3/kdtree.h"
+
+#define BENCH_MIN_POINTS 1000
+#define BENCH_MAX_POINTS 10000000
+#define BENCH_QUERIES 10000
+#define BENCH_MIN_SECONDS 0.2  /* builds are repeated to run at least this */
+
+static const char *distribution_names[] = {
+  "uniform", "clustered", "anisotropic"
+};
+static const double neighbours[] = { 10.0, 100.0, 1000.0 };
+static const char *index_names[] = { "tree", "grid", "auto" };
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+/* xorshift64, so the points are the same on every platform */
+static double uniform(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* standard normal deviate, by the Box-Muller transform */
+static double normal(void) {
+  double u = uniform(), v = uniform();
+  return sqrt(-2.0 * log(u + 1e-300)) * cos(6.283185307179586 * v);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* fill x, y, z with count points of the given distribution, and return the
+ * volume that they occupy */
+static double generate(int distribution, double *x, double *y, double *z,
+                       size_t count) {
+  double cx[100], cy[100], cz[100];
+  size_t i, c;
+
+  rng_state = 88172645463325252ULL;
+  switch (distribution) {
+    case 0: /* unit cube */
+      for (i = 0; i < count; i++) {
+        x[i] = uniform(); y[i] = uniform(); z[i] = uniform();
+      }
+      return 1.0;
+    case 1: /* 100 gaussian clusters within the unit cube */
+      for (c = 0; c < 100; c++) {
+        cx[c] = uniform(); cy[c] = uniform(); cz[c] = uniform();
+      }
+      for (i = 0; i < count; i++) {
+        c = i % 100;
+        x[i] = cx[c] + 0.01 * normal();
+        y[i] = cy[c] + 0.01 * normal();
+        z[i] = cz[c] + 0.01 * normal();
+      }
+      /* volume of the clusters, taken as spheres of two sigma */
+      return 100.0 * 4.0 / 3.0 * 3.141592653589793 * 0.02 * 0.02 * 0.02;
+    default: /* thin slab, 1 x 0.1 x 0.01 */
+      for (i = 0; i < count; i++) {
+        x[i] = uniform(); y[i] = 0.1 * uniform(); z[i] = 0.01 * uniform();
+      }
+      return 0.001;
+  }
+}
+
+static void print_separator(int *first) {
+  printf("%s\n", *first ? "" : ",");
+  *first = 0;
+}
+
+static void bench_size(int distribution, int index, size_t count, double *x,
+                       double *y, double *z, int *first) {
+  kdtree *tree;
+  kdtree_iterator *iter = NULL;
+  kdtree_options options;
+  const char *name = distribution_names[distribution];
+  const char *index_name = index_names[index];
+  double volume, start, seconds, radius, hits;
+  size_t i, q, r, repeats = 0, *query;
+
+  volume = generate(distribution, x, y, z, count);
+  kdtree_options_init(&options);
+  options.index = index;
+  tree = kdtree_create(&options);
+
+  start = now();
+  do {
+    kdtree_build(x, y, z, count, &tree);
+    repeats++;
+  } while ((seconds = now() - start) < BENCH_MIN_SECONDS);
+  seconds /= repeats;
+  print_separator(first);
+  printf("    {\"distribution\": \"%s\", \"index\": \"%s\", "
+         "\"grid\": %d, \"points\": %lu, "
+         "\"operation\": \"build\", \"seconds\": %.6g, "
+         "\"points_per_second\": %.6g}", name, index_name,
+         tree->grid.cells > 0, (unsigned long)count, seconds,
+         count / seconds);
+
+  /* queries are centred on points of the set, so clustered queries are
+   * mostly within clusters */
+  query = malloc(sizeof(size_t) * BENCH_QUERIES);
+  for (q = 0; q < BENCH_QUERIES; q++) {
+    query[q] = (size_t)(uniform() * count) % count;
+  }
+
+  for (r = 0; r < sizeof(neighbours) / sizeof(neighbours[0]); r++) {
+    radius = cbrt(3.0 * neighbours[r] * volume /
+                  (4.0 * 3.141592653589793 * count));
+
+    hits = 0.0;
+    start = now();
+    for (q = 0; q < BENCH_QUERIES; q++) {
+      i = query[q];
+      kdtree_search_radius(tree, &iter, x[i], y[i], z[i], radius);
+      hits += iter->size;
+    }
+    seconds = now() - start;
+    print_separator(first);
+    printf("    {\"distribution\": \"%s\", \"index\": \"%s\", "
+           "\"points\": %lu, "
+           "\"operation\": \"search_radius\", \"radius\": %.6g, "
+           "\"queries\": %d, \"seconds\": %.6g, "
+           "\"queries_per_second\": %.6g, \"hits_per_second\": %.6g}",
+           name, index_name, (unsigned long)count, radius, BENCH_QUERIES,
+           seconds, BENCH_QUERIES / seconds, hits / seconds);
+
+    /* box of the same volume as the sphere */
+    radius *= 0.5 * cbrt(4.0 / 3.0 * 3.141592653589793);
+    hits = 0.0;
+    start = now();
+    for (q = 0; q < BENCH_QUERIES; q++) {
+      i = query[q];
+      kdtree_search_space(tree, &iter, x[i] - radius, x[i] + radius,
+                          y[i] - radius, y[i] + radius,
+                          z[i] - radius, z[i] + radius);
+      hits += iter->size;
+    }
+    seconds = now() - start;
+    print_separator(first);
+    printf("    {\"distribution\": \"%s\", \"index\": \"%s\", "
+           "\"points\": %lu, "
+           "\"operation\": \"search_space\", \"half_width\": %.6g, "
+           "\"queries\": %d, \"seconds\": %.6g, "
+           "\"queries_per_second\": %.6g, \"hits_per_second\": %.6g}",
+           name, index_name, (unsigned long)count, radius, BENCH_QUERIES,
+           seconds, BENCH_QUERIES / seconds, hits / seconds);
+  }
+  fflush(stdout);
+
+  free(query);
+  kdtree_iterator_delete(&iter);
+  kdtree_delete(&tree);
+}
+
+int main(int argc, char **argv) {
+  size_t count, max_points = BENCH_MAX_POINTS;
+  double *x, *y, *z;
+  int distribution, index, first = 1;
+
+  if (argc > 1) max_points = (size_t)strtod(argv[1], NULL);
+  if (max_points < BENCH_MIN_POINTS) max_points = BENCH_MIN_POINTS;
+
+  x = malloc(sizeof(double) * max_points);
+  y = malloc(sizeof(double) * max_points);
+  z = malloc(sizeof(double) * max_points);
+  if (x == NULL || y == NULL || z == NULL) {
+    fprintf(stderr, "bench: cannot allocate %lu points\n",
+            (unsigned long)max_points);
+    return 1;
+  }
+
+  printf("{\n  \"max_points\": %lu,\n  \"results\": [",
+         (unsigned long)max_points);
+  for (distribution = 0; distribution < 3; distribution++) {
+    for (count = BENCH_MIN_POINTS; count <= max_points; count *= 10) {
+      for (index = KDTREE_INDEX_TREE; index <= KDTREE_INDEX_AUTO; index++) {
+        bench_size(distribution, index, count, x, y, z, &first);
+      }
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  free(x); free(y); free(z);
+  return 0;
+}
@@ -25,90 +25,609 @@
  * for tree nodes from a contiguous block of memory.
  *
  */
+#define _POSIX_C_SOURCE 200112L
 #include <assert.h> /* assert() */
 #include <float.h>  /* DBL_MAX */
+#include <limits.h> /* CHAR_BIT */
+#include <stddef.h> /* ptrdiff_t */
+#include <stdio.h>  /* fopen(), fwrite() */
 #include <string.h> /* memcpy() */
+#include <time.h>   /* clock_gettime() */
+#include <pthread.h> /* pthread_create(), pthread_join() */
+#include <unistd.h> /* sysconf(), close() */
+#include <fcntl.h>  /* open() */
+#include <sys/mman.h> /* mmap(), munmap() */
+#include <sys/stat.h> /* fstat() */
+
+/* vectorised leaf scans. Define KDTREE_NO_SIMD to use plain C instead */
+#if !defined(KDTREE_NO_SIMD) && defined(__AVX__)
+  #define KDTREE_SIMD_AVX
+  #include <immintrin.h>
+#elif !defined(KDTREE_NO_SIMD) && defined(__SSE2__)
+  #define KDTREE_SIMD_SSE2
+  #include <emmintrin.h>
+#endif
 #include "kdtree.h"
 
 /* dimensions hard coded to 3. Declare constants for convenience */
 enum DIMENSIONS { DIM_X = 0, DIM_Y, DIM_Z, NDIMS };
 
-/* Routines used for sorting points along different axes
+/* maximum depth of a tree. Each level at least halves the number of points
+ * covered by a node, so this is also the most nodes ever held on the stack
+ * of a non-recursive traversal */
+#define MAX_DEPTH (sizeof(size_t) * CHAR_BIT)
+
+/* update a traversal counter of an iterator. Compiled out unless
+ * KDTREE_STATS is defined */
+#ifdef KDTREE_STATS
+  #define STAT_ADD(iter, field, n) ((iter)->stats.field += (n))
+  #define STAT_TOTAL(tree, iter) \
+    _stats_accumulate(&(tree)->stats.search, &(iter)->stats)
+  #define STAT_CLOCK_START double stat_clock = _seconds();
+  #define STAT_PHASE(tree, phase) \
+    ((tree)->stats.build.phase = _seconds() - stat_clock, \
+     stat_clock += (tree)->stats.build.phase)
+#else
+  #define STAT_ADD(iter, field, n) ((void)0)
+  #define STAT_TOTAL(tree, iter) ((void)0)
+  #define STAT_CLOCK_START
+  #define STAT_PHASE(tree, phase) ((void)0)
+#endif
+
+/* spherical search space */
+struct sphere {
+  double centre[3];
+  double radius_squared;
+};
+
+/* search of a periodic domain, by either a cube or a sphere. Axes with a
+ * period of 0 are not periodic */
+struct periodic_query {
+  double centre[3];
+  double half_width[3];   /* of the cube, if !is_sphere */
+  double radius_squared;  /* of the sphere, if is_sphere */
+  double period[3];
+  int is_sphere;
+};
+
+/* the k nearest points found so far by _nearest_query(), as a max-heap
+ * keyed on distance */
+struct nearest_heap {
+  size_t *idx;
+  double *distance;
+  size_t size;
+  size_t k;
+  double radius_squared; /* furthest distance still of interest */
+  size_t accepted;       /* points that entered the heap */
+};
+
+/* arguments for visiting the points of leaves within a radius */
+struct radius_visit {
+  kdtree_visitor visit;
+  void *data;
+  double centre[3];
+  double radius_squared;
+};
+
+/* a run of consecutive points (in tree order) to be scanned. Usually this
+ * refers directly to the points of the tree. For index-only trees, the
+ * coordinates and indices of up to KDTREE_GATHER_SIZE points are gathered
+ * into the buffers so that the same scans can be used.
+ */
+struct point_run {
+  const double *coord[3];
+  const size_t *idx;
+  size_t count;
+  double coord_buffer[3][KDTREE_GATHER_SIZE];
+  size_t idx_buffer[KDTREE_GATHER_SIZE];
+};
+
+/* Routine used for selecting the median point along an axis
  *
- * We've tried more complicate cmp routines which proceed
- * to compare the other axes in the event that two points
- * have the same value, however tests show that a basic
- * compare results in better overall performance.
+ * Building the tree only requires the median of each sub-range (and the
+ * points on either side of it), not a full sort. We therefore use an
+ * in-place selection algorithm (Hoare's FIND, with a median-of-three pivot)
+ * which runs in linear time on average.
  *
+ * Coordinates are stored as separate arrays, so comparisons operate directly
+ * on the array for the selected axis and are inlined, rather than being
+ * dispatched through a qsort-style cmp function for every comparison.
+ *
+ * On return, position k holds the point that would have been there had the
+ * range [from, to] been sorted along the axis, with no point in [from, k)
+ * greater than it and no point in (k, to] less than it.
  */
-#define CMP(v1,v2) ((v1 > v2) ? 1 : ((v1 < v2) ? -1 : 0))
-
-static int cmp_x(const void *a1, const void *a2) {
-  const struct data_point *A1 = (const struct data_point*)a1;
-  const struct data_point *A2 = (const struct data_point*)a2;
-  return CMP(A1->x, A2->x);
-}
+#define MEDIAN3(a,b,c) ((a < b) ? ((b < c) ? b : ((a < c) ? c : a)) \
+                                : ((a < c) ? a : ((b < c) ? c : b)))
 
-static int cmp_y(const void *a1, const void *a2) {
-  const struct data_point *A1 = (const struct data_point*)a1;
-  const struct data_point *A2 = (const struct data_point*)a2;
-  return CMP(A1->y, A2->y);
+static void select_on_axis(struct point_data *points, size_t axis,
+                           ptrdiff_t from, ptrdiff_t to, ptrdiff_t k) {
+  double * const key = points->coord[axis];
+  double tmp;
+  size_t tmp_idx;
+  ptrdiff_t i, j;
+  size_t d;
+  double pivot;
+  while (from < to) {
+    pivot = MEDIAN3(key[from], key[k], key[to]);
+    i = from;
+    j = to;
+    do {
+      while (key[i] < pivot) i++;
+      while (pivot < key[j]) j--;
+      if (i <= j) {
+        for (d = 0; d < NDIMS; d++) {
+          tmp = points->coord[d][i];
+          points->coord[d][i] = points->coord[d][j];
+          points->coord[d][j] = tmp;
+        }
+        tmp_idx = points->idx[i];
+        points->idx[i] = points->idx[j];
+        points->idx[j] = tmp_idx;
+        i++; j--;
+      }
+    } while (i <= j);
+    if (j < k) from = i;
+    if (k < i) to = j;
+  }
 }
 
-static int cmp_z(const void *a1, const void *a2) {
-  const struct data_point *A1 = (const struct data_point*)a1;
-  const struct data_point *A2 = (const struct data_point*)a2;
-  return CMP(A1->z, A2->z);
+/* As select_on_axis(), but for index-only trees. Only the permutation is
+ * reordered, with the coordinates of each point looked up in key.
+ */
+static void select_on_perm(const double *key, uint32_t *perm,
+                           ptrdiff_t from, ptrdiff_t to, ptrdiff_t k) {
+  uint32_t tmp;
+  ptrdiff_t i, j;
+  double pivot;
+  while (from < to) {
+    pivot = MEDIAN3(key[perm[from]], key[perm[k]], key[perm[to]]);
+    i = from;
+    j = to;
+    do {
+      while (key[perm[i]] < pivot) i++;
+      while (pivot < key[perm[j]]) j--;
+      if (i <= j) {
+        tmp = perm[i];
+        perm[i] = perm[j];
+        perm[j] = tmp;
+        i++; j--;
+      }
+    } while (i <= j);
+    if (j < k) from = i;
+    if (k < i) to = j;
+  }
 }
 
 /* for sorting iterators */
+#define CMP(v1,v2) ((v1 > v2) ? 1 : ((v1 < v2) ? -1 : 0))
 static int cmp_size_t(const void *a1, const void *a2) {
   const size_t *A1 = (const size_t*)a1;
   const size_t *A2 = (const size_t*)a2;
   return CMP(*A1, *A2);
 }
 
-/* datatype for cmp function pointer */
-typedef int(*cmp_func)(const void *, const void *);
+/* largest coordinate along each axis of a Morton code (21 bits) */
+#define MORTON_MAX 2097151.0
+
+/* spread the lower 21 bits of value so that there are two zero bits between
+ * each, ready to be interleaved with those of the other axes */
+static uint64_t _morton_spread(uint64_t value) {
+  value &= 0x1fffff;
+  value = (value | (value << 32)) & 0x1f00000000ffffULL;
+  value = (value | (value << 16)) & 0x1f0000ff0000ffULL;
+  value = (value | (value << 8))  & 0x100f00f00f00f00fULL;
+  value = (value | (value << 4))  & 0x10c30c30c30c30c3ULL;
+  value = (value | (value << 2))  & 0x1249249249249249ULL;
+  return value;
+}
+
+/* Morton codes are sorted RADIX_BITS at a time */
+#define RADIX_BITS 8
+#define RADIX_BINS (1 << RADIX_BITS)
+
+enum RADIX_PHASES { RADIX_CODES, RADIX_HISTOGRAM, RADIX_SCATTER };
+
+/* a point to be sorted by its Morton code */
+struct morton_entry {
+  uint64_t code;
+  size_t position;        /* position of the point in its source */
+};
+
+/* per-thread state of the radix sort in _morton_sort(). Each thread handles
+ * the entries from, up to to. In each pass, histogram holds the number of
+ * entries with each digit, and then the position to scatter the next of
+ * them to */
+struct radix_task {
+  const double *coord[NDIMS]; /* source of coordinates */
+  const uint32_t *perm;
+  const double *min;      /* quantisation of coordinates */
+  const double *scale;
+  struct morton_entry *in;
+  struct morton_entry *out;
+  size_t from;
+  size_t to;
+  size_t shift;           /* of the digit sorted in this pass */
+  int phase;              /* RADIX_PHASES */
+  size_t histogram[RADIX_BINS];
+};
+
+/* arguments for building a subtree on a separate thread */
+struct build_task {
+  kdtree *tree;
+  size_t idx_from;
+  size_t count;
+  size_t depth;
+  size_t node;
+  size_t threads;
+};
+
+/* Files written by kdtree_save() hold this header followed by each section
+ * of the tree, at the offsets given in the header (0 if absent). Sections
+ * are aligned to FILE_ALIGNMENT bytes and stored exactly as in memory, so a
+ * loaded tree refers directly into the mapped file. Files are therefore only
+ * readable on hosts with the same byte order and size_t as the writer. */
+#define FILE_MAGIC "KD3TREE"
+#define FILE_BYTE_ORDER 0x01020304
+#define FILE_ALIGNMENT 64
+
+enum FILE_SECTIONS {
+  SECTION_X = 0, SECTION_Y, SECTION_Z, /* coordinates */
+  SECTION_INDEX,                       /* points.idx, or points.perm */
+  SECTION_NODES, SECTION_BOUNDS, SECTION_SUMS,
+  SECTION_WEIGHT,                      /* weights, in original order */
+  NUM_SECTIONS
+};
+
+struct file_header {
+  char magic[8];          /* FILE_MAGIC */
+  uint32_t version;       /* KDTREE_FILE_VERSION */
+  uint32_t byte_order;    /* FILE_BYTE_ORDER, as stored by the writer */
+  uint32_t size_t_bytes;  /* sizeof(size_t) of the writer */
+  int32_t layout;
+  int32_t index_only;
+  int32_t aggregate;
+  int32_t weighted;
+  uint64_t count;
+  uint64_t max_nodes;
+  uint64_t leaf_depth;
+  uint64_t leaf_size;
+  double build_cost;
+  double cost;
+  uint64_t offset[NUM_SECTIONS];
+  uint64_t size[NUM_SECTIONS];
+  uint64_t file_size;
+};
+
+/* state shared by the threads of a batch query */
+struct batch_job {
+  const kdtree *tree;
+  const double *coord[3]; /* coordinates of query points */
+  const struct point_data *points; /* if set, query the points of the tree
+                                    * instead of coord (see
+                                    * _batch_query_point()) */
+  size_t count;           /* number of queries */
+  struct sphere sphere;   /* radius of search (centre set per query) */
+  size_t k;               /* neighbours per query, or 0 for radius queries */
+  size_t next_block;      /* next block of queries to hand out */
+  pthread_mutex_t lock;   /* protects next_block */
+  kdtree_neighbours *result;
+};
+
+/* per-thread state of a batch query. Neighbours are appended to buffer in
+ * the order that blocks were processed, and copied into place once the
+ * offset of each row is known */
+struct batch_worker {
+  struct batch_job *job;
+  kdtree_iterator *buffer;
+  size_t *blocks;         /* blocks processed by this thread, in order */
+  size_t num_blocks;
+  size_t blocks_capacity;
+};
 
-/* static array of cmp functions indexed by dim */
-const cmp_func func_select[] = { cmp_x, cmp_y, cmp_z };
+/* an inserted point being paired with the leaves of the tree, see
+ * _join_pending() */
+struct inserted_join {
+  struct point_run point; /* the inserted point, as a run of one */
+  double radius_squared;
+  kdtree_pairs *pairs;
+};
+
+/* arguments for refitting a subtree on a separate thread */
+struct refit_task {
+  kdtree *tree;
+  size_t node;
+  const double **coord;
+  size_t threads;
+};
+
+/* state of the build of a kdtree_buffer's back tree */
+enum BUFFER_STATES {
+  BUFFER_IDLE = 0, /* nothing to publish */
+  BUFFER_BUILDING, /* building in the background */
+  BUFFER_BUILT     /* built, waiting for kdtree_buffer_publish() */
+};
+
+/* Two trees, the front one published to readers and the back one rebuilt
+ * from a snapshot of the coordinates. Each tree has its own snapshot, which
+ * index-only trees go on referring to once built. A tree is only rebuilt
+ * once every reader that acquired it has released it */
+struct kdtree_buffer {
+  kdtree *tree[2];
+  double *snapshot[2][3];      /* coordinates each tree is built from */
+  size_t snapshot_capacity[2];
+  size_t count;                /* points in the build in progress */
+  size_t readers[2];           /* acquired and not yet released */
+  int front;                   /* index of the published tree */
+  int published;               /* set once a tree has been published */
+  int state;                   /* BUFFER_STATES */
+  int joinable;                /* set if the build runs on thread */
+  pthread_t thread;
+  pthread_mutex_t lock;        /* protects the fields above */
+  pthread_cond_t changed;      /* a build finished or a tree was released */
+};
 
 /* declaration of internal functions */
-inline static struct tree_node* _next_node(kdtree *tree);
-inline static struct tree_node* _get_leaf_node(kdtree *tree, size_t offset);
-inline static struct tree_node* _get_branch_node(kdtree *tree, double split);
-static struct tree_node* _build_kdtree(size_t idx_from, size_t idx_to,
-                                       size_t depth, kdtree *tree);
+inline static size_t _point_run(const kdtree *tree, size_t offset,
+                                size_t count, struct point_run *run);
+inline static size_t _point_index(const struct point_data *points, size_t i);
+inline static double _point_coord(const struct point_data *points, size_t d,
+                                  size_t i);
+static void _free_points(kdtree *tree);
+inline static size_t _left_child(const kdtree *tree, size_t node);
+inline static size_t _right_child(const kdtree *tree, size_t node);
+inline static void _node_points(const kdtree *tree, size_t node,
+                                size_t *offset, size_t *count);
+inline static size_t _split_point(size_t count, size_t depth, size_t position);
+static size_t _floor_log2(size_t value);
+inline static void _leaf_bounds(const kdtree *tree, size_t node);
+inline static void _branch_bounds(const kdtree *tree, size_t node);
+inline static void _add_sums(struct node_sums *sums,
+                             const struct node_sums *a,
+                             const struct node_sums *b);
+static double _tree_cost(const kdtree *tree);
+static void _refit_kdtree(size_t node, const double *coord[],
+                          size_t threads, kdtree *tree);
+static void* _refit_kdtree_task(void *arg);
+static size_t _count_leaves(size_t count, size_t leaf_size);
+static size_t _leaf_depth(size_t count, size_t leaf_size);
+static void _build_kdtree(size_t idx_from, size_t count, size_t depth,
+                          size_t node, size_t threads, kdtree *tree);
+static void* _build_kdtree_task(void *arg);
+static void* _buffer_build_task(void *arg);
+inline static void _set_add(const kdtree *tree, kdtree_result_set *set,
+                            size_t offset, size_t count);
+inline static void _set_add_run(kdtree_result_set *set, size_t offset,
+                                size_t count);
+inline static void _set_reserve(kdtree_result_set *set, size_t count);
+inline static size_t _lowest_bit(uint64_t word);
+static size_t _resolve_num_threads(size_t num_threads);
+static void _morton_sort(const double *x, const double *y, const double *z,
+                         const uint32_t *perm, size_t count, size_t threads,
+                         size_t *order);
+static void* _radix_task(void *arg);
+static void _morton_arrange(kdtree *tree, const struct point_data *source);
+static void _gather_points(kdtree *tree, const struct point_data *source,
+                           const size_t *order);
+static void _plan_grid(kdtree *tree, const struct point_data *source);
+static int _uniform_density(const struct point_data *points, size_t count);
+static void _grid_layout(struct grid *grid, const double min[],
+                         const double max[], size_t count, double per_cell,
+                         double cell_size);
+inline static size_t _grid_index(const struct grid *grid, size_t d,
+                                 double value);
+inline static size_t _grid_point_cell(const struct grid *grid,
+                                      const struct point_data *points,
+                                      size_t i);
+static void _grid_arrange(kdtree *tree, const struct point_data *source);
+static double _root(double value, size_t n);
+static void _build_grid(kdtree *tree);
+static void _build_grid_nodes(kdtree *tree, const size_t *cell,
+                              const size_t *first, size_t from, size_t to,
+                              size_t node);
+static void _reserve_points(kdtree *tree, size_t count, size_t keep);
+static void _reserve_nodes(kdtree *tree);
+static size_t _grow_capacity(size_t capacity, size_t required);
+static void _clear_pending(kdtree *tree);
+static void _free_pending(kdtree *tree);
+static void _check_pending(kdtree *tree);
+static void _map_positions(kdtree *tree);
+inline static int _has_pending(const kdtree *tree);
+inline static void _inserted_run(const kdtree *tree, struct point_run *run);
+inline static void _drop_removed(const kdtree *tree, kdtree_iterator *iter,
+                                 size_t from);
+static void _aggregate_pending(const kdtree *tree,
+                               const struct space *search_space,
+                               const struct sphere *sphere,
+                               kdtree_aggregate *result, int with_sums);
+inline static int _aggregate_contains(const struct space *search_space,
+                                      const struct sphere *sphere,
+                                      const double p[]);
+static void _file_sections(const kdtree *tree, const void *data[],
+                           uint64_t size[]);
+static int _valid_header(const struct file_header *header, size_t file_size);
+static void _unmap(kdtree *tree);
+#ifdef KDTREE_STATS
+static double _seconds(void);
+static void _stats_accumulate(kdtree_search_stats *total,
+                              const kdtree_search_stats *stats);
+#endif
 inline static kdtree_iterator* _iterator_new(void);
 inline static void _iterator_reset(kdtree_iterator *iter);
 inline static void _iterator_push(kdtree_iterator *iter, size_t value);
-inline static void _explore_branch(kdtree *tree,
-                                   struct tree_node *node,
-                                   size_t depth,
-                                   const struct space *search_space,
-                                   const struct space *domain,
-                                   kdtree_iterator *iter);
-static void _search_kdtree(kdtree *tree,
-                           struct tree_node *root,
-                           size_t depth,
+inline static void _iterator_reserve(kdtree_iterator *iter, size_t count);
+inline static kdtree_iterator* _iterator_prepare(kdtree_iterator **iter_ptr,
+                                                 int with_distance);
+inline static void _report_node(const kdtree *tree, size_t node,
+                                kdtree_iterator *iter);
+inline static void _report_points(const kdtree *tree, size_t offset,
+                                  size_t count, kdtree_iterator *iter);
+inline static void _report_cells(const kdtree *tree, size_t from, size_t to,
+                                 kdtree_iterator *iter);
+static void _search_kdtree(const kdtree *tree, size_t node,
                            const struct space *search_space,
-                           const struct space *domain,
                            kdtree_iterator *iter);
-inline static int _point_in_search_space(const struct data_point *point,
-                                         const struct space *search_space);
+static void _search_grid(const kdtree *tree,
+                         const struct space *search_space,
+                         kdtree_iterator *iter);
+inline static void _search_pending(const kdtree *tree,
+                                   const struct space *search_space,
+                                   kdtree_iterator *iter, size_t from);
+static void _index_leaves(kdtree *tree);
+static void _free_self(kdtree *tree);
+inline static size_t _parent_node(const kdtree *tree, size_t node);
+inline static int _cell_encloses(const struct space *cell,
+                                 const struct space *search_space);
+inline static void _filter_leaf(const kdtree *tree, size_t leaf,
+                                const struct space *search_space,
+                                kdtree_iterator *iter);
+inline static void _filter_run(const struct point_run *run,
+                               const struct space *search_space,
+                               kdtree_iterator *iter);
+inline static void _filter_leaf_radius(const kdtree *tree, size_t leaf,
+                                       const struct sphere *sphere,
+                                       kdtree_iterator *iter);
+inline static void _filter_run_radius(const struct point_run *run,
+                                      const struct sphere *sphere,
+                                      kdtree_iterator *iter);
+static int _is_periodic(const kdtree *tree);
+static void _periodic_query(const kdtree *tree,
+                            const struct periodic_query *query,
+                            kdtree_iterator *iter);
+inline static void _periodic_filter_run(const struct point_run *run,
+                                        const struct periodic_query *query,
+                                        kdtree_iterator *iter);
+inline static double _periodic_distance(double centre, double period,
+                                        const struct boundaries *bounds);
+inline static double _floor(double value);
+inline static void _iterator_want_images(kdtree_iterator *iter);
+inline static double _distance_to_domain(const struct sphere *sphere,
+                                         const struct space *domain);
+static void _radius_query(const kdtree *tree, const struct sphere *sphere,
+                          kdtree_iterator *iter);
+static void _nearest_query(const kdtree *tree, const struct sphere *sphere,
+                           size_t k, kdtree_iterator *iter);
+inline static void _heap_sift_down(size_t *idx, double *distance,
+                                   size_t size, size_t i);
+inline static void _nearest_run(const struct point_run *run,
+                                const double centre[],
+                                const unsigned char *removed,
+                                struct nearest_heap *heap);
+static void _visit_leaves(const kdtree *tree, const struct sphere *sphere,
+                          kdtree_leaf_visitor visit, void *data);
+inline static void _visit_radius_run(const struct radius_visit *args,
+                                     const struct point_run *run,
+                                     const unsigned char *removed);
+static void _batch_query(kdtree *tree, kdtree_neighbours **nbr_ptr,
+                         const double *coord[],
+                         const struct point_data *points,
+                         size_t count, size_t rows, double radius_squared,
+                         size_t k, int with_distance);
+inline static size_t _batch_query_point(const struct batch_job *job,
+                                        size_t i, double centre[]);
+static size_t _index_limit(const kdtree *tree);
+static void _visit_radius_leaf(void *arg, const kdtree *tree,
+                               size_t offset, size_t count);
+static void* _batch_search_task(void *arg);
+static void* _batch_merge_task(void *arg);
+static void _run_tasks(void* (*routine)(void *), void *args, size_t arg_size,
+                       pthread_t *threads, size_t num_threads);
+static void _join_kdtree(const kdtree *tree, size_t a, size_t b,
+                         double radius_squared, kdtree_pairs *pairs);
+static void _join_pending(const kdtree *tree, double radius_squared,
+                          kdtree_pairs *pairs);
+static void _join_inserted_leaf(void *arg, const kdtree *tree,
+                                size_t offset, size_t count);
+inline static void _join_leaf(const kdtree *tree, size_t a, size_t b,
+                              double radius_squared, kdtree_pairs *pairs);
+inline static void _join_runs(const struct point_run *a,
+                              const struct point_run *b, int same,
+                              double radius_squared, kdtree_pairs *pairs);
+inline static double _domain_distance(const struct space *a,
+                                      const struct space *b);
+inline static void _pairs_reserve(kdtree_pairs *pairs, size_t count);
 inline static int _completely_enclosed(const struct space *search_space,
                                        const struct space *domain);
+inline static int _sphere_encloses(const struct sphere *sphere,
+                                   const struct space *domain);
+static void _aggregate_query(const kdtree *tree,
+                             const struct space *search_space,
+                             const struct sphere *sphere,
+                             kdtree_aggregate *result, int with_sums);
 inline static int _search_area_intersects(const struct space *search_space,
                                           const struct space *domain);
 #ifndef _DEBUG_MODE
-inline static int _is_leaf_node(const struct tree_node *node);
+inline static int _is_leaf_node(const kdtree *tree, size_t node);
 #else
-#define _is_leaf_node(node) (node->left == NULL)
+#define _is_leaf_node(tree, node) (((tree)->layout == KDTREE_LAYOUT_IMPLICIT) \
+    ? ((node) >= ((size_t)1 << (tree)->leaf_depth) - 1)                      \
+    : ((tree)->node_data[node].right == 0))
 #endif
 
 /* ---------------- Implementation of public APIs --------------------------- */
 
+/* Initialise build options to their default values */
+void kdtree_options_init(kdtree_options *options) {
+  assert(options != NULL);
+  options->num_threads = 1;
+  options->parallel_cutoff = KDTREE_PARALLEL_CUTOFF;
+  options->leaf_size = KDTREE_LEAF_SIZE;
+  options->refit_tolerance = KDTREE_REFIT_TOLERANCE;
+  options->layout = KDTREE_LAYOUT_POINTER;
+  options->index_only = 0;
+  options->aggregate = 0;
+  options->weight = NULL;
+  options->period[DIM_X] = 0.0;
+  options->period[DIM_Y] = 0.0;
+  options->period[DIM_Z] = 0.0;
+  options->period_images = 0;
+  options->update_fraction = KDTREE_UPDATE_FRACTION;
+  options->build_method = KDTREE_BUILD_MEDIAN;
+  options->self_search = 0;
+  options->index = KDTREE_INDEX_TREE;
+  options->grid_cell_size = 0.0;
+}
+
+/* Create an empty tree object which uses the given build options. Pass the
+ * result to kdtree_build() to populate it. If options is NULL, the defaults
+ * are used (which is what kdtree_build() does when given a NULL tree).
+ */
+kdtree* kdtree_create(const kdtree_options *options) {
+  kdtree *tree = malloc(sizeof(kdtree));
+  assert(tree != NULL);
+
+  if (options) tree->options = *options;
+  else kdtree_options_init(&tree->options);
+
+  tree->count = 0;
+  tree->max_nodes = 0;
+  tree->capacity = 0;
+  tree->node_capacity = 0;
+  tree->layout = tree->options.layout;
+  tree->index_only = 0;
+  tree->leaf_depth = 0;
+  tree->points.coord[DIM_X] = NULL;
+  tree->points.coord[DIM_Y] = NULL;
+  tree->points.coord[DIM_Z] = NULL;
+  tree->points.idx = NULL;
+  tree->points.perm = NULL;
+  tree->node_data = NULL;
+  tree->node_bounds = NULL;
+  tree->node_sums = NULL;
+  tree->weight = NULL;
+  tree->build_cost = 0.0;
+  tree->cost = 0.0;
+  tree->mapping = NULL;
+  tree->mapping_size = 0;
+  memset(&tree->pending, 0, sizeof(struct pending_changes));
+  memset(&tree->self, 0, sizeof(struct self_search));
+  memset(&tree->grid, 0, sizeof(struct grid));
+#ifdef KDTREE_STATS
+  memset(&tree->stats, 0, sizeof(kdtree_stats));
+#endif
+  return tree;
+}
+
 /* Build a 3D k-d tree based on the points stored in x, y, z arrays (with count
  * specifying the number of points).
  *
@@ -126,53 +645,320 @@ inline static int _is_leaf_node(const struct tree_node *node);
  *   }
  *   kdtree_delete(&tree);
  *
- * Note that tree object can only be reused if the count is equal. Mismatching
- * counts will cause the previous object to be deleted and a new one built in
- * its place.
+ * To build with non-default options (e.g. using multiple threads), create the
+ * tree object with kdtree_create() before the first call.
+ *
+ * Memory within the tree object is reused when rebuilding. It is only
+ * reallocated if the tree outgrows it, and is then grown geometrically (by
+ * KDTREE_CAPACITY_GROWTH_RATIO) so that slowly growing counts rarely cause
+ * a reallocation. The options of the tree object are retained. Any points
+ * inserted or removed since the last build are discarded.
+ *
+ * By default, points are partitioned by selecting the median along each axis
+ * in turn. With options.build_method set to KDTREE_BUILD_MORTON, they are
+ * instead radix sorted along a Morton curve (see _morton_sort()) and each
+ * node takes a contiguous run of the curve, which is quicker to build but
+ * gives looser node bounds.
+ *
+ * With options.index set to KDTREE_INDEX_GRID, a uniform grid of cells is
+ * built instead (see _plan_grid()), in O(n) by a counting sort of the points
+ * into cells. Each non-empty cell becomes a leaf node. kdtree_search() and
+ * kdtree_search_space() look up the cells they overlap directly, while
+ * other searches traverse the nodes as usual. KDTREE_INDEX_AUTO builds a
+ * grid only if a sample of the points suggests that their density is close
+ * to uniform (see _uniform_density()).
+ *
+ * If options.index_only is set, the coordinates are not copied. The tree
+ * instead refers to x, y and z directly, so they must not be modified or
+ * freed until the tree is next built (or refit) or deleted.
  *
  * To reduce the amount of checks, we do not handle cases where count < 0.
  * Do ensure that we're dealing with at lease two points
  *
  */
 void kdtree_build(double *x, double *y, double *z, size_t count, kdtree **tree_ptr) {
+  struct point_data source;
   size_t i;
   kdtree *tree = *tree_ptr;
   
   /* sanity check */
   assert(count > 1);
 
-  /* Reallocate object if ptr == NULL or if count does not match */
-  if (!tree || tree->count != count) {
-    if (tree) kdtree_delete(&tree); /* delete prev obj */
-    
-    /* allocate new object and update user's reference */
-    tree = malloc(sizeof(kdtree));
-    assert(tree != NULL);
-    *tree_ptr = tree;
-    
-    /* initialise values and memory */
-    tree->count = count;
-    tree->max_nodes = ((count - 1) * 2) + 1;
-    tree->points = malloc(sizeof(struct data_point) * count);
-    tree->node_data = malloc(sizeof(struct tree_node) * tree->max_nodes);
-    assert(tree->points != NULL);
-    assert(tree->node_data != NULL);
-  }
-
-  /* reset control values */
-  tree->next_node = 0;
-
-  /* cache coordinates of each point and map to the idx of the point */
-  for (i = 0; i < count; i++) {
-    tree->points[i].idx = i;
-    tree->points[i].x = x[i];
-    tree->points[i].y = y[i];
-    tree->points[i].z = z[i];
+  /* allocate new object with default options if ptr == NULL */
+  if (!tree) {
+    tree = kdtree_create(NULL);
+    *tree_ptr = tree; /* update user's reference */
+  }
+  STAT_CLOCK_START
+  _unmap(tree); /* a loaded tree is read-only, so build into new memory */
+  _clear_pending(tree);
+  _reserve_points(tree, count, 0);
+  tree->count = count;
+  source.coord[DIM_X] = x;
+  source.coord[DIM_Y] = y;
+  source.coord[DIM_Z] = z;
+  source.idx = NULL;
+  source.perm = NULL;
+  _plan_grid(tree, &source);
+  _reserve_nodes(tree);
+  tree->weight = tree->options.weight;
+  STAT_PHASE(tree, allocate);
+
+  if (tree->grid.cells > 0 ||
+      tree->options.build_method == KDTREE_BUILD_MORTON) {
+    /* copy points straight into cell or Morton order */
+    if (tree->index_only) {
+      for (i = 0; i < NDIMS; i++) tree->points.coord[i] = source.coord[i];
+    }
+    if (tree->grid.cells > 0) _grid_arrange(tree, &source);
+    else _morton_arrange(tree, &source);
+  } else if (tree->index_only) {
+    /* refer to the caller's coordinates */
+    tree->points.coord[DIM_X] = x;
+    tree->points.coord[DIM_Y] = y;
+    tree->points.coord[DIM_Z] = z;
+    for (i = 0; i < count; i++) tree->points.perm[i] = (uint32_t)i;
+  } else {
+    /* cache coordinates of each point and map to the idx of the point */
+    memcpy(tree->points.coord[DIM_X], x, sizeof(double) * count);
+    memcpy(tree->points.coord[DIM_Y], y, sizeof(double) * count);
+    memcpy(tree->points.coord[DIM_Z], z, sizeof(double) * count);
+    for (i = 0; i < count; i++) tree->points.idx[i] = i;
+  }
+  STAT_PHASE(tree, copy);
+
+  /* build tree. The root is always the first node */
+  if (tree->grid.cells > 0) {
+    _build_grid(tree);
+  } else {
+    _build_kdtree(0, count, 0, 0,
+                  _resolve_num_threads(tree->options.num_threads), tree);
+  }
+  _index_leaves(tree);
+  STAT_PHASE(tree, construct);
+  tree->build_cost = tree->cost = _tree_cost(tree);
+  STAT_PHASE(tree, cost);
+#ifdef KDTREE_STATS
+  tree->stats.build.total = tree->stats.build.allocate +
+                            tree->stats.build.copy +
+                            tree->stats.build.construct +
+                            tree->stats.build.cost;
+#endif
+}
+
+/* Update the tree after points have moved, reusing its existing structure.
+ *
+ * Instead of rebuilding the tree, the new coordinates are copied in and the
+ * bounds of each node recomputed bottom-up, which is O(n). Searches remain
+ * correct however far the points move, but become less efficient as the
+ * bounds of nodes grow and overlap. The tree is therefore rebuilt if its
+ * cost (see _tree_cost()) has grown by more than options.refit_tolerance
+ * since it was last built, or if it cannot be refit (e.g. count changed, or
+ * points were inserted with indices beyond count, see kdtree_insert()).
+ * Grids (see options.index) are always rebuilt, which is cheap, since points
+ * that move must change cells.
+ *
+ *   kdtree *tree = NULL;
+ *   kdtree_build(x, y, z, count, &tree);
+ *   for (...) {
+ *       ... move points ...
+ *       kdtree_refit(x, y, z, count, &tree);
+ *   }
+ *
+ * Returns 1 if the tree was rebuilt, 0 if it was only refit.
+ */
+int kdtree_refit(double *x, double *y, double *z, size_t count,
+                 kdtree **tree_ptr) {
+  kdtree *tree = *tree_ptr;
+  const double *coord[NDIMS];
+
+  if (!tree || tree->mapping || _has_pending(tree) || tree->pending.sparse ||
+      tree->grid.cells > 0 || tree->options.index != KDTREE_INDEX_TREE ||
+      tree->count != count ||
+      tree->layout != tree->options.layout ||
+      tree->index_only != tree->options.index_only ||
+      (tree->node_sums != NULL) != (tree->options.aggregate != 0)) {
+    kdtree_build(x, y, z, count, tree_ptr);
+    return 1;
+  }
+  if (tree->index_only) {
+    tree->points.coord[DIM_X] = x;
+    tree->points.coord[DIM_Y] = y;
+    tree->points.coord[DIM_Z] = z;
+  }
+  tree->weight = tree->options.weight;
+
+  coord[DIM_X] = x;
+  coord[DIM_Y] = y;
+  coord[DIM_Z] = z;
+  _refit_kdtree(0, coord,
+                _resolve_num_threads(tree->options.num_threads), tree);
+
+  tree->cost = _tree_cost(tree);
+  if (tree->cost > tree->build_cost * (1.0 + tree->options.refit_tolerance)) {
+    kdtree_build(x, y, z, count, tree_ptr);
+    return 1;
+  }
+  _index_leaves(tree);
+  return 0;
+}
+
+/* Insert a point with the given index into the tree, without rebuilding it.
+ *
+ * idx identifies the point in search results, and must not be the index of
+ * any other point in the tree. It need not be below the count the tree was
+ * built with, but if it is not, kdtree_refit() will rebuild the tree.
+ * kdtree_search_radius_all() returns a row for every index up to the
+ * largest, whether or not it is in the tree, so rows of removed points and
+ * of indices never inserted are empty. If the tree has weights, they must
+ * cover idx.
+ *
+ * Inserted points are held in a buffer that every search scans in full,
+ * until the number of pending inserts and removals exceeds
+ * options.update_fraction of the points in the tree (or
+ * KDTREE_INSERT_BUFFER_SIZE, whichever is larger). The tree is then rebuilt
+ * with them by kdtree_flush(), reusing its memory where it can. Points
+ * cannot be inserted into index-only trees, and trees loaded by kdtree_load()
+ * cannot be changed at all.
+ */
+void kdtree_insert(kdtree *tree, size_t idx, double x, double y, double z) {
+  struct pending_changes *pending;
+  size_t d;
+
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(!tree->index_only);
+  assert(tree->mapping == NULL);
+  pending = &tree->pending;
+
+  if (pending->inserted_count == pending->inserted_capacity) {
+    pending->inserted_capacity = (pending->inserted_capacity * 2) +
+                                 KDTREE_INSERT_BUFFER_SIZE;
+    for (d = 0; d < NDIMS; d++) {
+      pending->inserted.coord[d] = realloc(pending->inserted.coord[d],
+          sizeof(double) * pending->inserted_capacity);
+      assert(pending->inserted.coord[d] != NULL);
+    }
+    pending->inserted.idx = realloc(pending->inserted.idx,
+                                    sizeof(size_t) *
+                                    pending->inserted_capacity);
+    assert(pending->inserted.idx != NULL);
+  }
+  pending->inserted.coord[DIM_X][pending->inserted_count] = x;
+  pending->inserted.coord[DIM_Y][pending->inserted_count] = y;
+  pending->inserted.coord[DIM_Z][pending->inserted_count] = z;
+  pending->inserted.idx[pending->inserted_count++] = idx;
+  _check_pending(tree);
+}
+
+/* Remove the point with the given index from the tree, without rebuilding
+ * it. The point must be in the tree.
+ *
+ * Points that are still in the insert buffer are removed from it directly.
+ * Others are flagged, and skipped by searches until the tree is next rebuilt
+ * (see kdtree_insert()). The first removal after a build maps each index to
+ * its position in the tree, which takes O(n).
+ */
+void kdtree_remove(kdtree *tree, size_t idx) {
+  struct pending_changes *pending;
+  size_t i, d, last;
+
+  assert(tree != NULL);
+  assert(tree->mapping == NULL);
+  pending = &tree->pending;
+
+  /* search the buffer from the end, as recent inserts are likelier to go */
+  for (i = pending->inserted_count; i-- > 0;) {
+    if (pending->inserted.idx[i] != idx) continue;
+    last = --pending->inserted_count;
+    for (d = 0; d < NDIMS; d++) {
+      pending->inserted.coord[d][i] = pending->inserted.coord[d][last];
+    }
+    pending->inserted.idx[i] = pending->inserted.idx[last];
+    return;
+  }
+
+  if (pending->removed == NULL) _map_positions(tree);
+  assert(idx < pending->index_limit);
+  assert(pending->position[idx] != KDTREE_END);
+  assert(!pending->removed[idx]);
+  pending->removed[idx] = 1;
+  if (pending->removed_count == pending->removed_capacity) {
+    pending->removed_capacity = (pending->removed_capacity * 2) +
+                                KDTREE_INSERT_BUFFER_SIZE;
+    pending->removed_idx = realloc(pending->removed_idx, sizeof(size_t) *
+                                   pending->removed_capacity);
+    assert(pending->removed_idx != NULL);
+  }
+  pending->removed_idx[pending->removed_count++] = idx;
+  _check_pending(tree);
+}
+
+/* Rebuild the tree with any points inserted or removed since it was last
+ * built. This is done automatically once enough changes are pending (see
+ * kdtree_insert()), but may be called at any time, e.g. before a burst of
+ * queries. The remaining points are compacted in place, so memory is only
+ * reallocated if they no longer fit. The tree must keep at least two points.
+ */
+void kdtree_flush(kdtree *tree) {
+  struct pending_changes *pending;
+  struct point_data source;
+  const unsigned char *removed;
+  size_t i, j, d, live, max_idx = 0;
+
+  assert(tree != NULL);
+  if (!_has_pending(tree)) return;
+  pending = &tree->pending;
+  removed = pending->removed;
+  live = tree->count - pending->removed_count + pending->inserted_count;
+  assert(live > 1);
+
+  /* drop removed points, keeping the rest in tree order */
+  for (i = 0, j = 0; i < tree->count; i++) {
+    if (tree->index_only) {
+      if (removed && removed[tree->points.perm[i]]) continue;
+      if (tree->points.perm[i] > max_idx) max_idx = tree->points.perm[i];
+      tree->points.perm[j++] = tree->points.perm[i];
+    } else {
+      if (removed && removed[tree->points.idx[i]]) continue;
+      if (tree->points.idx[i] > max_idx) max_idx = tree->points.idx[i];
+      for (d = 0; d < NDIMS; d++) {
+        tree->points.coord[d][j] = tree->points.coord[d][i];
+      }
+      tree->points.idx[j++] = tree->points.idx[i];
+    }
   }
+  tree->count = j;
 
-  /* build tree and store ptr to root node */
-  tree->root = _build_kdtree(0, count - 1, 0, tree);
+  /* append inserted points */
+  _reserve_points(tree, live, tree->count);
+  for (i = 0; i < pending->inserted_count; i++, j++) {
+    for (d = 0; d < NDIMS; d++) {
+      tree->points.coord[d][j] = pending->inserted.coord[d][i];
+    }
+    tree->points.idx[j] = pending->inserted.idx[i];
+    if (tree->points.idx[j] > max_idx) max_idx = tree->points.idx[j];
+  }
+  tree->count = live;
+  _clear_pending(tree);
+  pending->sparse = (max_idx >= live);
+  source = tree->points;
+  _plan_grid(tree, &source);
+  if (tree->grid.cells > 0) {
+    _grid_arrange(tree, &source);
+  } else if (tree->options.build_method == KDTREE_BUILD_MORTON) {
+    _morton_arrange(tree, &source);
+  }
 
+  _reserve_nodes(tree);
+  if (tree->grid.cells > 0) {
+    _build_grid(tree);
+  } else {
+    _build_kdtree(0, tree->count, 0, 0,
+                  _resolve_num_threads(tree->options.num_threads), tree);
+  }
+  _index_leaves(tree);
+  tree->build_cost = tree->cost = _tree_cost(tree);
 }
 
 /* search tree for points that fall within the 3d cube defined by
@@ -188,6 +974,82 @@ void kdtree_search(kdtree *tree, kdtree_iterator **iter_ptr,
                       z - apothem, z + apothem);
 }
 
+/* search tree for points that fall within the 3d cube of the given apothem
+ * centred on the point with index idx, which must be in the tree. This finds
+ * the same points as kdtree_search() at the coordinates of that point.
+ *
+ * The tree must be built with options.self_search. Rather than descending
+ * from the root, the search starts at the leaf holding the point and climbs
+ * only until the cube lies within the cell of a node (see struct
+ * self_search), so small searches skip most of the descent. Searching for
+ * each point in the order given by kdtree_get_order() visits neighbouring
+ * leaves one after another, which also keeps them in cache.
+ *
+ *   kdtree_get_order(tree, order);
+ *   for (i = 0; i < count; i++) {
+ *       kdtree_search_point(tree, &iter, order[i], apothem);
+ *       ...
+ *   }
+ *
+ * Points inserted since the tree was built, and periodic trees, are searched
+ * from the root.
+ */
+void kdtree_search_point(kdtree *tree, kdtree_iterator **iter_ptr,
+                         size_t idx, double apothem) {
+  const struct self_search *self;
+  const struct pending_changes *pending;
+  kdtree_iterator *iter;
+  struct space search_space;
+  double centre[NDIMS];
+  size_t node = KDTREE_END, i, d, offset, count;
+
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(apothem >= 0.0);
+  self = &tree->self;
+  pending = &tree->pending;
+  assert(self->leaf != NULL); /* not built with options.self_search */
+
+  if (idx < self->index_limit &&
+      !(pending->removed && idx < pending->index_limit &&
+        pending->removed[idx])) {
+    node = self->leaf[idx];
+  }
+  if (node == KDTREE_END) {
+    /* the point must have been inserted since the tree was built */
+    for (i = 0; i < pending->inserted_count; i++) {
+      if (pending->inserted.idx[i] == idx) break;
+    }
+    assert(i < pending->inserted_count);
+    for (d = 0; d < NDIMS; d++) centre[d] = pending->inserted.coord[d][i];
+  } else {
+    _node_points(tree, node, &offset, &count);
+    for (i = offset; _point_index(&tree->points, i) != idx; i++) {
+      assert(i + 1 < offset + count);
+    }
+    for (d = 0; d < NDIMS; d++) centre[d] = _point_coord(&tree->points, d, i);
+  }
+  if (node == KDTREE_END || _is_periodic(tree)) {
+    kdtree_search(tree, iter_ptr, centre[DIM_X], centre[DIM_Y], centre[DIM_Z],
+                  apothem);
+    return;
+  }
+
+  iter = _iterator_prepare(iter_ptr, 0);
+  for (d = 0; d < NDIMS; d++) {
+    search_space.dim[d].min = centre[d] - apothem;
+    search_space.dim[d].max = centre[d] + apothem;
+  }
+
+  /* climb to the lowest node holding every point within the search space */
+  while (node > 0 && !_cell_encloses(&self->cell[node], &search_space)) {
+    STAT_ADD(iter, intersection_tests, 1);
+    node = _parent_node(tree, node);
+  }
+  _search_kdtree(tree, node, &search_space, iter);
+  STAT_TOTAL(tree, iter);
+}
+
 /* search tree for points that fall within the 3d box defined by
  * x_min, x_max, y_min, y_max, z_min, z_max.
  */
@@ -195,22 +1057,35 @@ void kdtree_search_space(kdtree *tree, kdtree_iterator **iter_ptr,
                          double x_min, double x_max,
                          double y_min, double y_max,
                          double z_min, double z_max) {
-  kdtree_iterator *iter = *iter_ptr;
+  kdtree_iterator *iter;
   struct space search_space;
-  struct space domain;
+  struct periodic_query query;
+  size_t d;
 
   /* sanity checks */
   assert(tree != NULL);
   
   /* The tree should have at least one point */
-  assert(tree->root != NULL);
-  assert(!_is_leaf_node(tree->root));
+  assert(tree->count > 0);
 
   /* Either create a new iterator or reset an exisiting one */
-  if (iter != NULL) _iterator_reset(iter);
-  else {
-    iter = _iterator_new();
-    *iter_ptr = iter; /* write back new ptr to obj */
+  iter = _iterator_prepare(iter_ptr, 0);
+
+  /* periodic domains are searched using minimum-image distances from the
+   * centre of the box */
+  if (_is_periodic(tree)) {
+    query.centre[DIM_X] = 0.5 * (x_min + x_max);
+    query.centre[DIM_Y] = 0.5 * (y_min + y_max);
+    query.centre[DIM_Z] = 0.5 * (z_min + z_max);
+    query.half_width[DIM_X] = 0.5 * (x_max - x_min);
+    query.half_width[DIM_Y] = 0.5 * (y_max - y_min);
+    query.half_width[DIM_Z] = 0.5 * (z_max - z_min);
+    for (d = 0; d < NDIMS; d++) query.period[d] = tree->options.period[d];
+    query.is_sphere = 0;
+    if (tree->options.period_images) _iterator_want_images(iter);
+    _periodic_query(tree, &query, iter);
+    STAT_TOTAL(tree, iter);
+    return;
   }
 
   /* define the search space */
@@ -221,130 +1096,1521 @@ void kdtree_search_space(kdtree *tree, kdtree_iterator **iter_ptr,
   search_space.dim[DIM_Z].min = z_min;
   search_space.dim[DIM_Z].max = z_max;
 
-  /* set initial domain to infinite space */
-  domain.dim[DIM_X].min = -DBL_MAX;
-  domain.dim[DIM_X].max =  DBL_MAX;
-  domain.dim[DIM_Y].min = -DBL_MAX;
-  domain.dim[DIM_Y].max =  DBL_MAX;
-  domain.dim[DIM_Z].min = -DBL_MAX;
-  domain.dim[DIM_Z].max =  DBL_MAX;
-
   /* search tree */
-  _search_kdtree(tree, tree->root, 0, &search_space, &domain, iter);
+  if (tree->grid.cells > 0) _search_grid(tree, &search_space, iter);
+  else _search_kdtree(tree, 0, &search_space, iter);
+  STAT_TOTAL(tree, iter);
 }
 
-/* Deallocates a tree object referenced by tree_ptr and sets the ptr to NULL */
-void kdtree_delete(kdtree **tree_ptr) {
-  kdtree *tree = *tree_ptr;
-  if (tree == NULL) return;
-  
-  free(tree->points);
-  free(tree->node_data);
-  free(tree);
-  *tree_ptr = NULL;
-}
+/* Search tree for points within the 3d box defined by x_min, x_max, y_min,
+ * y_max, z_min, z_max, as kdtree_search_space() does, but hold the points
+ * found in a result set rather than an iterator (see kdtree_result_set).
+ * This suits boxes that find a large fraction of the points, where writing
+ * an index per point (and sorting them) dominates the search.
+ *
+ * With KDTREE_SET_BITMAP, the set takes a bit per point in the tree, set for
+ * each point found, so it can be tested with kdtree_result_set_contains() and
+ * is iterated in index order. With KDTREE_SET_RUNS, subtrees enclosed by the
+ * box are held as one run of positions each, as are consecutive points found
+ * in the leaves the box cuts through, and points are iterated in tree order.
+ *
+ *   kdtree_search_space_set(tree, &set, KDTREE_SET_BITMAP, x_min, x_max,
+ *                           y_min, y_max, -DBL_MAX, DBL_MAX);
+ *   while ((idx = kdtree_result_set_get_next(set)) != KDTREE_END) {...}
+ *
+ * Pending changes are accounted for without rebuilding the tree: removed
+ * points are left out, and inserted points found are held as runs of
+ * positions after the end of the tree, which are iterated as the index at
+ * that position of tree->pending.inserted. Not for periodic trees.
+ */
+void kdtree_search_space_set(kdtree *tree, kdtree_result_set **set_ptr,
+                             int mode, double x_min, double x_max,
+                             double y_min, double y_max,
+                             double z_min, double z_max) {
+  kdtree_result_set *set = *set_ptr;
+  struct point_run run;
+  struct space search_space;
+  size_t stack[MAX_DEPTH];
+  size_t top = 0, node = 0, i, offset, count, limit;
+  const struct space *bounds;
+  double x, y, z;
 
-/* returns the next entry in the iteration, or KDTREE_END if the
- * end is reached */
-size_t kdtree_iterator_get_next(kdtree_iterator *iter) {
-  if (iter->current == iter->size) return KDTREE_END;
-  return iter->data[iter->current++];
-}
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(mode == KDTREE_SET_BITMAP || mode == KDTREE_SET_RUNS);
+  assert(!_is_periodic(tree));
 
-/* rewind the iterator */
-void kdtree_iterator_rewind(kdtree_iterator *iter) {
-  assert(iter != NULL);
-  iter->current = 0;
-}
+  /* either create a new set or reset the existing one */
+  if (set == NULL) {
+    set = malloc(sizeof(kdtree_result_set));
+    assert(set != NULL);
+    memset(set, 0, sizeof(kdtree_result_set));
+    *set_ptr = set;
+  }
+  if (set->mode != mode) {
+    free(set->bits);
+    free(set->run_offset);
+    free(set->run_count);
+    set->bits = NULL;
+    set->run_offset = set->run_count = NULL;
+    set->capacity = 0;
+  }
+  set->mode = mode;
+  set->tree = tree;
+  set->size = 0;
+  set->runs = 0;
+  set->words = 0;
+  set->current = 0;
+  set->current_run = 0;
+  _inserted_run(tree, &run);
+  if (mode == KDTREE_SET_BITMAP) {
+    limit = _index_limit(tree);
+    for (i = 0; i < run.count; i++) {
+      if (run.idx[i] >= limit) limit = run.idx[i] + 1;
+    }
+    set->words = (limit + 63) / 64;
+    _set_reserve(set, set->words);
+    memset(set->bits, 0, sizeof(uint64_t) * set->words);
+  }
 
-/* deallocate memory associated with an iterator */
-void kdtree_iterator_delete(kdtree_iterator **iter_ptr) {
-  kdtree_iterator *iter = *iter_ptr;
-  if (iter == NULL) return;
-  
-  free(iter->data);
-  free(iter);
-  *iter_ptr = NULL;
-}
+  search_space.dim[DIM_X].min = x_min;
+  search_space.dim[DIM_X].max = x_max;
+  search_space.dim[DIM_Y].min = y_min;
+  search_space.dim[DIM_Y].max = y_max;
+  search_space.dim[DIM_Z].min = z_min;
+  search_space.dim[DIM_Z].max = z_max;
 
-/* sort entries within the iterator */
-void kdtree_iterator_sort(kdtree_iterator *iter) {
-  qsort(iter->data, iter->size, sizeof(size_t), cmp_size_t);
+  for (;;) {
+    bounds = &tree->node_bounds[node];
+    if (_search_area_intersects(&search_space, bounds)) {
+      if (_completely_enclosed(&search_space, bounds)) {
+        _node_points(tree, node, &offset, &count);
+        _set_add(tree, set, offset, count);
+      } else if (_is_leaf_node(tree, node)) {
+        _node_points(tree, node, &offset, &count);
+        for (; count > 0; offset += run.count, count -= run.count) {
+          _point_run(tree, offset, count, &run);
+          for (i = 0; i < run.count; i++) {
+            x = run.coord[DIM_X][i];
+            y = run.coord[DIM_Y][i];
+            z = run.coord[DIM_Z][i];
+            if ((x >= x_min) & (x <= x_max) & (y >= y_min) & (y <= y_max) &
+                (z >= z_min) & (z <= z_max)) {
+              _set_add(tree, set, offset + i, 1);
+            }
+          }
+        }
+      } else {
+        assert(top < MAX_DEPTH);
+        stack[top++] = _right_child(tree, node);
+        node = _left_child(tree, node);
+        continue;
+      }
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+
+  /* points inserted since the tree was built */
+  _inserted_run(tree, &run);
+  for (i = 0; i < run.count; i++) {
+    x = run.coord[DIM_X][i];
+    y = run.coord[DIM_Y][i];
+    z = run.coord[DIM_Z][i];
+    if (!((x >= x_min) & (x <= x_max) & (y >= y_min) & (y <= y_max) &
+          (z >= z_min) & (z <= z_max))) continue;
+    if (mode == KDTREE_SET_BITMAP) {
+      set->bits[run.idx[i] / 64] |= (uint64_t)1 << (run.idx[i] % 64);
+      set->size++;
+    } else {
+      _set_add_run(set, tree->count + i, 1);
+    }
+  }
 }
 
-/* --------------- INTERNAL ROUTINES ------------------------------- */
+/* search tree for points that are within radius of the point x, y, z.
+ *
+ * Unlike kdtree_search(), this returns only points within the sphere. The
+ * squared distance of each point from x, y, z is stored alongside its index
+ * and can be retrieved using kdtree_iterator_get_next_with_distance().
+ */
+void kdtree_search_radius(kdtree *tree, kdtree_iterator **iter_ptr,
+                          double x, double y, double z, double radius) {
+  kdtree_iterator *iter;
+  struct sphere sphere;
 
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(radius >= 0.0);
 
-/* get pointer to the next available node within the node data cache */
-inline static struct tree_node* _next_node(kdtree *tree) {
-  assert(tree->next_node < tree->max_nodes);
-  return &tree->node_data[tree->next_node++];
-}
+  /* Either create a new iterator or reset an exisiting one */
+  iter = _iterator_prepare(iter_ptr, 1);
+  if (tree->options.period_images && _is_periodic(tree)) {
+    _iterator_want_images(iter);
+  }
+
+  /* define the search space */
+  sphere.centre[DIM_X] = x;
+  sphere.centre[DIM_Y] = y;
+  sphere.centre[DIM_Z] = z;
+  sphere.radius_squared = radius * radius;
 
-/* return a branch node */
-inline static struct tree_node* _get_branch_node(kdtree *tree, double split) {
-  struct tree_node *node = _next_node(tree);
-  node->split = split;
-  return node;
+  /* search tree */
+  _radius_query(tree, &sphere, iter);
+  STAT_TOTAL(tree, iter);
 }
 
-/* return a leaf node. Holds the index of the actual data point */
-inline static struct tree_node* _get_leaf_node(kdtree *tree, size_t offset) {
-  struct tree_node *node = _next_node(tree);
-  node->left = NULL;
-  node->right = NULL;
-  node->idx = offset;
-  return node;
+/* Search the tree for neighbours of many points at once, using the number
+ * of threads set in the tree options.
+ *
+ * For each of the count points in x, y, z, all points in the tree within
+ * radius are found (as with kdtree_search_radius()). Results are returned in
+ * compressed sparse row form: the neighbours of query i are
+ *
+ *   nbr->index[nbr->offset[i]] ... nbr->index[nbr->offset[i + 1] - 1]
+ *
+ * with squared distances in nbr->distance if with_distance is set. Like the
+ * iterator, the neighbours object referenced by nbr_ptr is created if NULL or
+ * its memory reused if not.
+ */
+void kdtree_search_radius_batch(kdtree *tree, kdtree_neighbours **nbr_ptr,
+                                const double *x, const double *y,
+                                const double *z, size_t count,
+                                double radius, int with_distance) {
+  const double *coord[NDIMS];
+  coord[DIM_X] = x;
+  coord[DIM_Y] = y;
+  coord[DIM_Z] = z;
+  assert(radius >= 0.0);
+  _batch_query(tree, nbr_ptr, coord, NULL, count, count, radius * radius, 0,
+               with_distance);
 }
 
-#ifndef _DEBUG_MODE
-/* determine if a node is a leaf node */
-inline static int _is_leaf_node(const struct tree_node *node) {
-  return ((node->left == NULL) && (node->right == NULL));
+/* Search the tree for neighbours of every point in the tree.
+ *
+ * This is equivalent to calling kdtree_search_radius_batch() with the arrays
+ * that the tree was built from, with row i of the result holding the
+ * neighbours of point i (which includes point i itself). Queries are issued
+ * in tree order so that consecutive searches visit the same parts of the tree.
+ *
+ * There is a row for every index up to the largest in the tree, so nbr->count
+ * is one more than that. Rows of indices that are not in the tree, such as
+ * removed points, are empty. Pending inserts and removals are searched as by
+ * kdtree_search_radius(), without rebuilding the tree.
+ */
+void kdtree_search_radius_all(kdtree *tree, kdtree_neighbours **nbr_ptr,
+                              double radius, int with_distance) {
+  const struct pending_changes *pending;
+  size_t i, rows;
+
+  assert(tree != NULL);
+  assert(radius >= 0.0);
+  pending = &tree->pending;
+  rows = _index_limit(tree);
+  for (i = 0; i < pending->inserted_count; i++) {
+    if (pending->inserted.idx[i] >= rows) rows = pending->inserted.idx[i] + 1;
+  }
+  _batch_query(tree, nbr_ptr, NULL, &tree->points,
+               tree->count + pending->inserted_count, rows, radius * radius,
+               0, with_distance);
 }
-#endif
 
-/* returns true if point is within search space */
-inline static int _point_in_search_space(const struct data_point *point,
-                                         const struct space *search_space) {
-  return ((point->x <= search_space->dim[DIM_X].max) &&
-          (point->x >= search_space->dim[DIM_X].min) &&
+/* search tree for the k points nearest to x, y, z.
+ *
+ * The points are returned nearest-first, with the squared distance of each
+ * from x, y, z stored alongside its index (as with kdtree_search_radius()).
+ * If the tree holds fewer than k points, all of them are returned. Points
+ * at the same distance as the kth nearest may be returned in any order, so
+ * which of them are included is arbitrary. Not for periodic trees.
+ */
+void kdtree_search_nearest(kdtree *tree, kdtree_iterator **iter_ptr,
+                           double x, double y, double z, size_t k) {
+  kdtree_iterator *iter;
+  struct sphere sphere;
+
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(!_is_periodic(tree));
 
-          (point->y <= search_space->dim[DIM_Y].max) &&
-          (point->y >= search_space->dim[DIM_Y].min) &&
-          
-          (point->z <= search_space->dim[DIM_Z].max) &&
-          (point->z >= search_space->dim[DIM_Z].min));
+  /* Either create a new iterator or reset an exisiting one */
+  iter = _iterator_prepare(iter_ptr, 1);
+
+  /* the search is not limited to any radius */
+  sphere.centre[DIM_X] = x;
+  sphere.centre[DIM_Y] = y;
+  sphere.centre[DIM_Z] = z;
+  sphere.radius_squared = DBL_MAX;
+
+  /* search tree */
+  _nearest_query(tree, &sphere, k, iter);
+  STAT_TOTAL(tree, iter);
 }
 
-/* returns true if domain is completely enclosed within search space */
-inline static int _completely_enclosed(const struct space *search_space,
-                                       const struct space *domain) {
-  return ((domain->dim[DIM_X].min <= search_space->dim[DIM_X].max) &&
-          (domain->dim[DIM_X].min >= search_space->dim[DIM_X].min) &&
-          (domain->dim[DIM_X].max <= search_space->dim[DIM_X].max) &&
-          (domain->dim[DIM_X].max >= search_space->dim[DIM_X].min) &&
-          
-          (domain->dim[DIM_Y].min <= search_space->dim[DIM_Y].max) &&
-          (domain->dim[DIM_Y].min >= search_space->dim[DIM_Y].min) &&
-          (domain->dim[DIM_Y].max <= search_space->dim[DIM_Y].max) &&
-          (domain->dim[DIM_Y].max >= search_space->dim[DIM_Y].min) &&
-          
-          (domain->dim[DIM_Z].min <= search_space->dim[DIM_Z].max) &&
-          (domain->dim[DIM_Z].min >= search_space->dim[DIM_Z].min) &&
-          (domain->dim[DIM_Z].max <= search_space->dim[DIM_Z].max) &&
-          (domain->dim[DIM_Z].max >= search_space->dim[DIM_Z].min));
+/* Search the tree for the k nearest neighbours of many points at once,
+ * using the number of threads set in the tree options.
+ *
+ * Results are returned in compressed sparse row form as with
+ * kdtree_search_radius_batch(), with the neighbours of each query in
+ * nearest-first order. Not for periodic trees.
+ */
+void kdtree_search_nearest_batch(kdtree *tree, kdtree_neighbours **nbr_ptr,
+                                 const double *x, const double *y,
+                                 const double *z, size_t count,
+                                 size_t k, int with_distance) {
+  const double *coord[NDIMS];
+  assert(tree != NULL);
+  assert(!_is_periodic(tree));
+  coord[DIM_X] = x;
+  coord[DIM_Y] = y;
+  coord[DIM_Z] = z;
+  _batch_query(tree, nbr_ptr, coord, NULL, count, count, DBL_MAX, k,
+               with_distance);
 }
 
+/* Deallocates a neighbours object referenced by nbr_ptr and sets the ptr
+ * to NULL */
+void kdtree_neighbours_delete(kdtree_neighbours **nbr_ptr) {
+  kdtree_neighbours *nbr = *nbr_ptr;
+  if (nbr == NULL) return;
 
-/* returns true if search space and domain
+  free(nbr->offset);
+  free(nbr->index);
+  free(nbr->distance);
+  free(nbr);
+  *nbr_ptr = NULL;
+}
+
+/* Call visit(data, idx, distance_squared) for each point within radius of
+ * x, y, z, where distance_squared is that of the point from x, y, z.
  *
- * It is easier to determine if two cubes are completely separate, so
- * we do just that and negate the return value.
+ * This finds the same points as kdtree_search_radius(), but passes them
+ * straight to the caller rather than storing them in an iterator. Points are
+ * visited in no particular order. To have the visitor inlined into the scan
+ * of each leaf, see KDTREE_DEFINE_RADIUS_VISITOR in kdtree.h. Not for
+ * periodic trees.
  */
-inline static int _search_area_intersects(const struct space *search_space,
-                                          const struct space *domain) {
-  return !((search_space->dim[DIM_X].min > domain->dim[DIM_X].max) ||
+void kdtree_visit_radius(kdtree *tree, double x, double y, double z,
+                         double radius, kdtree_visitor visit, void *data) {
+  struct radius_visit args;
+  struct sphere sphere;
+  struct point_run run;
+
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(radius >= 0.0);
+  assert(!_is_periodic(tree));
+
+  args.visit = visit;
+  args.data = data;
+  sphere.centre[DIM_X] = args.centre[DIM_X] = x;
+  sphere.centre[DIM_Y] = args.centre[DIM_Y] = y;
+  sphere.centre[DIM_Z] = args.centre[DIM_Z] = z;
+  sphere.radius_squared = args.radius_squared = radius * radius;
+  _visit_leaves(tree, &sphere, _visit_radius_leaf, &args);
+
+  /* points inserted since the tree was built */
+  _inserted_run(tree, &run);
+  _visit_radius_run(&args, &run, NULL);
+}
+
+/* Call visit(data, tree, offset, count) for each leaf that may hold points
+ * within radius of x, y, z. The leaf holds the points from offset up to
+ * offset + count in tree order (see tree->points), and the visitor must test
+ * each of them against the radius itself.
+ *
+ * The tree is not changed, so leaves still hold any points removed since it
+ * was built. These are flagged in tree->pending.removed (by index, NULL if
+ * none are), and should be skipped by the visitor. Points inserted since are
+ * in no leaf, and are held in tree->pending.inserted (inserted_count of
+ * them). Functions defined by KDTREE_DEFINE_RADIUS_VISITOR handle both.
+ * Not for periodic trees.
+ */
+void kdtree_visit_radius_leaves(kdtree *tree, double x, double y, double z,
+                                double radius, kdtree_leaf_visitor visit,
+                                void *data) {
+  struct sphere sphere;
+
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(radius >= 0.0);
+  assert(!_is_periodic(tree));
+
+  sphere.centre[DIM_X] = x;
+  sphere.centre[DIM_Y] = y;
+  sphere.centre[DIM_Z] = z;
+  sphere.radius_squared = radius * radius;
+  _visit_leaves(tree, &sphere, visit, data);
+}
+
+/* call visit(data, tree, offset, count) for each leaf that may hold points
+ * within sphere (see kdtree_visit_radius_leaves()) */
+static void _visit_leaves(const kdtree *tree, const struct sphere *sphere,
+                          kdtree_leaf_visitor visit, void *data) {
+  size_t stack[MAX_DEPTH];
+  size_t top = 0, node = 0, offset, count;
+
+  for (;;) {
+    if (_distance_to_domain(sphere, &tree->node_bounds[node]) <=
+        sphere->radius_squared) {
+      if (_is_leaf_node(tree, node)) {
+        _node_points(tree, node, &offset, &count);
+        if (count > 0) visit(data, tree, offset, count);
+      } else {
+        assert(top < MAX_DEPTH);
+        stack[top++] = _right_child(tree, node);
+        node = _left_child(tree, node);
+        continue;
+      }
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+}
+
+/* Call visit(data, idx, 0.0) for each point within the 3d box defined by
+ * x_min, x_max, y_min, y_max, z_min, z_max.
+ *
+ * This finds the same points as kdtree_search_space(), but passes them
+ * straight to the caller rather than storing them in an iterator. No
+ * distance is calculated, so 0.0 is passed in its place. Not for periodic
+ * trees.
+ */
+void kdtree_visit_space(kdtree *tree, double x_min, double x_max,
+                        double y_min, double y_max,
+                        double z_min, double z_max,
+                        kdtree_visitor visit, void *data) {
+  struct point_run run;
+  struct space search_space;
+  size_t stack[MAX_DEPTH];
+  size_t top = 0, node = 0, i, offset, count;
+  const struct space *bounds;
+  const unsigned char *removed = tree->pending.removed;
+  double x, y, z;
+  int enclosed;
+
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(!_is_periodic(tree));
+
+  search_space.dim[DIM_X].min = x_min;
+  search_space.dim[DIM_X].max = x_max;
+  search_space.dim[DIM_Y].min = y_min;
+  search_space.dim[DIM_Y].max = y_max;
+  search_space.dim[DIM_Z].min = z_min;
+  search_space.dim[DIM_Z].max = z_max;
+
+  for (;;) {
+    bounds = &tree->node_bounds[node];
+    if (_search_area_intersects(&search_space, bounds)) {
+      enclosed = _completely_enclosed(&search_space, bounds);
+      if (enclosed || _is_leaf_node(tree, node)) {
+        _node_points(tree, node, &offset, &count);
+        for (; count > 0; offset += run.count, count -= run.count) {
+          _point_run(tree, offset, count, &run);
+          for (i = 0; i < run.count; i++) {
+            x = run.coord[DIM_X][i];
+            y = run.coord[DIM_Y][i];
+            z = run.coord[DIM_Z][i];
+            if (removed && removed[run.idx[i]]) continue;
+            if (enclosed || ((x >= x_min) & (x <= x_max) &
+                             (y >= y_min) & (y <= y_max) &
+                             (z >= z_min) & (z <= z_max))) {
+              visit(data, run.idx[i], 0.0);
+            }
+          }
+        }
+      } else {
+        assert(top < MAX_DEPTH);
+        stack[top++] = _right_child(tree, node);
+        node = _left_child(tree, node);
+        continue;
+      }
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+
+  /* points inserted since the tree was built */
+  _inserted_run(tree, &run);
+  for (i = 0; i < run.count; i++) {
+    x = run.coord[DIM_X][i];
+    y = run.coord[DIM_Y][i];
+    z = run.coord[DIM_Z][i];
+    if ((x >= x_min) & (x <= x_max) & (y >= y_min) & (y <= y_max) &
+        (z >= z_min) & (z <= z_max)) {
+      visit(data, run.idx[i], 0.0);
+    }
+  }
+}
+
+/* returns the number of points within the 3d box defined by x_min, x_max,
+ * y_min, y_max, z_min, z_max.
+ *
+ * Subtrees that are completely within the box are counted without visiting
+ * their points, so large boxes are counted much faster than they would be by
+ * kdtree_search_space(). Not for periodic trees, as with the other counts
+ * and aggregates.
+ */
+size_t kdtree_count_space(kdtree *tree, double x_min, double x_max,
+                          double y_min, double y_max,
+                          double z_min, double z_max) {
+  kdtree_aggregate result;
+  struct space search_space;
+
+  search_space.dim[DIM_X].min = x_min;
+  search_space.dim[DIM_X].max = x_max;
+  search_space.dim[DIM_Y].min = y_min;
+  search_space.dim[DIM_Y].max = y_max;
+  search_space.dim[DIM_Z].min = z_min;
+  search_space.dim[DIM_Z].max = z_max;
+  _aggregate_query(tree, &search_space, NULL, &result, 0);
+  return result.count;
+}
+
+/* returns the number of points within radius of x, y, z. As with
+ * kdtree_count_space(), subtrees completely within the sphere are counted
+ * without visiting their points. */
+size_t kdtree_count_radius(kdtree *tree, double x, double y, double z,
+                           double radius) {
+  kdtree_aggregate result;
+  struct sphere sphere;
+
+  assert(radius >= 0.0);
+  sphere.centre[DIM_X] = x;
+  sphere.centre[DIM_Y] = y;
+  sphere.centre[DIM_Z] = z;
+  sphere.radius_squared = radius * radius;
+  _aggregate_query(tree, NULL, &sphere, &result, 0);
+  return result.count;
+}
+
+/* Find the number of points within the 3d box defined by x_min, x_max,
+ * y_min, y_max, z_min, z_max, along with the sum of their coordinates and
+ * weights (see kdtree_options). The centroid of the points is therefore
+ * result->sum[] / result->count.
+ *
+ * The tree must have been built with options.aggregate set, so that the sums
+ * of each subtree are available. Subtrees that are completely within the box
+ * are then accounted for without visiting their points.
+ */
+void kdtree_aggregate_space(kdtree *tree, kdtree_aggregate *result,
+                            double x_min, double x_max,
+                            double y_min, double y_max,
+                            double z_min, double z_max) {
+  struct space search_space;
+
+  search_space.dim[DIM_X].min = x_min;
+  search_space.dim[DIM_X].max = x_max;
+  search_space.dim[DIM_Y].min = y_min;
+  search_space.dim[DIM_Y].max = y_max;
+  search_space.dim[DIM_Z].min = z_min;
+  search_space.dim[DIM_Z].max = z_max;
+  _aggregate_query(tree, &search_space, NULL, result, 1);
+}
+
+/* As kdtree_aggregate_space(), but for points within radius of x, y, z */
+void kdtree_aggregate_radius(kdtree *tree, kdtree_aggregate *result,
+                             double x, double y, double z, double radius) {
+  struct sphere sphere;
+
+  assert(radius >= 0.0);
+  sphere.centre[DIM_X] = x;
+  sphere.centre[DIM_Y] = y;
+  sphere.centre[DIM_Z] = z;
+  sphere.radius_squared = radius * radius;
+  _aggregate_query(tree, NULL, &sphere, result, 1);
+}
+
+/* Find all pairs of points in the tree that are within radius of each other.
+ *
+ * The tree is traversed against itself, visiting pairs of nodes together so
+ * that whole pairs of subtrees can be skipped when their domains are further
+ * apart than radius. Each pair is reported once, with first < second, along
+ * with the squared distance between the points. Like the iterator, the pairs
+ * object referenced by pairs_ptr is created if NULL or its memory reused if
+ * not. Pending inserts and removals are accounted for without rebuilding the
+ * tree (see _join_pending()). Not for periodic trees.
+ */
+void kdtree_self_join(kdtree *tree, kdtree_pairs **pairs_ptr, double radius) {
+  kdtree_pairs *pairs = *pairs_ptr;
+
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(radius >= 0.0);
+  assert(!_is_periodic(tree));
+
+  /* Either create a new pairs object or reset an existing one */
+  if (pairs == NULL) {
+    pairs = malloc(sizeof(kdtree_pairs));
+    assert(pairs != NULL);
+    pairs->capacity = KDTREE_ITERATOR_INITIAL_SIZE;
+    pairs->first = malloc(sizeof(size_t) * pairs->capacity);
+    pairs->second = malloc(sizeof(size_t) * pairs->capacity);
+    pairs->distance = malloc(sizeof(double) * pairs->capacity);
+    assert(pairs->first != NULL);
+    assert(pairs->second != NULL);
+    assert(pairs->distance != NULL);
+    *pairs_ptr = pairs; /* write back new ptr to obj */
+  }
+  pairs->size = 0;
+
+  _join_kdtree(tree, 0, 0, radius * radius, pairs);
+  if (_has_pending(tree)) _join_pending(tree, radius * radius, pairs);
+}
+
+/* Deallocates a pairs object referenced by pairs_ptr and sets the ptr to
+ * NULL */
+void kdtree_pairs_delete(kdtree_pairs **pairs_ptr) {
+  kdtree_pairs *pairs = *pairs_ptr;
+  if (pairs == NULL) return;
+
+  free(pairs->first);
+  free(pairs->second);
+  free(pairs->distance);
+  free(pairs);
+  *pairs_ptr = NULL;
+}
+
+/* Save the tree to a file at path, which kdtree_load() can later map back
+ * into memory without rebuilding. Returns 0 on success, or -1 if the file
+ * could not be written.
+ *
+ * The file holds the points and nodes of the tree exactly as they are in
+ * memory, which contains no pointers. For index-only trees, the coordinates
+ * the tree refers to are saved in their original order, so the loaded tree
+ * does not depend on the caller's arrays. The same goes for the weights of
+ * trees built with options.aggregate. Any inserts and removals must first be
+ * applied with kdtree_flush().
+ */
+int kdtree_save(const kdtree *tree, const char *path) {
+  static const char padding[FILE_ALIGNMENT] = { 0 };
+  struct file_header header;
+  const void *data[NUM_SECTIONS];
+  uint64_t position;
+  size_t i;
+  FILE *file;
+  int ok;
+
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(!_has_pending(tree)); /* see kdtree_flush() */
+  assert(tree->grid.cells == 0); /* grids are not saved */
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+  header.version = KDTREE_FILE_VERSION;
+  header.byte_order = FILE_BYTE_ORDER;
+  header.size_t_bytes = sizeof(size_t);
+  header.layout = tree->layout;
+  header.index_only = tree->index_only;
+  header.aggregate = (tree->node_sums != NULL);
+  header.weighted = (tree->node_sums != NULL && tree->weight != NULL);
+  header.count = tree->count;
+  header.max_nodes = tree->max_nodes;
+  header.leaf_depth = tree->leaf_depth;
+  header.leaf_size = tree->options.leaf_size;
+  header.build_cost = tree->build_cost;
+  header.cost = tree->cost;
+
+  /* lay out the sections one after another */
+  _file_sections(tree, data, header.size);
+  position = sizeof(header);
+  for (i = 0; i < NUM_SECTIONS; i++) {
+    if (header.size[i] == 0) continue;
+    position = (position + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT *
+               FILE_ALIGNMENT;
+    header.offset[i] = position;
+    position += header.size[i];
+  }
+  header.file_size = position;
+
+  file = fopen(path, "wb");
+  if (file == NULL) return -1;
+  ok = (fwrite(&header, sizeof(header), 1, file) == 1);
+  position = sizeof(header);
+  for (i = 0; ok && i < NUM_SECTIONS; i++) {
+    if (header.size[i] == 0) continue;
+    ok = (fwrite(padding, 1, (size_t)(header.offset[i] - position), file) ==
+          (size_t)(header.offset[i] - position)) &&
+         (fwrite(data[i], 1, (size_t)header.size[i], file) ==
+          (size_t)header.size[i]);
+    position = header.offset[i] + header.size[i];
+  }
+  ok = (fclose(file) == 0) && ok;
+  return ok ? 0 : -1;
+}
+
+/* Load a tree saved by kdtree_save(). Returns NULL if the file cannot be
+ * read, or was not written by a compatible version on a compatible host.
+ *
+ * The file is mapped read-only rather than read, so loading takes constant
+ * time, and processes that load the same file share one copy of it in the
+ * page cache. The loaded tree can be searched as usual (its options, such as
+ * num_threads, may be changed). Building or refitting it replaces the
+ * mapping with memory of its own. The file must not be modified while the
+ * tree is in use, and is unmapped by kdtree_delete().
+ */
+kdtree* kdtree_load(const char *path) {
+  struct file_header header;
+  struct stat status;
+  kdtree *tree;
+  char *base;
+  size_t size;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &status) != 0 || status.st_size < (off_t)sizeof(header)) {
+    close(fd);
+    return NULL;
+  }
+  size = (size_t)status.st_size;
+  base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); /* the mapping remains valid */
+  if (base == MAP_FAILED) return NULL;
+
+  memcpy(&header, base, sizeof(header));
+  if (!_valid_header(&header, size)) {
+    munmap(base, size);
+    return NULL;
+  }
+
+  tree = kdtree_create(NULL);
+  tree->mapping = base;
+  tree->mapping_size = size;
+  tree->options.leaf_size = (size_t)header.leaf_size;
+  tree->options.layout = header.layout;
+  tree->options.index_only = header.index_only;
+  tree->options.aggregate = header.aggregate;
+  tree->count = (size_t)header.count;
+  tree->max_nodes = (size_t)header.max_nodes;
+  tree->layout = header.layout;
+  tree->index_only = header.index_only;
+  tree->leaf_depth = (size_t)header.leaf_depth;
+  tree->build_cost = header.build_cost;
+  tree->cost = header.cost;
+  tree->capacity = tree->count;
+  tree->node_capacity = tree->max_nodes;
+
+  /* refer to each section within the mapping */
+  tree->points.coord[DIM_X] = (double*)(base + header.offset[SECTION_X]);
+  tree->points.coord[DIM_Y] = (double*)(base + header.offset[SECTION_Y]);
+  tree->points.coord[DIM_Z] = (double*)(base + header.offset[SECTION_Z]);
+  if (tree->index_only) {
+    tree->points.perm = (uint32_t*)(base + header.offset[SECTION_INDEX]);
+  } else {
+    tree->points.idx = (size_t*)(base + header.offset[SECTION_INDEX]);
+  }
+  if (tree->layout == KDTREE_LAYOUT_POINTER) {
+    tree->node_data = (struct tree_node*)(base +
+                                          header.offset[SECTION_NODES]);
+  }
+  tree->node_bounds = (struct space*)(base + header.offset[SECTION_BOUNDS]);
+  if (header.aggregate) {
+    tree->node_sums = (struct node_sums*)(base +
+                                          header.offset[SECTION_SUMS]);
+  }
+  if (header.weighted) {
+    tree->weight = (const double*)(base + header.offset[SECTION_WEIGHT]);
+  }
+  return tree;
+}
+
+/* Get the order of points within the tree. order[i] is set to the index of
+ * the ith point in tree order, so points that are near each other in space
+ * tend to be near each other in order. order must hold tree->count entries.
+ *
+ * Reordering per-point arrays in this order (see kdtree_apply_order()) makes
+ * the neighbours returned by searches close together in memory. Note that
+ * the tree refers to points by their index, so it has to be rebuilt with the
+ * reordered coordinates.
+ */
+void kdtree_get_order(const kdtree *tree, size_t *order) {
+  size_t i;
+  assert(tree != NULL);
+  assert(!_has_pending(tree));
+  for (i = 0; i < tree->count; i++) order[i] = _point_index(&tree->points, i);
+}
+
+/* Get the order of count points along a Morton (Z-order) curve, without
+ * building a tree. order[i] is set to the index of the ith point along the
+ * curve. Coordinates are quantised to 21 bits within the bounding box of all
+ * points, and the interleaved bits radix sorted. Points with the same code
+ * keep their relative order. This is the order in which trees built with
+ * KDTREE_BUILD_MORTON hold their points.
+ */
+void kdtree_morton_order(const double *x, const double *y, const double *z,
+                         size_t count, size_t *order) {
+  _morton_sort(x, y, z, NULL, count, 1, order);
+}
+
+/* Reorder an array of count elements (each of size bytes) so that element i
+ * is the element previously at order[i], e.g. to put per-point data into the
+ * order given by kdtree_get_order() or kdtree_morton_order().
+ *
+ * If out is NULL, data is reordered in place by following the cycles of the
+ * permutation, which needs only a bit per element of extra memory. Otherwise
+ * the reordered elements are written to out, which must not overlap data.
+ */
+void kdtree_apply_order(const size_t *order, size_t count,
+                        void *data, size_t size, void *out) {
+  unsigned char *bytes = (unsigned char*)data;
+  unsigned char *done, *tmp;
+  size_t i, j, next;
+
+  if (out != NULL) {
+    for (i = 0; i < count; i++) {
+      memcpy((unsigned char*)out + (i * size), bytes + (order[i] * size), size);
+    }
+    return;
+  }
+
+  done = calloc((count / CHAR_BIT) + 1, 1);
+  tmp = malloc(size);
+  assert(done != NULL);
+  assert(tmp != NULL);
+  for (i = 0; i < count; i++) {
+    if (done[i / CHAR_BIT] & (1u << (i % CHAR_BIT))) continue;
+    /* move each element of the cycle starting at i into place */
+    memcpy(tmp, bytes + (i * size), size);
+    for (j = i; (next = order[j]) != i; j = next) {
+      memcpy(bytes + (j * size), bytes + (next * size), size);
+      done[j / CHAR_BIT] |= (unsigned char)(1u << (j % CHAR_BIT));
+    }
+    memcpy(bytes + (j * size), tmp, size);
+    done[j / CHAR_BIT] |= (unsigned char)(1u << (j % CHAR_BIT));
+  }
+  free(tmp);
+  free(done);
+}
+
+/* Create a pair of trees, built with the given options (or the defaults
+ * if options is NULL), for rebuilding in the background while searches
+ * continue. A timestep then looks like:
+ *
+ *   kdtree_buffer_build(buffer, x, y, z, count); (returns straight away)
+ *   ... move the points, search the published tree ...
+ *   kdtree_buffer_publish(buffer);
+ *
+ * with readers on any thread searching whichever tree is published:
+ *
+ *   kdtree *tree = kdtree_buffer_acquire(buffer);
+ *   if (tree) kdtree_search_radius(tree, &iter, qx, qy, qz, radius);
+ *   kdtree_buffer_release(buffer, tree);
+ *
+ * Both trees take the memory that one tree would, plus a snapshot of the
+ * coordinates each (24 bytes per point).
+ */
+kdtree_buffer* kdtree_buffer_create(const kdtree_options *options) {
+  kdtree_buffer *buffer = malloc(sizeof(kdtree_buffer));
+  assert(buffer != NULL);
+
+  memset(buffer, 0, sizeof(kdtree_buffer));
+  buffer->tree[0] = kdtree_create(options);
+  buffer->tree[1] = kdtree_create(options);
+  buffer->front = 0;
+  buffer->state = BUFFER_IDLE;
+  pthread_mutex_init(&buffer->lock, NULL);
+  pthread_cond_init(&buffer->changed, NULL);
+  return buffer;
+}
+
+/* Start rebuilding the back tree of buffer over the given points, on a
+ * background thread (or before returning, if no thread can be created).
+ * The coordinates are copied first, so the caller may move the points as
+ * soon as this returns. Returns 0 if the build was started, or -1 if a
+ * previous build has yet to be published.
+ *
+ * Readers still holding the back tree (acquired before the last
+ * kdtree_buffer_publish()) are waited for before it is rebuilt. The
+ * trees' options.weight array must be left unchanged, as for
+ * kdtree_build(). Builds and publishes should be made from one thread.
+ */
+int kdtree_buffer_build(kdtree_buffer *buffer, const double *x,
+                        const double *y, const double *z, size_t count) {
+  const double *coord[3];
+  int back;
+  size_t d;
+
+  assert(buffer != NULL);
+  assert(count > 1);
+
+  pthread_mutex_lock(&buffer->lock);
+  if (buffer->state != BUFFER_IDLE) {
+    pthread_mutex_unlock(&buffer->lock);
+    return -1;
+  }
+  back = 1 - buffer->front;
+  while (buffer->readers[back] > 0) {
+    pthread_cond_wait(&buffer->changed, &buffer->lock);
+  }
+  buffer->state = BUFFER_BUILDING;
+  pthread_mutex_unlock(&buffer->lock);
+
+  /* snapshot the coordinates */
+  coord[DIM_X] = x;
+  coord[DIM_Y] = y;
+  coord[DIM_Z] = z;
+  if (count > buffer->snapshot_capacity[back]) {
+    buffer->snapshot_capacity[back] =
+        _grow_capacity(buffer->snapshot_capacity[back], count);
+    for (d = 0; d < NDIMS; d++) {
+      free(buffer->snapshot[back][d]);
+      buffer->snapshot[back][d] =
+          malloc(sizeof(double) * buffer->snapshot_capacity[back]);
+      assert(buffer->snapshot[back][d] != NULL);
+    }
+  }
+  for (d = 0; d < NDIMS; d++) {
+    memcpy(buffer->snapshot[back][d], coord[d], sizeof(double) * count);
+  }
+  buffer->count = count;
+
+  if (pthread_create(&buffer->thread, NULL, _buffer_build_task,
+                     buffer) == 0) {
+    buffer->joinable = 1;
+  } else {
+    /* could not create thread. Build before returning */
+    _buffer_build_task(buffer);
+  }
+  return 0;
+}
+
+/* Returns 1 if buffer has no build in progress, so that
+ * kdtree_buffer_wait() and kdtree_buffer_publish() would not block, or 0
+ * if it is still building */
+int kdtree_buffer_poll(kdtree_buffer *buffer) {
+  int done;
+  assert(buffer != NULL);
+  pthread_mutex_lock(&buffer->lock);
+  done = (buffer->state != BUFFER_BUILDING);
+  pthread_mutex_unlock(&buffer->lock);
+  return done;
+}
+
+/* Wait for the build in progress in buffer, if any, to finish */
+void kdtree_buffer_wait(kdtree_buffer *buffer) {
+  assert(buffer != NULL);
+  if (buffer->joinable) {
+    pthread_join(buffer->thread, NULL);
+    buffer->joinable = 0;
+  }
+}
+
+/* Swap the trees of buffer once the build in progress has finished
+ * (waiting for it if need be), so that kdtree_buffer_acquire() returns the
+ * newly built tree. Readers holding the previous tree may go on searching
+ * it until they release it. Returns 1 if a new tree was published, or 0 if
+ * there was no build to publish.
+ */
+int kdtree_buffer_publish(kdtree_buffer *buffer) {
+  kdtree_buffer_wait(buffer);
+  pthread_mutex_lock(&buffer->lock);
+  if (buffer->state != BUFFER_BUILT) {
+    pthread_mutex_unlock(&buffer->lock);
+    return 0;
+  }
+  buffer->front = 1 - buffer->front;
+  buffer->published = 1;
+  buffer->state = BUFFER_IDLE;
+  pthread_mutex_unlock(&buffer->lock);
+  return 1;
+}
+
+/* Returns the tree published by buffer (NULL if none has been yet), which
+ * stays valid until it is passed to kdtree_buffer_release(). Any number of
+ * readers may search it at once, but must not change it (by inserting,
+ * removing, refitting or rebuilding points).
+ */
+kdtree* kdtree_buffer_acquire(kdtree_buffer *buffer) {
+  kdtree *tree = NULL;
+  assert(buffer != NULL);
+  pthread_mutex_lock(&buffer->lock);
+  if (buffer->published) {
+    buffer->readers[buffer->front]++;
+    tree = buffer->tree[buffer->front];
+  }
+  pthread_mutex_unlock(&buffer->lock);
+  return tree;
+}
+
+/* Release a tree returned by kdtree_buffer_acquire(). Releasing NULL has
+ * no effect */
+void kdtree_buffer_release(kdtree_buffer *buffer, kdtree *tree) {
+  int i;
+  assert(buffer != NULL);
+  if (tree == NULL) return;
+  pthread_mutex_lock(&buffer->lock);
+  i = (tree == buffer->tree[0]) ? 0 : 1;
+  assert(tree == buffer->tree[i] && buffer->readers[i] > 0);
+  if (--buffer->readers[i] == 0) pthread_cond_broadcast(&buffer->changed);
+  pthread_mutex_unlock(&buffer->lock);
+}
+
+/* Deallocates buffer and both its trees, once any build in progress has
+ * finished, and sets the ptr to NULL. No tree may still be acquired */
+void kdtree_buffer_delete(kdtree_buffer **buffer_ptr) {
+  kdtree_buffer *buffer = *buffer_ptr;
+  size_t i, d;
+  if (buffer == NULL) return;
+
+  kdtree_buffer_wait(buffer);
+  assert(buffer->readers[0] == 0 && buffer->readers[1] == 0);
+  for (i = 0; i < 2; i++) {
+    kdtree_delete(&buffer->tree[i]);
+    for (d = 0; d < NDIMS; d++) free(buffer->snapshot[i][d]);
+  }
+  pthread_mutex_destroy(&buffer->lock);
+  pthread_cond_destroy(&buffer->changed);
+  free(buffer);
+  *buffer_ptr = NULL;
+}
+
+/* Deallocates a tree object referenced by tree_ptr and sets the ptr to NULL */
+void kdtree_delete(kdtree **tree_ptr) {
+  kdtree *tree = *tree_ptr;
+  if (tree == NULL) return;
+  
+  _unmap(tree);
+  _free_points(tree);
+  _free_pending(tree);
+  free(tree->node_data);
+  free(tree->node_bounds);
+  free(tree->node_sums);
+  _free_self(tree);
+  free(tree->grid.leaf);
+  free(tree);
+  *tree_ptr = NULL;
+}
+
+#ifdef KDTREE_STATS
+/* zero the search totals held by the tree. Totals are accumulated after
+ * each search without locking, so they are only approximate if searches
+ * are run on the tree from several threads at once (batch searches are
+ * accounted for after their threads have finished) */
+void kdtree_stats_reset(kdtree *tree) {
+  assert(tree != NULL);
+  memset(&tree->stats.search, 0, sizeof(kdtree_search_stats));
+}
+#endif
+
+/* returns the next entry in the iteration, or KDTREE_END if the
+ * end is reached */
+size_t kdtree_iterator_get_next(kdtree_iterator *iter) {
+  if (iter->current == iter->size) return KDTREE_END;
+  return iter->data[iter->current++];
+}
+
+/* returns the next entry in the iteration, or KDTREE_END if the end is
+ * reached. For iterators populated by kdtree_search_radius() or
+ * kdtree_search_nearest(), the squared distance of the point from the centre
+ * of the search is written to distance_squared. */
+size_t kdtree_iterator_get_next_with_distance(kdtree_iterator *iter,
+                                              double *distance_squared) {
+  assert(iter->with_distance);
+  if (iter->current == iter->size) return KDTREE_END;
+  *distance_squared = iter->distance[iter->current];
+  return iter->data[iter->current++];
+}
+
+/* returns the next entry in the iteration, or KDTREE_END if the end is
+ * reached. For iterators populated by searches of a periodic tree with
+ * options.period_images set, the image of the point that was found is
+ * written to image: the point plus image[d] * period[d] along each axis is
+ * the image nearest to the centre of the search. The squared distance of
+ * that image is written to distance_squared, unless it is NULL (which it
+ * must be for box searches). */
+size_t kdtree_iterator_get_next_with_image(kdtree_iterator *iter,
+                                           double *distance_squared,
+                                           int image[3]) {
+  assert(iter->with_image);
+  assert(distance_squared == NULL || iter->with_distance);
+  if (iter->current == iter->size) return KDTREE_END;
+  if (distance_squared) *distance_squared = iter->distance[iter->current];
+  image[DIM_X] = iter->image[(NDIMS * iter->current) + DIM_X];
+  image[DIM_Y] = iter->image[(NDIMS * iter->current) + DIM_Y];
+  image[DIM_Z] = iter->image[(NDIMS * iter->current) + DIM_Z];
+  return iter->data[iter->current++];
+}
+
+/* rewind the iterator */
+void kdtree_iterator_rewind(kdtree_iterator *iter) {
+  assert(iter != NULL);
+  iter->current = 0;
+}
+
+/* deallocate memory associated with an iterator */
+void kdtree_iterator_delete(kdtree_iterator **iter_ptr) {
+  kdtree_iterator *iter = *iter_ptr;
+  if (iter == NULL) return;
+  
+  free(iter->data);
+  free(iter->distance);
+  free(iter->image);
+  free(iter);
+  *iter_ptr = NULL;
+}
+
+/* sort entries within the iterator. Distances and images are kept with
+ * their entries */
+void kdtree_iterator_sort(kdtree_iterator *iter) {
+  struct entry { size_t idx; double distance; int image[3]; } *entries;
+  size_t i, d;
+
+  if (!iter->with_distance && !iter->with_image) {
+    qsort(iter->data, iter->size, sizeof(size_t), cmp_size_t);
+    return;
+  }
+
+  /* sort copies of index/distance pairs then write them back. idx is the
+   * first member so cmp_size_t can be used on the entries */
+  entries = malloc(sizeof(struct entry) * (iter->size + 1));
+  assert(entries != NULL);
+  for (i = 0; i < iter->size; i++) {
+    entries[i].idx = iter->data[i];
+    if (iter->with_distance) entries[i].distance = iter->distance[i];
+    for (d = 0; iter->with_image && d < NDIMS; d++) {
+      entries[i].image[d] = iter->image[(NDIMS * i) + d];
+    }
+  }
+  qsort(entries, iter->size, sizeof(struct entry), cmp_size_t);
+  for (i = 0; i < iter->size; i++) {
+    iter->data[i] = entries[i].idx;
+    if (iter->with_distance) iter->distance[i] = entries[i].distance;
+    for (d = 0; iter->with_image && d < NDIMS; d++) {
+      iter->image[(NDIMS * i) + d] = entries[i].image[d];
+    }
+  }
+  free(entries);
+}
+
+/* returns true if the point with index idx was found. The set must be a
+ * bitmap */
+int kdtree_result_set_contains(const kdtree_result_set *set, size_t idx) {
+  assert(set != NULL && set->mode == KDTREE_SET_BITMAP);
+  if (idx / 64 >= set->words) return 0;
+  return (int)((set->bits[idx / 64] >> (idx % 64)) & 1);
+}
+
+/* returns the index of the next point in the set, or KDTREE_END if the end
+ * is reached. Bitmaps skip a word of 64 indices at a time where no point was
+ * found */
+size_t kdtree_result_set_get_next(kdtree_result_set *set) {
+  const kdtree *tree = (const kdtree*)set->tree;
+  size_t word, offset;
+  uint64_t bits;
+
+  if (set->mode == KDTREE_SET_BITMAP) {
+    word = set->current / 64;
+    if (word >= set->words) return KDTREE_END;
+    bits = set->bits[word] & (~(uint64_t)0 << (set->current % 64));
+    while (bits == 0) {
+      if (++word == set->words) {
+        set->current = word * 64;
+        return KDTREE_END;
+      }
+      bits = set->bits[word];
+    }
+    set->current = (word * 64) + _lowest_bit(bits) + 1;
+    return set->current - 1;
+  }
+
+  if (set->current_run == set->runs) return KDTREE_END;
+  offset = set->run_offset[set->current_run] + set->current;
+  if (++set->current == set->run_count[set->current_run]) {
+    set->current = 0;
+    set->current_run++;
+  }
+  if (offset >= tree->count) {
+    return tree->pending.inserted.idx[offset - tree->count];
+  }
+  return _point_index(&tree->points, offset);
+}
+
+/* rewind the result set */
+void kdtree_result_set_rewind(kdtree_result_set *set) {
+  assert(set != NULL);
+  set->current = 0;
+  set->current_run = 0;
+}
+
+/* deallocate memory associated with a result set */
+void kdtree_result_set_delete(kdtree_result_set **set_ptr) {
+  kdtree_result_set *set = *set_ptr;
+  if (set == NULL) return;
+
+  free(set->bits);
+  free(set->run_offset);
+  free(set->run_count);
+  free(set);
+  *set_ptr = NULL;
+}
+
+/* --------------- INTERNAL ROUTINES ------------------------------- */
+
+
+/* Set run to the points from offset (in tree order), up to count of them.
+ * Returns the number of points in the run, which for index-only trees may be
+ * fewer than count. */
+inline static size_t _point_run(const kdtree *tree, size_t offset,
+                                size_t count, struct point_run *run) {
+  size_t d, i;
+
+  if (!tree->index_only) {
+    for (d = 0; d < NDIMS; d++) run->coord[d] = tree->points.coord[d] + offset;
+    run->idx = tree->points.idx + offset;
+    run->count = count;
+    return count;
+  }
+
+  if (count > KDTREE_GATHER_SIZE) count = KDTREE_GATHER_SIZE;
+  for (i = 0; i < count; i++) {
+    run->idx_buffer[i] = tree->points.perm[offset + i];
+  }
+  for (d = 0; d < NDIMS; d++) {
+    for (i = 0; i < count; i++) {
+      run->coord_buffer[d][i] = tree->points.coord[d][run->idx_buffer[i]];
+    }
+    run->coord[d] = run->coord_buffer[d];
+  }
+  run->idx = run->idx_buffer;
+  run->count = count;
+  return count;
+}
+
+/* returns the original index of the point at position i in tree order */
+inline static size_t _point_index(const struct point_data *points, size_t i) {
+  return points->perm ? points->perm[i] : points->idx[i];
+}
+
+/* returns coordinate d of the point at position i in tree order */
+inline static double _point_coord(const struct point_data *points, size_t d,
+                                  size_t i) {
+  return points->perm ? points->coord[d][points->perm[i]]
+                      : points->coord[d][i];
+}
+
+/* deallocate the points of a tree. For index-only trees the coordinates
+ * belong to the caller, so only the permutation is freed */
+static void _free_points(kdtree *tree) {
+  size_t d;
+  if (!tree->index_only) free(tree->points.coord[DIM_X]);
+  free(tree->points.idx);
+  free(tree->points.perm);
+  for (d = 0; d < NDIMS; d++) tree->points.coord[d] = NULL;
+  tree->points.idx = NULL;
+  tree->points.perm = NULL;
+}
+
+/* Nodes are referred to by their position in the tree's node arrays, with
+ * the root at 0. In the pointer layout, nodes are stored in pre-order so the
+ * left child of a branch immediately follows it, and the remaining links and
+ * point ranges are held in node_data. The implicit layout is a perfect
+ * binary tree stored in level order, so the children of node i are at
+ * 2i + 1 and 2i + 2 and all leaves are at leaf_depth. Its point ranges are
+ * computed from the position of the node (see _split_point()), which leaves
+ * only the bounding box of each node to be stored.
+ */
+
+/* returns the left child of a branch node */
+inline static size_t _left_child(const kdtree *tree, size_t node) {
+  if (tree->layout == KDTREE_LAYOUT_IMPLICIT) return (2 * node) + 1;
+  return node + 1;
+}
+
+/* returns the right child of a branch node */
+inline static size_t _right_child(const kdtree *tree, size_t node) {
+  if (tree->layout == KDTREE_LAYOUT_IMPLICIT) return (2 * node) + 2;
+  return tree->node_data[node].right;
+}
+
+/* returns the parent of a node other than the root. Trees of the pointer
+ * layout only record parents if built with options.self_search */
+inline static size_t _parent_node(const kdtree *tree, size_t node) {
+  if (tree->layout == KDTREE_LAYOUT_IMPLICIT) return (node - 1) / 2;
+  return tree->self.parent[node];
+}
+
+/* get the offset and number of the points covered by a node */
+inline static void _node_points(const kdtree *tree, size_t node,
+                                size_t *offset, size_t *count) {
+  size_t depth, position, end;
+  if (tree->layout == KDTREE_LAYOUT_IMPLICIT) {
+    depth = tree->leaf_depth;
+    position = node + 1;
+    if (position < ((size_t)1 << depth)) depth = _floor_log2(position);
+    position -= (size_t)1 << depth;
+    *offset = _split_point(tree->count, depth, position);
+    end = _split_point(tree->count, depth, position + 1);
+    *count = end - *offset;
+  } else {
+    *offset = tree->node_data[node].idx;
+    *count = tree->node_data[node].count;
+  }
+}
+
+/* returns the offset of the first point covered by the node at position
+ * within depth of the implicit layout, i.e. floor(position * count / 2^depth).
+ * The nodes at each depth therefore hold equal shares of the points (to
+ * within one), and the children of a node split its points between them.
+ * The product is split up to avoid overflow, and is exact while depth <= 32.
+ */
+inline static size_t _split_point(size_t count, size_t depth, size_t position) {
+  const size_t mask = ((size_t)1 << depth) - 1;
+  return (position * (count >> depth)) +
+         (size_t)(((unsigned long long)position * (count & mask)) >> depth);
+}
+
+/* returns the position of the highest bit set in value (which must not be 0) */
+static size_t _floor_log2(size_t value) {
+  size_t result = 0;
+  while (value >>= 1) result++;
+  return result;
+}
+
+/* set the bounds of a leaf node to the bounding box of its points. Leaves
+ * with no points (possible in the implicit layout when leaf_size is 1) are
+ * given inverted bounds, which do not intersect any search. The sums of the
+ * points are also set if the tree holds them. */
+inline static void _leaf_bounds(const kdtree *tree, size_t node) {
+  struct point_run run;
+  size_t d, i, offset, count;
+  struct space *bounds = &tree->node_bounds[node];
+  struct node_sums *sums = tree->node_sums ? &tree->node_sums[node] : NULL;
+  const double *coord;
+
+  for (d = 0; d < NDIMS; d++) {
+    bounds->dim[d].min = DBL_MAX;
+    bounds->dim[d].max = -DBL_MAX;
+  }
+  if (sums) {
+    for (d = 0; d < NDIMS; d++) sums->sum[d] = 0.0;
+    sums->weight = 0.0;
+  }
+  _node_points(tree, node, &offset, &count);
+  for (; count > 0; offset += run.count, count -= run.count) {
+    _point_run(tree, offset, count, &run);
+    for (d = 0; d < NDIMS; d++) {
+      coord = run.coord[d];
+      for (i = 0; i < run.count; i++) {
+        if (coord[i] < bounds->dim[d].min) bounds->dim[d].min = coord[i];
+        if (coord[i] > bounds->dim[d].max) bounds->dim[d].max = coord[i];
+      }
+    }
+    for (i = 0; sums && i < run.count; i++) {
+      for (d = 0; d < NDIMS; d++) sums->sum[d] += run.coord[d][i];
+      sums->weight += tree->weight ? tree->weight[run.idx[i]] : 1.0;
+    }
+  }
+}
+
+/* set the bounds of a branch node to the union of its children's bounds (and
+ * its sums to the total of theirs) */
+inline static void _branch_bounds(const kdtree *tree, size_t node) {
+  size_t d;
+  struct space *bounds = &tree->node_bounds[node];
+  const struct space *left = &tree->node_bounds[_left_child(tree, node)];
+  const struct space *right = &tree->node_bounds[_right_child(tree, node)];
+
+  for (d = 0; d < NDIMS; d++) {
+    bounds->dim[d].min = (left->dim[d].min < right->dim[d].min) ?
+                         left->dim[d].min : right->dim[d].min;
+    bounds->dim[d].max = (left->dim[d].max > right->dim[d].max) ?
+                         left->dim[d].max : right->dim[d].max;
+  }
+  if (tree->node_sums) {
+    _add_sums(&tree->node_sums[node], &tree->node_sums[_left_child(tree, node)],
+              &tree->node_sums[_right_child(tree, node)]);
+  }
+}
+
+/* set sums to the total of a and b */
+inline static void _add_sums(struct node_sums *sums,
+                             const struct node_sums *a,
+                             const struct node_sums *b) {
+  size_t d;
+  for (d = 0; d < NDIMS; d++) sums->sum[d] = a->sum[d] + b->sum[d];
+  sums->weight = a->weight + b->weight;
+}
+
+/* returns the cost of the tree used to decide when a refit tree should be
+ * rebuilt. This is the sum of the half-perimeters of the bounds of all
+ * nodes, relative to that of the root. As points drift and the bounds of
+ * nodes grow and overlap, the cost increases. Being relative to the root
+ * makes it independent of the overall scale of the points.
+ */
+static double _tree_cost(const kdtree *tree) {
+  size_t i, d;
+  double total = 0.0, root = 0.0;
+  const struct space *bounds;
+
+  for (i = 0; i < tree->max_nodes; i++) {
+    bounds = &tree->node_bounds[i];
+    for (d = 0; d < NDIMS; d++) {
+      /* skip the inverted bounds of empty leaves */
+      if (bounds->dim[d].max < bounds->dim[d].min) break;
+      total += bounds->dim[d].max - bounds->dim[d].min;
+    }
+  }
+  for (d = 0; d < NDIMS; d++) {
+    root += tree->node_bounds[0].dim[d].max - tree->node_bounds[0].dim[d].min;
+  }
+  return (root > 0.0) ? total / root : 0.0;
+}
+
+#ifndef _DEBUG_MODE
+/* determine if a node is a leaf node */
+inline static int _is_leaf_node(const kdtree *tree, size_t node) {
+  if (tree->layout == KDTREE_LAYOUT_IMPLICIT) {
+    return node >= ((size_t)1 << tree->leaf_depth) - 1;
+  }
+  return (tree->node_data[node].right == 0); /* root is no node's child */
+}
+#endif
+
+/* push the points within a leaf bucket that fall within the search space */
+inline static void _filter_leaf(const kdtree *tree, size_t leaf,
+                                const struct space *search_space,
+                                kdtree_iterator *iter) {
+  struct point_run run;
+  size_t offset, count;
+
+  _node_points(tree, leaf, &offset, &count);
+  _iterator_reserve(iter, count);
+  STAT_ADD(iter, leaves_tested, 1);
+  STAT_ADD(iter, points_tested, count);
+  for (; count > 0; offset += run.count, count -= run.count) {
+    _point_run(tree, offset, count, &run);
+    _filter_run(&run, search_space, iter);
+  }
+}
+
+/* push the points of a run that fall within the search space. There must
+ * be space reserved in the iterator for all of them.
+ *
+ * Coordinates of points in a run are contiguous along each axis, so the
+ * box test is vectorised where possible. Every point is written to the
+ * iterator but the write position is only advanced for points that pass,
+ * which keeps the scan free of branches.
+ */
+inline static void _filter_run(const struct point_run *run,
+                               const struct space *search_space,
+                               kdtree_iterator *iter) {
+  const double *x = run->coord[DIM_X];
+  const double *y = run->coord[DIM_Y];
+  const double *z = run->coord[DIM_Z];
+  const size_t *idx = run->idx;
+  const size_t end = run->count;
+  const double x_min = search_space->dim[DIM_X].min;
+  const double x_max = search_space->dim[DIM_X].max;
+  const double y_min = search_space->dim[DIM_Y].min;
+  const double y_max = search_space->dim[DIM_Y].max;
+  const double z_min = search_space->dim[DIM_Z].min;
+  const double z_max = search_space->dim[DIM_Z].max;
+  size_t i = 0;
+  size_t *out;
+  size_t n = 0;
+#if defined(KDTREE_SIMD_AVX)
+  __m256d v, mask;
+  int bits;
+  const __m256d vx_min = _mm256_set1_pd(x_min);
+  const __m256d vx_max = _mm256_set1_pd(x_max);
+  const __m256d vy_min = _mm256_set1_pd(y_min);
+  const __m256d vy_max = _mm256_set1_pd(y_max);
+  const __m256d vz_min = _mm256_set1_pd(z_min);
+  const __m256d vz_max = _mm256_set1_pd(z_max);
+#elif defined(KDTREE_SIMD_SSE2)
+  __m128d v, mask;
+  int bits;
+  const __m128d vx_min = _mm_set1_pd(x_min);
+  const __m128d vx_max = _mm_set1_pd(x_max);
+  const __m128d vy_min = _mm_set1_pd(y_min);
+  const __m128d vy_max = _mm_set1_pd(y_max);
+  const __m128d vz_min = _mm_set1_pd(z_min);
+  const __m128d vz_max = _mm_set1_pd(z_max);
+#endif
+
+  out = iter->data + iter->size;
+
+#if defined(KDTREE_SIMD_AVX)
+  for (; i + 4 <= end; i += 4) {
+    v = _mm256_loadu_pd(x + i);
+    mask = _mm256_and_pd(_mm256_cmp_pd(v, vx_min, _CMP_GE_OQ),
+                         _mm256_cmp_pd(v, vx_max, _CMP_LE_OQ));
+    v = _mm256_loadu_pd(y + i);
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(v, vy_min, _CMP_GE_OQ));
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(v, vy_max, _CMP_LE_OQ));
+    v = _mm256_loadu_pd(z + i);
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(v, vz_min, _CMP_GE_OQ));
+    mask = _mm256_and_pd(mask, _mm256_cmp_pd(v, vz_max, _CMP_LE_OQ));
+    bits = _mm256_movemask_pd(mask);
+    out[n] = idx[i];     n += bits & 1;
+    out[n] = idx[i + 1]; n += (bits >> 1) & 1;
+    out[n] = idx[i + 2]; n += (bits >> 2) & 1;
+    out[n] = idx[i + 3]; n += (bits >> 3) & 1;
+  }
+#elif defined(KDTREE_SIMD_SSE2)
+  for (; i + 2 <= end; i += 2) {
+    v = _mm_loadu_pd(x + i);
+    mask = _mm_and_pd(_mm_cmpge_pd(v, vx_min), _mm_cmple_pd(v, vx_max));
+    v = _mm_loadu_pd(y + i);
+    mask = _mm_and_pd(mask, _mm_cmpge_pd(v, vy_min));
+    mask = _mm_and_pd(mask, _mm_cmple_pd(v, vy_max));
+    v = _mm_loadu_pd(z + i);
+    mask = _mm_and_pd(mask, _mm_cmpge_pd(v, vz_min));
+    mask = _mm_and_pd(mask, _mm_cmple_pd(v, vz_max));
+    bits = _mm_movemask_pd(mask);
+    out[n] = idx[i];     n += bits & 1;
+    out[n] = idx[i + 1]; n += (bits >> 1) & 1;
+  }
+#endif
+
+  /* remaining points (or all of them if SIMD is not available) */
+  for (; i < end; i++) {
+    out[n] = idx[i];
+    n += (size_t)((x[i] >= x_min) & (x[i] <= x_max) &
+                  (y[i] >= y_min) & (y[i] <= y_max) &
+                  (z[i] >= z_min) & (z[i] <= z_max));
+  }
+  iter->size += n;
+  STAT_ADD(iter, points_accepted, n);
+}
+
+/* returns true if domain is completely enclosed within search space */
+inline static int _completely_enclosed(const struct space *search_space,
+                                       const struct space *domain) {
+  return ((domain->dim[DIM_X].min <= search_space->dim[DIM_X].max) &&
+          (domain->dim[DIM_X].min >= search_space->dim[DIM_X].min) &&
+          (domain->dim[DIM_X].max <= search_space->dim[DIM_X].max) &&
+          (domain->dim[DIM_X].max >= search_space->dim[DIM_X].min) &&
+          
+          (domain->dim[DIM_Y].min <= search_space->dim[DIM_Y].max) &&
+          (domain->dim[DIM_Y].min >= search_space->dim[DIM_Y].min) &&
+          (domain->dim[DIM_Y].max <= search_space->dim[DIM_Y].max) &&
+          (domain->dim[DIM_Y].max >= search_space->dim[DIM_Y].min) &&
+          
+          (domain->dim[DIM_Z].min <= search_space->dim[DIM_Z].max) &&
+          (domain->dim[DIM_Z].min >= search_space->dim[DIM_Z].min) &&
+          (domain->dim[DIM_Z].max <= search_space->dim[DIM_Z].max) &&
+          (domain->dim[DIM_Z].max >= search_space->dim[DIM_Z].min));
+}
+
+
+/* returns true if search space and domain
+ *
+ * It is easier to determine if two cubes are completely separate, so
+ * we do just that and negate the return value.
+ */
+inline static int _search_area_intersects(const struct space *search_space,
+                                          const struct space *domain) {
+  return !((search_space->dim[DIM_X].min > domain->dim[DIM_X].max) ||
            (search_space->dim[DIM_X].max < domain->dim[DIM_X].min) ||
           
            (search_space->dim[DIM_Y].min > domain->dim[DIM_Y].max) ||
@@ -354,94 +2620,2126 @@ inline static int _search_area_intersects(const struct space *search_space,
            (search_space->dim[DIM_Z].max < domain->dim[DIM_Z].min));
 }
 
-/* add all leaf nodes under a branch to the iterator */
-static void _report_all_leaves(const kdtree *tree,
-                               const struct tree_node *node,
-                               kdtree_iterator *iter) {
-  if (_is_leaf_node(node)) {
-    _iterator_push(iter, tree->points[node->idx].idx);
+/* add all points under a node to the iterator. The points covered by a node
+ * are contiguous, so they are copied in one go */
+inline static void _report_node(const kdtree *tree, size_t node,
+                                kdtree_iterator *iter) {
+  size_t offset, count;
+  _node_points(tree, node, &offset, &count);
+  _report_points(tree, offset, count, iter);
+}
+
+/* add count points from offset in tree order to the iterator */
+inline static void _report_points(const kdtree *tree, size_t offset,
+                                  size_t count, kdtree_iterator *iter) {
+  size_t i, *out;
+  _iterator_reserve(iter, count);
+  if (tree->index_only) {
+    out = iter->data + iter->size;
+    for (i = 0; i < count; i++) out[i] = tree->points.perm[offset + i];
+  } else {
+    memcpy(iter->data + iter->size, tree->points.idx + offset,
+           sizeof(size_t) * count);
+  }
+  iter->size += count;
+}
+
+/* Search the subtree below node for points within a search space.
+ * Results are appended to the iterator object. Points removed since the
+ * tree was built are then dropped, and inserted points scanned.
+ * kdtree_search_point() starts below the root, once it knows that no point
+ * outside node lies within the search space.
+ *
+ * Rather than recursing, the tree is traversed depth-first using a small
+ * stack of nodes that are yet to be visited. The left child of a branch is
+ * visited next while the right one is pushed on the stack, so the stack never
+ * holds more than one node per level.
+ */
+static void _search_kdtree(const kdtree *tree, size_t node,
+                           const struct space *search_space,
+                           kdtree_iterator *iter) {
+  size_t stack[MAX_DEPTH];
+  size_t top = 0;
+  const size_t before = iter->size;
+  const struct space *bounds;
+
+  STAT_ADD(iter, queries, 1);
+  for (;;) {
+    bounds = &tree->node_bounds[node];
+    STAT_ADD(iter, nodes_visited, 1);
+    STAT_ADD(iter, intersection_tests, 1);
+    if (_search_area_intersects(search_space, bounds)) {
+      STAT_ADD(iter, intersection_tests, 1);
+      if (_completely_enclosed(search_space, bounds)) {
+        STAT_ADD(iter, enclosed_subtrees, 1);
+        _report_node(tree, node, iter);
+      } else if (_is_leaf_node(tree, node)) {
+        _filter_leaf(tree, node, search_space, iter);
+      } else {
+        assert(top < MAX_DEPTH);
+        stack[top++] = _right_child(tree, node);
+        node = _left_child(tree, node);
+        continue;
+      }
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+  _search_pending(tree, search_space, iter, before);
+}
+
+/* Search a grid for points within a search space. The range of cells that
+ * the search space overlaps along each axis is found directly. Cells strictly
+ * inside that range lie within the search space, and as cells are stored row
+ * by row, the points of those in each row are reported in one go. The
+ * remaining cells are treated as leaves of _search_kdtree() */
+static void _search_grid(const kdtree *tree,
+                         const struct space *search_space,
+                         kdtree_iterator *iter) {
+  const struct grid *grid = &tree->grid;
+  const size_t before = iter->size;
+  size_t from[NDIMS], to[NDIMS], x, y, z, d, leaf, row;
+  const struct space *bounds;
+  int inner;
+
+  STAT_ADD(iter, queries, 1);
+  for (d = 0; d < NDIMS; d++) {
+    if (search_space->dim[d].max < grid->origin[d]) {
+      _search_pending(tree, search_space, iter, before);
+      return;
+    }
+    from[d] = _grid_index(grid, d, search_space->dim[d].min);
+    to[d] = _grid_index(grid, d, search_space->dim[d].max);
+  }
+  for (z = from[DIM_Z]; z <= to[DIM_Z]; z++) {
+    for (y = from[DIM_Y]; y <= to[DIM_Y]; y++) {
+      row = ((z * grid->dims[DIM_Y]) + y) * grid->dims[DIM_X];
+      inner = (z > from[DIM_Z] && z < to[DIM_Z] &&
+               y > from[DIM_Y] && y < to[DIM_Y]);
+      for (x = from[DIM_X]; x <= to[DIM_X]; x++) {
+        if (inner && x > from[DIM_X] && x < to[DIM_X]) {
+          STAT_ADD(iter, enclosed_subtrees, 1);
+          _report_cells(tree, row + x, row + to[DIM_X], iter);
+          x = to[DIM_X] - 1;
+          continue;
+        }
+        leaf = grid->leaf[row + x];
+        if (leaf == KDTREE_END) continue;
+        bounds = &tree->node_bounds[leaf];
+        STAT_ADD(iter, nodes_visited, 1);
+        STAT_ADD(iter, intersection_tests, 1);
+        if (!_search_area_intersects(search_space, bounds)) continue;
+        STAT_ADD(iter, intersection_tests, 1);
+        if (_completely_enclosed(search_space, bounds)) {
+          STAT_ADD(iter, enclosed_subtrees, 1);
+          _report_node(tree, leaf, iter);
+        } else {
+          _filter_leaf(tree, leaf, search_space, iter);
+        }
+      }
+    }
+  }
+  _search_pending(tree, search_space, iter, before);
+}
+
+/* add the points of the cells of a grid from up to to, which are contiguous,
+ * to the iterator */
+inline static void _report_cells(const kdtree *tree, size_t from, size_t to,
+                                 kdtree_iterator *iter) {
+  const size_t *leaf = tree->grid.leaf;
+  const struct tree_node *last;
+  size_t offset;
+
+  while (from < to && leaf[from] == KDTREE_END) from++;
+  while (to > from && leaf[to - 1] == KDTREE_END) to--;
+  if (from == to) return;
+  offset = tree->node_data[leaf[from]].idx;
+  last = &tree->node_data[leaf[to - 1]];
+  _report_points(tree, offset, last->idx + last->count - offset, iter);
+}
+
+/* apply pending changes to the results of a search from position from of
+ * the iterator onwards: removed points are dropped, and inserted points
+ * within search_space added */
+inline static void _search_pending(const kdtree *tree,
+                                   const struct space *search_space,
+                                   kdtree_iterator *iter, size_t from) {
+  struct point_run run;
+  if (tree->pending.removed) _drop_removed(tree, iter, from);
+  _inserted_run(tree, &run);
+  _iterator_reserve(iter, run.count);
+  _filter_run(&run, search_space, iter);
+}
+
+/* returns true if search_space lies strictly within the cell of a node */
+inline static int _cell_encloses(const struct space *cell,
+                                 const struct space *search_space) {
+  size_t d;
+  for (d = 0; d < NDIMS; d++) {
+    if (search_space->dim[d].min <= cell->dim[d].min ||
+        search_space->dim[d].max >= cell->dim[d].max) return 0;
+  }
+  return 1;
+}
+
+/* returns true if domain is completely within sphere, i.e. the corner of the
+ * domain furthest from its centre is within range */
+inline static int _sphere_encloses(const struct sphere *sphere,
+                                   const struct space *domain) {
+  size_t d;
+  double low, high, total = 0.0;
+  for (d = 0; d < NDIMS; d++) {
+    low = sphere->centre[d] - domain->dim[d].min;
+    high = domain->dim[d].max - sphere->centre[d];
+    total += (low > high) ? low * low : high * high;
+  }
+  return total <= sphere->radius_squared;
+}
+
+/* Count (and if with_sums is set, sum) the points within either a search
+ * space or a sphere, whichever is not NULL.
+ *
+ * The traversal is the same as that of _search_kdtree(), except that the
+ * totals of subtrees which are completely enclosed are taken from the node
+ * rather than visiting their points. Node totals do not reflect pending
+ * inserts and removals, so these are accounted for separately.
+ */
+static void _aggregate_query(const kdtree *tree,
+                             const struct space *search_space,
+                             const struct sphere *sphere,
+                             kdtree_aggregate *result, int with_sums) {
+  struct point_run run;
+  size_t stack[MAX_DEPTH];
+  size_t top = 0, node = 0, i, d, offset, count;
+  const struct space *bounds;
+  double p[NDIMS];
+
+  /* sanity checks */
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(!with_sums || tree->node_sums != NULL);
+  assert(!_is_periodic(tree));
+
+  result->count = 0;
+  for (d = 0; d < NDIMS; d++) result->sum[d] = 0.0;
+  result->weight = 0.0;
+
+  for (;;) {
+    bounds = &tree->node_bounds[node];
+    if (search_space ? _search_area_intersects(search_space, bounds)
+                     : (_distance_to_domain(sphere, bounds) <=
+                        sphere->radius_squared)) {
+      if (search_space ? _completely_enclosed(search_space, bounds)
+                       : _sphere_encloses(sphere, bounds)) {
+        /* take totals from the node */
+        _node_points(tree, node, &offset, &count);
+        result->count += count;
+        if (with_sums) {
+          for (d = 0; d < NDIMS; d++) {
+            result->sum[d] += tree->node_sums[node].sum[d];
+          }
+          result->weight += tree->node_sums[node].weight;
+        }
+      } else if (_is_leaf_node(tree, node)) {
+        /* test points one by one */
+        _node_points(tree, node, &offset, &count);
+        for (; count > 0; offset += run.count, count -= run.count) {
+          _point_run(tree, offset, count, &run);
+          for (i = 0; i < run.count; i++) {
+            for (d = 0; d < NDIMS; d++) p[d] = run.coord[d][i];
+            if (!_aggregate_contains(search_space, sphere, p)) continue;
+            result->count++;
+            if (with_sums) {
+              for (d = 0; d < NDIMS; d++) result->sum[d] += p[d];
+              result->weight += tree->weight ? tree->weight[run.idx[i]] : 1.0;
+            }
+          }
+        }
+      } else {
+        assert(top < MAX_DEPTH);
+        stack[top++] = _right_child(tree, node);
+        node = _left_child(tree, node);
+        continue;
+      }
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+  if (_has_pending(tree)) {
+    _aggregate_pending(tree, search_space, sphere, result, with_sums);
+  }
+}
+
+/* returns true if p is within either a search space or a sphere, whichever
+ * is not NULL */
+inline static int _aggregate_contains(const struct space *search_space,
+                                      const struct sphere *sphere,
+                                      const double p[]) {
+  size_t d;
+  double delta, d2 = 0.0;
+  int inside = 1;
+
+  for (d = 0; d < NDIMS; d++) {
+    if (search_space) {
+      inside &= (p[d] >= search_space->dim[d].min) &
+                (p[d] <= search_space->dim[d].max);
+    } else {
+      delta = p[d] - sphere->centre[d];
+      d2 += delta * delta;
+    }
+  }
+  return search_space ? inside : (d2 <= sphere->radius_squared);
+}
+
+/* correct the totals of _aggregate_query(), which cover the points of the
+ * tree as built, for pending changes: removed points within the query are
+ * taken off, and inserted ones added */
+static void _aggregate_pending(const kdtree *tree,
+                               const struct space *search_space,
+                               const struct sphere *sphere,
+                               kdtree_aggregate *result, int with_sums) {
+  const struct pending_changes *pending = &tree->pending;
+  size_t i, d, idx, position;
+  double p[NDIMS];
+
+  for (i = 0; i < pending->removed_count; i++) {
+    idx = pending->removed_idx[i];
+    position = pending->position[idx];
+    for (d = 0; d < NDIMS; d++) {
+      p[d] = _point_coord(&tree->points, d, position);
+    }
+    if (!_aggregate_contains(search_space, sphere, p)) continue;
+    result->count--;
+    if (with_sums) {
+      for (d = 0; d < NDIMS; d++) result->sum[d] -= p[d];
+      result->weight -= tree->weight ? tree->weight[idx] : 1.0;
+    }
+  }
+  for (i = 0; i < pending->inserted_count; i++) {
+    idx = pending->inserted.idx[i];
+    for (d = 0; d < NDIMS; d++) p[d] = pending->inserted.coord[d][i];
+    if (!_aggregate_contains(search_space, sphere, p)) continue;
+    result->count++;
+    if (with_sums) {
+      for (d = 0; d < NDIMS; d++) result->sum[d] += p[d];
+      result->weight += tree->weight ? tree->weight[idx] : 1.0;
+    }
+  }
+}
+
+/* returns true if any axis of the tree has a periodic boundary */
+static int _is_periodic(const kdtree *tree) {
+  return (tree->options.period[DIM_X] > 0.0) ||
+         (tree->options.period[DIM_Y] > 0.0) ||
+         (tree->options.period[DIM_Z] > 0.0);
+}
+
+/* returns the largest integer not greater than value (for values that fit
+ * in a long long), without depending on libm */
+inline static double _floor(double value) {
+  double truncated = (double)(long long)value;
+  return (truncated > value) ? truncated - 1.0 : truncated;
+}
+
+/* returns the distance along one axis from centre to the nearest image of
+ * the range given by bounds. The centre is first wrapped into the period
+ * starting at bounds->min, so it is either within the range or between its
+ * end and the start of the next image of it. */
+inline static double _periodic_distance(double centre, double period,
+                                        const struct boundaries *bounds) {
+  double above, below;
+  if (period <= 0.0) {
+    if (centre < bounds->min) return bounds->min - centre;
+    return (centre > bounds->max) ? centre - bounds->max : 0.0;
+  }
+  centre -= period * _floor((centre - bounds->min) / period);
+  if (centre <= bounds->max) return 0.0;
+  above = centre - bounds->max;
+  below = bounds->min + period - centre;
+  return (above < below) ? above : below;
+}
+
+/* Search a periodic tree for points whose nearest image lies within the
+ * query (a cube or sphere). Results are appended to the iterator, with
+ * their squared minimum-image distance if the iterator has distances, and
+ * the image that produced each if it has images.
+ *
+ * Wrapping is handled within one traversal: node bounds are tested against
+ * the nearest image of the query along each periodic axis, and points by
+ * their minimum-image displacement, so each point is reported at most once
+ * however many images of the query overlap the domain. Unlike
+ * _search_kdtree(), enclosed subtrees are not reported whole, since their
+ * points may still need an image to be computed.
+ */
+static void _periodic_query(const kdtree *tree,
+                            const struct periodic_query *query,
+                            kdtree_iterator *iter) {
+  struct point_run run;
+  size_t stack[MAX_DEPTH];
+  size_t top = 0, node = 0, d, offset, count;
+  const size_t before = iter->size;
+  const struct space *bounds;
+  double gap, d2;
+  int inside;
+
+  STAT_ADD(iter, queries, 1);
+  for (;;) {
+    bounds = &tree->node_bounds[node];
+    STAT_ADD(iter, nodes_visited, 1);
+    STAT_ADD(iter, intersection_tests, 1);
+    inside = (bounds->dim[DIM_X].min <= bounds->dim[DIM_X].max);
+    for (d = 0, d2 = 0.0; inside && d < NDIMS; d++) {
+      gap = _periodic_distance(query->centre[d], query->period[d],
+                               &bounds->dim[d]);
+      if (query->is_sphere) d2 += gap * gap;
+      else inside = (gap <= query->half_width[d]);
+    }
+    if (query->is_sphere) inside = inside && (d2 <= query->radius_squared);
+
+    if (inside && _is_leaf_node(tree, node)) {
+      _node_points(tree, node, &offset, &count);
+      _iterator_reserve(iter, count);
+      STAT_ADD(iter, leaves_tested, 1);
+      STAT_ADD(iter, points_tested, count);
+      for (; count > 0; offset += run.count, count -= run.count) {
+        _point_run(tree, offset, count, &run);
+        _periodic_filter_run(&run, query, iter);
+      }
+    } else if (inside) {
+      assert(top < MAX_DEPTH);
+      stack[top++] = _right_child(tree, node);
+      node = _left_child(tree, node);
+      continue;
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+
+  /* apply pending removals and inserts */
+  if (tree->pending.removed) _drop_removed(tree, iter, before);
+  _inserted_run(tree, &run);
+  _iterator_reserve(iter, run.count);
+  _periodic_filter_run(&run, query, iter);
+}
+
+/* push the points of a run whose nearest image lies within the query (see
+ * _periodic_query()). There must be space reserved in the iterator for all
+ * of them */
+inline static void _periodic_filter_run(const struct point_run *run,
+                                        const struct periodic_query *query,
+                                        kdtree_iterator *iter) {
+  size_t i, d;
+  double delta[NDIMS], shift[NDIMS], d2;
+  int inside;
+
+  for (i = 0; i < run->count; i++) {
+    d2 = 0.0;
+    inside = 1;
+    for (d = 0; d < NDIMS; d++) {
+      delta[d] = run->coord[d][i] - query->centre[d];
+      shift[d] = 0.0;
+      if (query->period[d] > 0.0) {
+        shift[d] = -_floor((delta[d] / query->period[d]) + 0.5);
+        delta[d] += shift[d] * query->period[d];
+      }
+      d2 += delta[d] * delta[d];
+      if (!query->is_sphere) {
+        inside &= (delta[d] >= -query->half_width[d]) &
+                  (delta[d] <= query->half_width[d]);
+      }
+    }
+    if (query->is_sphere) inside = (d2 <= query->radius_squared);
+    if (!inside) continue;
+    STAT_ADD(iter, points_accepted, 1);
+    if (iter->with_distance) iter->distance[iter->size] = d2;
+    for (d = 0; iter->with_image && d < NDIMS; d++) {
+      iter->image[(NDIMS * iter->size) + d] = (int)shift[d];
+    }
+    iter->data[iter->size++] = run->idx[i];
+  }
+}
+
+/* returns the squared distance from the centre of sphere to the nearest
+ * point of domain (0 if the centre is within the domain) */
+inline static double _distance_to_domain(const struct sphere *sphere,
+                                         const struct space *domain) {
+  size_t d;
+  double delta, total = 0.0;
+  for (d = 0; d < NDIMS; d++) {
+    if (sphere->centre[d] < domain->dim[d].min) {
+      delta = domain->dim[d].min - sphere->centre[d];
+    } else if (sphere->centre[d] > domain->dim[d].max) {
+      delta = sphere->centre[d] - domain->dim[d].max;
+    } else {
+      continue;
+    }
+    total += delta * delta;
+  }
+  return total;
+}
+
+/* push the points within a leaf bucket that fall within the sphere, along
+ * with their squared distance from its centre */
+inline static void _filter_leaf_radius(const kdtree *tree, size_t leaf,
+                                       const struct sphere *sphere,
+                                       kdtree_iterator *iter) {
+  struct point_run run;
+  size_t offset, count;
+
+  _node_points(tree, leaf, &offset, &count);
+  _iterator_reserve(iter, count);
+  STAT_ADD(iter, leaves_tested, 1);
+  STAT_ADD(iter, points_tested, count);
+  for (; count > 0; offset += run.count, count -= run.count) {
+    _point_run(tree, offset, count, &run);
+    _filter_run_radius(&run, sphere, iter);
+  }
+}
+
+/* push the points of a run that fall within the sphere, along with their
+ * squared distance from its centre. As with _filter_run(), the scan is
+ * branch-free and vectorised where possible.
+ */
+inline static void _filter_run_radius(const struct point_run *run,
+                                      const struct sphere *sphere,
+                                      kdtree_iterator *iter) {
+  const double *x = run->coord[DIM_X];
+  const double *y = run->coord[DIM_Y];
+  const double *z = run->coord[DIM_Z];
+  const size_t *idx = run->idx;
+  const size_t end = run->count;
+  const double cx = sphere->centre[DIM_X];
+  const double cy = sphere->centre[DIM_Y];
+  const double cz = sphere->centre[DIM_Z];
+  const double r2 = sphere->radius_squared;
+  size_t i = 0;
+  size_t *out;
+  double *out_distance;
+  double dx, dy, dz, d2;
+  size_t n = 0;
+#if defined(KDTREE_SIMD_AVX)
+  __m256d vd, vd2;
+  double lanes[4];
+  int bits;
+  const __m256d vcx = _mm256_set1_pd(cx);
+  const __m256d vcy = _mm256_set1_pd(cy);
+  const __m256d vcz = _mm256_set1_pd(cz);
+  const __m256d vr2 = _mm256_set1_pd(r2);
+#elif defined(KDTREE_SIMD_SSE2)
+  __m128d vd, vd2;
+  double lanes[2];
+  int bits;
+  const __m128d vcx = _mm_set1_pd(cx);
+  const __m128d vcy = _mm_set1_pd(cy);
+  const __m128d vcz = _mm_set1_pd(cz);
+  const __m128d vr2 = _mm_set1_pd(r2);
+#endif
+
+  out = iter->data + iter->size;
+  out_distance = iter->distance + iter->size;
+
+#if defined(KDTREE_SIMD_AVX)
+  for (; i + 4 <= end; i += 4) {
+    vd = _mm256_sub_pd(_mm256_loadu_pd(x + i), vcx);
+    vd2 = _mm256_mul_pd(vd, vd);
+    vd = _mm256_sub_pd(_mm256_loadu_pd(y + i), vcy);
+    vd2 = _mm256_add_pd(vd2, _mm256_mul_pd(vd, vd));
+    vd = _mm256_sub_pd(_mm256_loadu_pd(z + i), vcz);
+    vd2 = _mm256_add_pd(vd2, _mm256_mul_pd(vd, vd));
+    bits = _mm256_movemask_pd(_mm256_cmp_pd(vd2, vr2, _CMP_LE_OQ));
+    _mm256_storeu_pd(lanes, vd2);
+    out[n] = idx[i];     out_distance[n] = lanes[0]; n += bits & 1;
+    out[n] = idx[i + 1]; out_distance[n] = lanes[1]; n += (bits >> 1) & 1;
+    out[n] = idx[i + 2]; out_distance[n] = lanes[2]; n += (bits >> 2) & 1;
+    out[n] = idx[i + 3]; out_distance[n] = lanes[3]; n += (bits >> 3) & 1;
+  }
+#elif defined(KDTREE_SIMD_SSE2)
+  for (; i + 2 <= end; i += 2) {
+    vd = _mm_sub_pd(_mm_loadu_pd(x + i), vcx);
+    vd2 = _mm_mul_pd(vd, vd);
+    vd = _mm_sub_pd(_mm_loadu_pd(y + i), vcy);
+    vd2 = _mm_add_pd(vd2, _mm_mul_pd(vd, vd));
+    vd = _mm_sub_pd(_mm_loadu_pd(z + i), vcz);
+    vd2 = _mm_add_pd(vd2, _mm_mul_pd(vd, vd));
+    bits = _mm_movemask_pd(_mm_cmple_pd(vd2, vr2));
+    _mm_storeu_pd(lanes, vd2);
+    out[n] = idx[i];     out_distance[n] = lanes[0]; n += bits & 1;
+    out[n] = idx[i + 1]; out_distance[n] = lanes[1]; n += (bits >> 1) & 1;
+  }
+#endif
+
+  /* remaining points (or all of them if SIMD is not available) */
+  for (; i < end; i++) {
+    dx = x[i] - cx;
+    dy = y[i] - cy;
+    dz = z[i] - cz;
+    d2 = (dx * dx) + (dy * dy) + (dz * dz);
+    out[n] = idx[i];
+    out_distance[n] = d2;
+    n += (size_t)(d2 <= r2);
+  }
+  iter->size += n;
+  STAT_ADD(iter, points_accepted, n);
+}
+
+/* Search the tree for points within a sphere, skipping subtrees whose bounds
+ * are further than the radius from its centre. Results are appended to the
+ * iterator object. As with _search_kdtree(), an explicit stack is used
+ * instead of recursion, and pending changes are applied afterwards. Periodic
+ * trees are handed to _periodic_query().
+ */
+static void _radius_query(const kdtree *tree, const struct sphere *sphere,
+                          kdtree_iterator *iter) {
+  struct periodic_query query;
+  struct point_run run;
+  size_t stack[MAX_DEPTH];
+  size_t top = 0, node = 0, d;
+  const size_t before = iter->size;
+
+  if (_is_periodic(tree)) {
+    for (d = 0; d < NDIMS; d++) {
+      query.centre[d] = sphere->centre[d];
+      query.period[d] = tree->options.period[d];
+    }
+    query.radius_squared = sphere->radius_squared;
+    query.is_sphere = 1;
+    _periodic_query(tree, &query, iter);
+    return;
+  }
+
+  STAT_ADD(iter, queries, 1);
+  for (;;) {
+    STAT_ADD(iter, nodes_visited, 1);
+    STAT_ADD(iter, intersection_tests, 1);
+    if (_distance_to_domain(sphere, &tree->node_bounds[node]) <=
+        sphere->radius_squared) {
+      if (_is_leaf_node(tree, node)) {
+        _filter_leaf_radius(tree, node, sphere, iter);
+      } else {
+        assert(top < MAX_DEPTH);
+        stack[top++] = _right_child(tree, node);
+        node = _left_child(tree, node);
+        continue;
+      }
+    }
+    if (top == 0) break;
+    node = stack[--top];
+  }
+
+  /* apply pending removals and inserts */
+  if (tree->pending.removed) _drop_removed(tree, iter, before);
+  _inserted_run(tree, &run);
+  _iterator_reserve(iter, run.count);
+  _filter_run_radius(&run, sphere, iter);
+}
+
+/* Find the k points nearest to the centre of sphere, appending them to iter
+ * in nearest-first order along with their squared distances. Only points
+ * within the radius of sphere are considered.
+ *
+ * The k nearest points found so far are held in a max-heap (keyed on
+ * distance) in the space reserved at the end of the iterator, so the
+ * furthest of them is always at the top. Once the heap is full, subtrees
+ * whose bounds are further away than that point are skipped. At each branch
+ * the nearer child is visited first, with the other pushed on an explicit
+ * stack along with its distance so that it can be skipped if the heap has
+ * since tightened. The heap is finally sorted in place.
+ */
+static void _nearest_query(const kdtree *tree, const struct sphere *sphere,
+                           size_t k, kdtree_iterator *iter) {
+  struct { size_t node; double distance; } stack[MAX_DEPTH];
+  struct point_run run;
+  struct nearest_heap heap;
+  size_t top = 0, node = 0;
+  size_t i, offset, count, near, far, tmp_idx, live;
+  double d2, near_distance, far_distance;
+
+  live = tree->count - tree->pending.removed_count +
+         tree->pending.inserted_count;
+  if (k > live) k = live;
+  if (k == 0) return;
+  _iterator_reserve(iter, k);
+  heap.idx = iter->data + iter->size;
+  heap.distance = iter->distance + iter->size;
+  heap.size = 0;
+  heap.k = k;
+  heap.radius_squared = sphere->radius_squared;
+  heap.accepted = 0;
+
+  /* inserted points are scanned first, which may tighten the heap before
+   * the traversal */
+  STAT_ADD(iter, queries, 1);
+  _inserted_run(tree, &run);
+  _nearest_run(&run, sphere->centre, NULL, &heap);
+  for (;;) {
+    STAT_ADD(iter, nodes_visited, 1);
+    if (_is_leaf_node(tree, node)) {
+      _node_points(tree, node, &offset, &count);
+      STAT_ADD(iter, leaves_tested, 1);
+      STAT_ADD(iter, points_tested, count);
+      for (; count > 0; offset += run.count, count -= run.count) {
+        _point_run(tree, offset, count, &run);
+        _nearest_run(&run, sphere->centre, tree->pending.removed, &heap);
+      }
+    } else {
+      near = _left_child(tree, node);
+      far = _right_child(tree, node);
+      STAT_ADD(iter, intersection_tests, 2);
+      near_distance = _distance_to_domain(sphere, &tree->node_bounds[near]);
+      far_distance = _distance_to_domain(sphere, &tree->node_bounds[far]);
+      if (far_distance < near_distance) {
+        tmp_idx = near; near = far; far = tmp_idx;
+        d2 = near_distance; near_distance = far_distance; far_distance = d2;
+      }
+      if (near_distance <= heap.radius_squared) {
+        if (far_distance <= heap.radius_squared) {
+          assert(top < MAX_DEPTH);
+          stack[top].node = far;
+          stack[top].distance = far_distance;
+          top++;
+        }
+        node = near;
+        continue;
+      }
+    }
+
+    /* resume from the next pending subtree that could still be in range */
+    while (top > 0 && stack[top - 1].distance > heap.radius_squared) top--;
+    if (top == 0) break;
+    node = stack[--top].node;
+  }
+  STAT_ADD(iter, points_accepted, heap.accepted);
+
+  /* sort heap so that points are in nearest-first order */
+  for (i = heap.size; i > 1; i--) {
+    tmp_idx = heap.idx[0];
+    heap.idx[0] = heap.idx[i - 1];
+    heap.idx[i - 1] = tmp_idx;
+    d2 = heap.distance[0];
+    heap.distance[0] = heap.distance[i - 1];
+    heap.distance[i - 1] = d2;
+    _heap_sift_down(heap.idx, heap.distance, i - 1, 0);
+  }
+  iter->size += heap.size;
+}
+
+/* offer the points of a run to the heap of nearest points, skipping any
+ * that are flagged in removed (if not NULL) */
+inline static void _nearest_run(const struct point_run *run,
+                                const double centre[],
+                                const unsigned char *removed,
+                                struct nearest_heap *heap) {
+  size_t i, child;
+  double dx, dy, dz, d2;
+
+  for (i = 0; i < run->count; i++) {
+    dx = run->coord[DIM_X][i] - centre[DIM_X];
+    dy = run->coord[DIM_Y][i] - centre[DIM_Y];
+    dz = run->coord[DIM_Z][i] - centre[DIM_Z];
+    d2 = (dx * dx) + (dy * dy) + (dz * dz);
+    if (d2 > heap->radius_squared) continue;
+    if (removed && removed[run->idx[i]]) continue;
+    heap->accepted++;
+    if (heap->size < heap->k) { /* add to heap and sift up */
+      child = heap->size++;
+      while (child > 0 && heap->distance[(child - 1) / 2] < d2) {
+        heap->idx[child] = heap->idx[(child - 1) / 2];
+        heap->distance[child] = heap->distance[(child - 1) / 2];
+        child = (child - 1) / 2;
+      }
+      heap->idx[child] = run->idx[i];
+      heap->distance[child] = d2;
+      if (heap->size == heap->k) heap->radius_squared = heap->distance[0];
+    } else if (d2 < heap->distance[0]) { /* replace the furthest */
+      heap->idx[0] = run->idx[i];
+      heap->distance[0] = d2;
+      _heap_sift_down(heap->idx, heap->distance, heap->size, 0);
+      heap->radius_squared = heap->distance[0];
+    }
+  }
+}
+
+/* restore the max-heap property of the first size entries of idx/distance
+ * after the entry at i has been replaced */
+inline static void _heap_sift_down(size_t *idx, double *distance,
+                                   size_t size, size_t i) {
+  const size_t top_idx = idx[i];
+  const double top_distance = distance[i];
+  size_t child;
+
+  while ((child = (2 * i) + 1) < size) {
+    if (child + 1 < size && distance[child + 1] > distance[child]) child++;
+    if (distance[child] <= top_distance) break;
+    idx[i] = idx[child];
+    distance[i] = distance[child];
+    i = child;
+  }
+  idx[i] = top_idx;
+  distance[i] = top_distance;
+}
+
+/* leaf visitor used by kdtree_visit_radius() to pass the points of a leaf
+ * that are within range to the user's visitor */
+static void _visit_radius_leaf(void *arg, const kdtree *tree,
+                               size_t offset, size_t count) {
+  const struct radius_visit *args = (const struct radius_visit*)arg;
+  struct point_run run;
+
+  for (; count > 0; offset += run.count, count -= run.count) {
+    _point_run(tree, offset, count, &run);
+    _visit_radius_run(args, &run, tree->pending.removed);
+  }
+}
+
+/* pass the points of a run that are within range to the user's visitor,
+ * skipping any that are flagged in removed (if not NULL) */
+inline static void _visit_radius_run(const struct radius_visit *args,
+                                     const struct point_run *run,
+                                     const unsigned char *removed) {
+  size_t i;
+  double dx, dy, dz, d2;
+
+  for (i = 0; i < run->count; i++) {
+    dx = run->coord[DIM_X][i] - args->centre[DIM_X];
+    dy = run->coord[DIM_Y][i] - args->centre[DIM_Y];
+    dz = run->coord[DIM_Z][i] - args->centre[DIM_Z];
+    d2 = (dx * dx) + (dy * dy) + (dz * dz);
+    if (d2 > args->radius_squared) continue;
+    if (removed && removed[run->idx[i]]) continue;
+    args->visit(args->data, run->idx[i], d2);
+  }
+}
+
+/* Run a batch of queries and store the results in CSR form. These are
+ * nearest neighbour queries if k > 0, otherwise radius queries.
+ *
+ * Queries are either given by coord, or are the points of the tree (see
+ * _batch_query_point(), with the results of each stored in the row of its
+ * original index). There are count queries and rows rows, which are empty
+ * unless a query is stored in them. Queries are handed out to threads in
+ * blocks. Each thread appends results to its own buffer and records the
+ * number of neighbours of each query in offset[row + 1]. A prefix sum then
+ * gives the offset of each row, after which the threads copy their buffers
+ * into place.
+ */
+static void _batch_query(kdtree *tree, kdtree_neighbours **nbr_ptr,
+                         const double *coord[],
+                         const struct point_data *points,
+                         size_t count, size_t rows, double radius_squared,
+                         size_t k, int with_distance) {
+  struct batch_job job;
+  struct batch_worker *workers;
+  pthread_t *threads;
+  kdtree_neighbours *nbr = *nbr_ptr;
+  size_t i, total, num_threads, num_blocks;
+
+  assert(tree != NULL);
+  assert(tree->count > 0);
+  assert(radius_squared >= 0.0);
+
+  /* Either create a new neighbours object or reuse an existing one */
+  if (nbr == NULL) {
+    nbr = malloc(sizeof(kdtree_neighbours));
+    assert(nbr != NULL);
+    nbr->count = 0;
+    nbr->capacity = 0;
+    nbr->offset = NULL;
+    nbr->index = NULL;
+    nbr->distance = NULL;
+    *nbr_ptr = nbr; /* write back new ptr to obj */
+  }
+  if (nbr->count != rows || nbr->offset == NULL) {
+    free(nbr->offset);
+    nbr->offset = malloc(sizeof(size_t) * (rows + 1));
+    assert(nbr->offset != NULL);
+  }
+  nbr->count = rows;
+  memset(nbr->offset, 0, sizeof(size_t) * (rows + 1));
+
+  job.tree = tree;
+  job.coord[DIM_X] = coord ? coord[DIM_X] : NULL;
+  job.coord[DIM_Y] = coord ? coord[DIM_Y] : NULL;
+  job.coord[DIM_Z] = coord ? coord[DIM_Z] : NULL;
+  job.points = points;
+  job.count = count;
+  job.sphere.radius_squared = radius_squared;
+  job.k = k;
+  job.next_block = 0;
+  job.result = nbr;
+  pthread_mutex_init(&job.lock, NULL);
+
+  /* no point having more threads than blocks */
+  num_blocks = (count + KDTREE_BATCH_BLOCK_SIZE - 1) / KDTREE_BATCH_BLOCK_SIZE;
+  num_threads = _resolve_num_threads(tree->options.num_threads);
+  if (num_threads > num_blocks) num_threads = num_blocks;
+  if (num_threads == 0) num_threads = 1;
+
+  workers = malloc(sizeof(struct batch_worker) * num_threads);
+  threads = malloc(sizeof(pthread_t) * num_threads);
+  assert(workers != NULL);
+  assert(threads != NULL);
+  for (i = 0; i < num_threads; i++) {
+    workers[i].job = &job;
+    workers[i].buffer = NULL;
+    _iterator_prepare(&workers[i].buffer, 1);
+    workers[i].blocks = NULL;
+    workers[i].num_blocks = 0;
+    workers[i].blocks_capacity = 0;
+  }
+
+  /* search. Thread 0 is the calling thread */
+  _run_tasks(_batch_search_task, workers, sizeof(struct batch_worker),
+             threads, num_threads);
+
+  /* prefix sum to get offset of each row */
+  for (i = 0; i < rows; i++) nbr->offset[i + 1] += nbr->offset[i];
+  total = nbr->offset[rows];
+
+  /* make sure there is space for all results */
+  if (total > nbr->capacity || (with_distance && nbr->distance == NULL)) {
+    if (total > nbr->capacity) nbr->capacity = total;
+    free(nbr->index);
+    free(nbr->distance);
+    nbr->index = malloc(sizeof(size_t) * (nbr->capacity + 1));
+    assert(nbr->index != NULL);
+    nbr->distance = NULL;
+    if (with_distance) {
+      nbr->distance = malloc(sizeof(double) * (nbr->capacity + 1));
+      assert(nbr->distance != NULL);
+    }
+  }
+  nbr->with_distance = with_distance;
+
+  /* copy results into place */
+  _run_tasks(_batch_merge_task, workers, sizeof(struct batch_worker),
+             threads, num_threads);
+
+  for (i = 0; i < num_threads; i++) {
+    STAT_TOTAL(tree, workers[i].buffer);
+    kdtree_iterator_delete(&workers[i].buffer);
+    free(workers[i].blocks);
+  }
+  pthread_mutex_destroy(&job.lock);
+  free(workers);
+  free(threads);
+}
+
+/* thread entry point for running queries of a batch */
+static void* _batch_search_task(void *arg) {
+  struct batch_worker *worker = (struct batch_worker*)arg;
+  struct batch_job *job = worker->job;
+  kdtree_iterator *buffer = worker->buffer;
+  struct sphere sphere = job->sphere;
+  size_t block, i, end, row, before;
+
+  for (;;) {
+    /* get next block of queries */
+    pthread_mutex_lock(&job->lock);
+    block = job->next_block++;
+    pthread_mutex_unlock(&job->lock);
+    i = block * KDTREE_BATCH_BLOCK_SIZE;
+    if (i >= job->count) break;
+    end = i + KDTREE_BATCH_BLOCK_SIZE;
+    if (end > job->count) end = job->count;
+
+    /* keep track of the blocks processed by this thread */
+    if (worker->num_blocks == worker->blocks_capacity) {
+      worker->blocks_capacity = (worker->blocks_capacity * 2) + 16;
+      worker->blocks = realloc(worker->blocks,
+                               sizeof(size_t) * worker->blocks_capacity);
+      assert(worker->blocks != NULL);
+    }
+    worker->blocks[worker->num_blocks++] = block;
+
+    for (; i < end; i++) {
+      row = _batch_query_point(job, i, sphere.centre);
+      if (row == KDTREE_END) continue;
+      before = buffer->size;
+      if (job->k > 0) _nearest_query(job->tree, &sphere, job->k, buffer);
+      else _radius_query(job->tree, &sphere, buffer);
+      job->result->offset[row + 1] = buffer->size - before;
+    }
+  }
+  return NULL;
+}
+
+/* thread entry point for copying results of a batch into place */
+static void* _batch_merge_task(void *arg) {
+  struct batch_worker *worker = (struct batch_worker*)arg;
+  struct batch_job *job = worker->job;
+  kdtree_neighbours *nbr = job->result;
+  size_t b, i, end, row, n, pos = 0;
+
+  for (b = 0; b < worker->num_blocks; b++) {
+    i = worker->blocks[b] * KDTREE_BATCH_BLOCK_SIZE;
+    end = i + KDTREE_BATCH_BLOCK_SIZE;
+    if (end > job->count) end = job->count;
+    for (; i < end; i++) {
+      row = _batch_query_point(job, i, NULL);
+      if (row == KDTREE_END) continue;
+      n = nbr->offset[row + 1] - nbr->offset[row];
+      memcpy(nbr->index + nbr->offset[row], worker->buffer->data + pos,
+             sizeof(size_t) * n);
+      if (nbr->with_distance) {
+        memcpy(nbr->distance + nbr->offset[row],
+               worker->buffer->distance + pos, sizeof(double) * n);
+      }
+      pos += n;
+    }
+  }
+  return NULL;
+}
+
+/* Returns the row of query i of a batch, and sets centre to its position
+ * unless centre is NULL. Queries of the points of the tree are the points in
+ * tree order followed by any inserted since the tree was built. Removed
+ * points are skipped, returning KDTREE_END */
+inline static size_t _batch_query_point(const struct batch_job *job,
+                                        size_t i, double centre[]) {
+  const struct point_data *points = job->points;
+  const unsigned char *removed = job->tree->pending.removed;
+  size_t d;
+
+  if (points == NULL) {
+    for (d = 0; centre && d < NDIMS; d++) centre[d] = job->coord[d][i];
+    return i;
+  }
+  if (i >= job->tree->count) {
+    points = &job->tree->pending.inserted;
+    i -= job->tree->count;
+  } else if (removed && removed[_point_index(points, i)]) {
+    return KDTREE_END;
+  }
+  for (d = 0; centre && d < NDIMS; d++) {
+    centre[d] = _point_coord(points, d, i);
+  }
+  return _point_index(points, i);
+}
+
+/* returns one more than the largest index of a point in the tree */
+static size_t _index_limit(const kdtree *tree) {
+  size_t i, limit = tree->count;
+  if (!tree->pending.sparse) return limit;
+  for (i = 0; i < tree->count; i++) {
+    if (_point_index(&tree->points, i) >= limit) {
+      limit = _point_index(&tree->points, i) + 1;
+    }
+  }
+  return limit;
+}
+
+/* Run routine on num_threads items of args (each of size arg_size). The
+ * first item is run on the calling thread. Items are run serially if
+ * threads cannot be created. */
+static void _run_tasks(void* (*routine)(void *), void *args, size_t arg_size,
+                       pthread_t *threads, size_t num_threads) {
+  size_t i, started = 1;
+  char *arg = (char*)args;
+
+  for (i = 1; i < num_threads; i++, started++) {
+    if (pthread_create(&threads[i], NULL, routine, arg + (i * arg_size)) != 0) {
+      break;
+    }
+  }
+  routine(arg);
+  for (i = started; i < num_threads; i++) routine(arg + (i * arg_size));
+  for (i = 1; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+/* returns the squared distance between the nearest points of two domains */
+inline static double _domain_distance(const struct space *a,
+                                      const struct space *b) {
+  size_t d;
+  double delta, total = 0.0;
+  for (d = 0; d < NDIMS; d++) {
+    if (a->dim[d].max < b->dim[d].min) {
+      delta = b->dim[d].min - a->dim[d].max;
+    } else if (b->dim[d].max < a->dim[d].min) {
+      delta = a->dim[d].min - b->dim[d].max;
+    } else {
+      continue;
+    }
+    total += delta * delta;
+  }
+  return total;
+}
+
+/* Recursively find pairs of points within range where the first point is
+ * under node a and the second under node b (which may be the same node).
+ *
+ * When a and b are the same node, the pairs are found within each child and
+ * between the two children, so each pair of points is considered once.
+ * Otherwise the node with more points is split until both are leaves.
+ */
+static void _join_kdtree(const kdtree *tree, size_t a, size_t b,
+                         double radius_squared, kdtree_pairs *pairs) {
+  size_t offset, a_count, b_count;
+  const int a_leaf = _is_leaf_node(tree, a);
+  const int b_leaf = _is_leaf_node(tree, b);
+
+  if (_domain_distance(&tree->node_bounds[a], &tree->node_bounds[b]) >
+      radius_squared) {
+    return;
+  }
+
+  if (a == b) {
+    if (a_leaf) {
+      _join_leaf(tree, a, a, radius_squared, pairs);
+    } else {
+      _join_kdtree(tree, _left_child(tree, a), _left_child(tree, a),
+                   radius_squared, pairs);
+      _join_kdtree(tree, _right_child(tree, a), _right_child(tree, a),
+                   radius_squared, pairs);
+      _join_kdtree(tree, _left_child(tree, a), _right_child(tree, a),
+                   radius_squared, pairs);
+    }
+    return;
+  }
+  if (a_leaf && b_leaf) {
+    _join_leaf(tree, a, b, radius_squared, pairs);
+    return;
+  }
+
+  _node_points(tree, a, &offset, &a_count);
+  _node_points(tree, b, &offset, &b_count);
+  if (a_leaf || (!b_leaf && b_count > a_count)) {
+    _join_kdtree(tree, a, _left_child(tree, b), radius_squared, pairs);
+    _join_kdtree(tree, a, _right_child(tree, b), radius_squared, pairs);
+  } else {
+    _join_kdtree(tree, _left_child(tree, a), b, radius_squared, pairs);
+    _join_kdtree(tree, _right_child(tree, a), b, radius_squared, pairs);
+  }
+}
+
+/* append pairs of points in range between two leaf buckets. If a and b are
+ * the same leaf, only pairs within the bucket are considered. The points of
+ * each leaf are taken a run at a time (see _point_run()).
+ */
+inline static void _join_leaf(const kdtree *tree, size_t a, size_t b,
+                              double radius_squared, kdtree_pairs *pairs) {
+  struct point_run run_a, run_b;
+  size_t a_idx, a_count, b_idx, b_count, b_from, b_left;
+
+  _node_points(tree, a, &a_idx, &a_count);
+  _node_points(tree, b, &b_idx, &b_count);
+  _pairs_reserve(pairs, a_count * b_count);
+  for (; a_count > 0; a_idx += run_a.count, a_count -= run_a.count) {
+    _point_run(tree, a_idx, a_count, &run_a);
+    /* within a single leaf, pair each run with itself and later runs */
+    b_from = (a == b) ? a_idx : b_idx;
+    b_left = (a == b) ? a_count : b_count;
+    for (; b_left > 0; b_from += run_b.count, b_left -= run_b.count) {
+      _point_run(tree, b_from, b_left, &run_b);
+      _join_runs(&run_a, &run_b, (a == b) && (b_from == a_idx),
+                 radius_squared, pairs);
+    }
+  }
+}
+
+/* Correct the pairs found by _join_kdtree(), which cover the points of the
+ * tree as built, for pending changes. Pairs with a removed point are dropped
+ * first, as an inserted point may reuse the index of a removed one. Each
+ * inserted point is then paired with the points of the leaves within range
+ * of it, and with the inserted points after it.
+ */
+static void _join_pending(const kdtree *tree, double radius_squared,
+                          kdtree_pairs *pairs) {
+  const unsigned char *removed = tree->pending.removed;
+  struct inserted_join args;
+  struct sphere sphere;
+  struct point_run run;
+  size_t i, d, n = 0;
+
+  for (i = 0; removed && i < pairs->size; i++) {
+    if (removed[pairs->first[i]] || removed[pairs->second[i]]) continue;
+    pairs->first[n] = pairs->first[i];
+    pairs->second[n] = pairs->second[i];
+    pairs->distance[n++] = pairs->distance[i];
+  }
+  if (removed) pairs->size = n;
+
+  _inserted_run(tree, &run);
+  args.radius_squared = sphere.radius_squared = radius_squared;
+  args.pairs = pairs;
+  args.point.count = 1;
+  for (i = 0; i < run.count; i++) {
+    for (d = 0; d < NDIMS; d++) {
+      args.point.coord[d] = run.coord[d] + i;
+      sphere.centre[d] = run.coord[d][i];
+    }
+    args.point.idx = run.idx + i;
+    _visit_leaves(tree, &sphere, _join_inserted_leaf, &args);
+  }
+  _pairs_reserve(pairs, run.count * run.count);
+  _join_runs(&run, &run, 1, radius_squared, pairs);
+}
+
+/* leaf visitor of _join_pending(), pairing an inserted point with the points
+ * of a leaf that have not been removed */
+static void _join_inserted_leaf(void *arg, const kdtree *tree,
+                                size_t offset, size_t count) {
+  struct inserted_join *args = (struct inserted_join*)arg;
+  const unsigned char *removed = tree->pending.removed;
+  kdtree_pairs *pairs = args->pairs;
+  const size_t idx = args->point.idx[0];
+  struct point_run run;
+  size_t i, n, other;
+
+  for (; count > 0; offset += run.count, count -= run.count) {
+    _point_run(tree, offset, count, &run);
+    _pairs_reserve(pairs, run.count);
+    n = pairs->size;
+    _join_runs(&args->point, &run, 0, args->radius_squared, pairs);
+    for (i = n; removed && i < pairs->size; i++) {
+      other = (pairs->first[i] == idx) ? pairs->second[i] : pairs->first[i];
+      if (removed[other]) continue;
+      pairs->first[n] = pairs->first[i];
+      pairs->second[n] = pairs->second[i];
+      pairs->distance[n++] = pairs->distance[i];
+    }
+    if (removed) pairs->size = n;
+  }
+}
+
+/* append pairs of points in range between two runs. If same is set, the runs
+ * are the same points and only pairs within the run are considered. The scan
+ * is branch-free, with the write position advanced only for pairs in range.
+ * There must be space reserved for all pairs.
+ */
+inline static void _join_runs(const struct point_run *a,
+                              const struct point_run *b, int same,
+                              double radius_squared, kdtree_pairs *pairs) {
+  const double *ax = a->coord[DIM_X], *bx = b->coord[DIM_X];
+  const double *ay = a->coord[DIM_Y], *by = b->coord[DIM_Y];
+  const double *az = a->coord[DIM_Z], *bz = b->coord[DIM_Z];
+  size_t i, j, n = pairs->size;
+  double dx, dy, dz, d2;
+
+  for (i = 0; i < a->count; i++) {
+    for (j = same ? i + 1 : 0; j < b->count; j++) {
+      dx = ax[i] - bx[j];
+      dy = ay[i] - by[j];
+      dz = az[i] - bz[j];
+      d2 = (dx * dx) + (dy * dy) + (dz * dz);
+      pairs->first[n]  = (a->idx[i] < b->idx[j]) ? a->idx[i] : b->idx[j];
+      pairs->second[n] = (a->idx[i] < b->idx[j]) ? b->idx[j] : a->idx[i];
+      pairs->distance[n] = d2;
+      n += (size_t)(d2 <= radius_squared);
+    }
+  }
+  pairs->size = n;
+}
+
+/* internal routine to recursively build the kdtree
+ *
+ * The count points starting at idx_from are placed under node, which is at
+ * the given depth. In the pointer layout, nodes are stored in pre-order.
+ * Since a subtree with n leaves always has (2n - 1) nodes, the offset of the
+ * right subtree is known before the left one is built. In the implicit
+ * layout, the position of both children is implied by that of the node.
+ * Both subtrees can therefore be built independently, and the resulting tree
+ * is identical regardless of the number of threads used.
+ *
+ * threads is the number of threads available for building this subtree.
+ * When there are more than one, the left subtree is built on a new thread
+ * and the available threads are split between both subtrees.
+ */
+static void _build_kdtree(size_t idx_from, size_t count, size_t depth,
+                          size_t node, size_t threads, kdtree *tree) {
+  struct build_task task;
+  pthread_t thread;
+  const size_t axis = depth % NDIMS;
+  const int implicit = (tree->layout == KDTREE_LAYOUT_IMPLICIT);
+  size_t left, right, left_count, position;
+
+  assert(node < tree->max_nodes);
+
+  /* if the points fit in a bucket, store a leaf node */
+  if (implicit ? (depth == tree->leaf_depth)
+               : (count <= tree->options.leaf_size)) {
+    if (!implicit) {
+      tree->node_data[node].left = 0;
+      tree->node_data[node].right = 0;
+      tree->node_data[node].idx = idx_from;
+      tree->node_data[node].count = count;
+    }
+    _leaf_bounds(tree, node);
+    return;
+  }
+
+  left = _left_child(tree, node);
+  if (implicit) {
+    right = left + 1;
+    position = node + 1 - ((size_t)1 << depth);
+    left_count = _split_point(tree->count, depth + 1, 2 * position + 1) -
+                 idx_from;
   } else {
-    _report_all_leaves(tree, node->left, iter);
-    _report_all_leaves(tree, node->right, iter);
+    left_count = (count + 1) / 2;
+    right = node + (_count_leaves(left_count, tree->options.leaf_size) * 2);
+    tree->node_data[node].left = left;
+    tree->node_data[node].right = right;
+    tree->node_data[node].idx = idx_from;
+    tree->node_data[node].count = count;
+  }
+
+  /* partition the points within this group around the median point. Points
+   * already in Morton order are split where they are */
+  if (tree->options.build_method == KDTREE_BUILD_MORTON) {
+    /* nothing to do */
+  } else if (count > 1 && tree->index_only) {
+    select_on_perm(tree->points.coord[axis], tree->points.perm,
+                   (ptrdiff_t)idx_from, (ptrdiff_t)(idx_from + count - 1),
+                   (ptrdiff_t)(idx_from + left_count - 1));
+  } else if (count > 1) {
+    select_on_axis(&tree->points, axis, (ptrdiff_t)idx_from,
+                   (ptrdiff_t)(idx_from + count - 1),
+                   (ptrdiff_t)(idx_from + left_count - 1));
+  }
+
+  /* build the left plane on a separate thread if worthwhile */
+  if (threads > 1 && count >= tree->options.parallel_cutoff) {
+    task.tree = tree;
+    task.idx_from = idx_from;
+    task.count = left_count;
+    task.depth = depth + 1;
+    task.node = left;
+    task.threads = threads / 2;
+    if (pthread_create(&thread, NULL, _build_kdtree_task, &task) == 0) {
+      _build_kdtree(idx_from + left_count, count - left_count, depth + 1,
+                    right, threads - task.threads, tree);
+      pthread_join(thread, NULL);
+      _branch_bounds(tree, node);
+      return;
+    }
+    /* could not create thread. Fall through to serial build */
   }
+
+  /* recursively build a tree for the left and right planes */
+  _build_kdtree(idx_from, left_count, depth + 1, left, 1, tree);
+  _build_kdtree(idx_from + left_count, count - left_count, depth + 1,
+                right, 1, tree);
+  _branch_bounds(tree, node);
 }
 
-/* convenience function to explore a sub-domain */
-inline static void _explore_branch(kdtree *tree,
-                                   struct tree_node *node,
-                                   size_t depth,
-                                   const struct space *search_space,
-                                   const struct space *domain,
-                                   kdtree_iterator *iter) {
-  if (_is_leaf_node(node)) {
-    if (_point_in_search_space(tree->points + node->idx, search_space)) {
-    _iterator_push(iter, tree->points[node->idx].idx);
-    }
-  } else if (_search_area_intersects(search_space, domain)) {
-    if (_completely_enclosed(search_space, domain)) {
-      _report_all_leaves(tree, node, iter);
-    } else {
-      _search_kdtree(tree, node, depth + 1, search_space, domain, iter);
+/* internal routine to recursively refit the bounds of the kdtree after its
+ * points have moved. The new coordinates of points in each leaf are copied
+ * from coord, and the bounds recomputed bottom-up. As with _build_kdtree(),
+ * subtrees are refit on separate threads when threads > 1.
+ */
+static void _refit_kdtree(size_t node, const double *coord[],
+                          size_t threads, kdtree *tree) {
+  struct refit_task task;
+  pthread_t thread;
+  size_t d, i, offset, count;
+
+  _node_points(tree, node, &offset, &count);
+  if (_is_leaf_node(tree, node)) {
+    /* index-only trees already refer to the new coordinates */
+    for (d = 0; d < NDIMS && !tree->index_only; d++) {
+      for (i = offset; i < offset + count; i++) {
+        tree->points.coord[d][i] = coord[d][tree->points.idx[i]];
+      }
     }
+    _leaf_bounds(tree, node);
+    return;
   }
+
+  if (threads > 1 && count >= tree->options.parallel_cutoff) {
+    task.tree = tree;
+    task.node = _left_child(tree, node);
+    task.coord = coord;
+    task.threads = threads / 2;
+    if (pthread_create(&thread, NULL, _refit_kdtree_task, &task) == 0) {
+      _refit_kdtree(_right_child(tree, node), coord, threads - task.threads,
+                    tree);
+      pthread_join(thread, NULL);
+      _branch_bounds(tree, node);
+      return;
+    }
+    /* could not create thread. Fall through to serial refit */
+  }
+
+  _refit_kdtree(_left_child(tree, node), coord, 1, tree);
+  _refit_kdtree(_right_child(tree, node), coord, 1, tree);
+  _branch_bounds(tree, node);
 }
 
-/* Recursively search the tree for points within a search space.
- * Results are appended to the iterator object.
+/* thread entry point for refitting a subtree */
+static void* _refit_kdtree_task(void *arg) {
+  struct refit_task *task = (struct refit_task*)arg;
+  _refit_kdtree(task->node, task->coord, task->threads, task->tree);
+  return NULL;
+}
+
+/* thread entry point for building the back tree of a kdtree_buffer. The
+ * tree is rebuilt from the snapshot without holding the lock, as neither
+ * readers nor kdtree_buffer_build() touch the back tree while building */
+static void* _buffer_build_task(void *arg) {
+  kdtree_buffer *buffer = (kdtree_buffer*)arg;
+  const int back = 1 - buffer->front;
+  kdtree *tree = buffer->tree[back];
+
+  kdtree_build(buffer->snapshot[back][DIM_X], buffer->snapshot[back][DIM_Y],
+               buffer->snapshot[back][DIM_Z], buffer->count, &tree);
+  pthread_mutex_lock(&buffer->lock);
+  buffer->tree[back] = tree;
+  buffer->state = BUFFER_BUILT;
+  pthread_cond_broadcast(&buffer->changed);
+  pthread_mutex_unlock(&buffer->lock);
+  return NULL;
+}
+
+/* thread entry point for building a subtree */
+static void* _build_kdtree_task(void *arg) {
+  struct build_task *task = (struct build_task*)arg;
+  _build_kdtree(task->idx_from, task->count, task->depth, task->node,
+                task->threads, task->tree);
+  return NULL;
+}
+
+/* Returns the number of leaves in a tree of count points.
+ *
+ * Each branch splits its points into halves of ceil(n/2) and floor(n/2), so
+ * the subtrees at any depth have at most two (adjacent) sizes. Rather than
+ * recursing, we track how many subtrees there are of each size.
  */
-static void _search_kdtree(kdtree *tree,
-                           struct tree_node *root,
-                           size_t depth,
-                           const struct space *search_space,
-                           const struct space *domain,
-                           kdtree_iterator *iter) {
-  const size_t axis = depth % NDIMS;
-  struct space new_domain;
-  
-  /* initialise boundaries for new domain */
-  memcpy(&new_domain, domain, sizeof(struct space));
-  
-  /* explore left branch */
-  new_domain.dim[axis].max = root->split;
-  _explore_branch(tree, root->left, depth, search_space, &new_domain, iter);
-  
-  /* explore right branch */
-  new_domain.dim[axis].max = domain->dim[axis].max; /* reset */
-  new_domain.dim[axis].min = root->split;
-  _explore_branch(tree, root->right, depth, search_space, &new_domain, iter);
-}
-
-/* internal routine to recursively build the kdtree */
-static struct tree_node* _build_kdtree(size_t idx_from, size_t idx_to,
-                                       size_t depth, kdtree *tree) {
-  double split;
-  struct tree_node *node;
-  struct data_point *point;
-  const size_t count = idx_to - idx_from + 1;
-  const size_t mid   = idx_from + ((idx_to - idx_from) / 2);
-  const size_t axis  = depth % NDIMS;
-
-  /* if there is only one point, return a leaf node */
-  if (count == 1) return _get_leaf_node(tree, idx_from);
-  
-  /* sort the points within this group to determine the median point
-   * - This can be a potential performance bottleneck. There are methods
-   *   to determine median in linear time, but that can get rather
-   *   complicated. Will consider if this proves to be an issue.
-  */
-  qsort((void*)(tree->points + idx_from), count,
-         sizeof(struct data_point), func_select[axis]);
-  
-  /* determine point where axis will be split */
-  point = &tree->points[mid];
-  split = (axis == 0) ? point->x : ((axis == 1) ? point->y : point->z);
-  
-  /* recursively build a tree for the left and right planes */
-  node = _get_branch_node(tree, split);
-  node->left  = _build_kdtree(idx_from, mid, depth + 1, tree);
-  node->right = _build_kdtree(mid + 1, idx_to, depth + 1, tree);
-  
-  return node;
+static size_t _count_leaves(size_t count, size_t leaf_size) {
+  size_t size = count; /* size of the smaller subtrees at this depth */
+  size_t n_small = 1;  /* number of subtrees with size points */
+  size_t n_large = 0;  /* number of subtrees with size + 1 points */
+  size_t leaves = 0;
+
+  while (n_small + n_large > 0) {
+    if (size + 1 <= leaf_size) return leaves + n_small + n_large;
+    if (size <= leaf_size) { /* only the smaller subtrees are leaves */
+      leaves += n_small;
+      n_small = 0;
+    }
+    if (size % 2 == 0) { /* 2h -> (h, h) and 2h + 1 -> (h + 1, h) */
+      n_small = (n_small * 2) + n_large;
+    } else {             /* 2h + 1 -> (h + 1, h) and 2h + 2 -> (h + 1, h + 1) */
+      n_large = n_small + (n_large * 2);
+    }
+    size /= 2;
+  }
+  return leaves;
+}
+
+/* Returns the depth of the leaves of an implicit tree of count points, which
+ * is the smallest depth at which no node holds more than leaf_size points.
+ */
+static size_t _leaf_depth(size_t count, size_t leaf_size) {
+  size_t depth = 0;
+  while (((count - 1) >> depth) + 1 > leaf_size) depth++;
+  return depth;
+}
+
+/* returns the number of threads to use, where 0 means all available cores */
+static size_t _resolve_num_threads(size_t num_threads) {
+  long cores = 1;
+  if (num_threads > 0) return num_threads;
+#ifdef _SC_NPROCESSORS_ONLN
+  cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return (cores > 0) ? (size_t)cores : 1;
+}
+
+/* returns the capacity to allocate for at least required elements, growing
+ * the current capacity geometrically */
+static size_t _grow_capacity(size_t capacity, size_t required) {
+  size_t grown = (size_t)(capacity * KDTREE_CAPACITY_GROWTH_RATIO);
+  return (grown > required) ? grown : required;
+}
+
+/* Make room for count points in tree order, keeping the first keep of them.
+ * Memory is only reallocated if count exceeds the capacity of the tree (or
+ * when building a tree of a different kind, if keep is 0) */
+static void _reserve_points(kdtree *tree, size_t count, size_t keep) {
+  double *coord;
+  size_t d, capacity;
+
+  if (keep == 0 && tree->index_only != tree->options.index_only) {
+    _free_points(tree);
+    tree->capacity = 0;
+    tree->index_only = tree->options.index_only;
+  }
+  if (count <= tree->capacity) return;
+  capacity = _grow_capacity(tree->capacity, count);
+
+  if (tree->index_only) {
+    assert(count <= UINT32_MAX);
+    tree->points.perm = realloc(tree->points.perm,
+                                sizeof(uint32_t) * capacity);
+    assert(tree->points.perm != NULL);
+  } else {
+    /* coordinates for all axes are held in a single block */
+    coord = malloc(sizeof(double) * capacity * NDIMS);
+    assert(coord != NULL);
+    for (d = 0; d < NDIMS; d++) {
+      if (keep > 0) {
+        memcpy(coord + (d * capacity), tree->points.coord[d],
+               sizeof(double) * keep);
+      }
+    }
+    free(tree->points.coord[DIM_X]);
+    for (d = 0; d < NDIMS; d++) {
+      tree->points.coord[d] = coord + (d * capacity);
+    }
+    tree->points.idx = realloc(tree->points.idx, sizeof(size_t) * capacity);
+    assert(tree->points.idx != NULL);
+  }
+  tree->capacity = capacity;
+}
+
+/* Set max_nodes (and leaf_depth) for the count and layout of the tree, and
+ * make room for that many nodes. As with points, node memory is grown
+ * geometrically and only reallocated if it is outgrown or the layout
+ * changes */
+static void _reserve_nodes(kdtree *tree) {
+  size_t capacity, leaves;
+  int layout = tree->options.layout;
+
+  assert(tree->options.leaf_size > 0);
+  assert(tree->options.layout == KDTREE_LAYOUT_POINTER ||
+         tree->options.layout == KDTREE_LAYOUT_IMPLICIT);
+  if (tree->grid.cells > 0) {
+    /* at most one leaf per cell or point, see _build_grid() */
+    leaves = (tree->grid.cells < tree->count) ? tree->grid.cells : tree->count;
+    layout = KDTREE_LAYOUT_POINTER;
+    tree->max_nodes = (2 * leaves) - 1;
+  } else if (layout == KDTREE_LAYOUT_IMPLICIT) {
+    tree->leaf_depth = _leaf_depth(tree->count, tree->options.leaf_size);
+    tree->max_nodes = ((size_t)2 << tree->leaf_depth) - 1;
+  } else {
+    tree->max_nodes = (_count_leaves(tree->count,
+                                     tree->options.leaf_size) * 2) - 1;
+  }
+
+  if (tree->max_nodes > tree->node_capacity || tree->layout != layout) {
+    free(tree->node_data);
+    free(tree->node_bounds);
+    free(tree->node_sums);
+    tree->node_sums = NULL;
+    capacity = _grow_capacity(tree->node_capacity, tree->max_nodes);
+    tree->node_capacity = capacity;
+    tree->layout = layout;
+    tree->node_data = NULL;
+    if (tree->layout == KDTREE_LAYOUT_POINTER) {
+      tree->node_data = malloc(sizeof(struct tree_node) * capacity);
+      assert(tree->node_data != NULL);
+    }
+    tree->node_bounds = malloc(sizeof(struct space) * capacity);
+    assert(tree->node_bounds != NULL);
+  }
+  if (tree->options.aggregate && tree->node_sums == NULL) {
+    tree->node_sums = malloc(sizeof(struct node_sums) * tree->node_capacity);
+    assert(tree->node_sums != NULL);
+  } else if (!tree->options.aggregate) {
+    free(tree->node_sums);
+    tree->node_sums = NULL;
+  }
+}
+
+/* Record what kdtree_search_point() needs if options.self_search is set, or
+ * free it otherwise: the leaf holding each index, the parent of each node
+ * and the cell of each node. The cell of a child is that of its parent, cut
+ * off along one axis at the near side of its sibling's bounds. The axis with
+ * the widest gap between the siblings is chosen, which for median builds is
+ * the axis they were split along. Parents precede their children in both
+ * layouts, so cells are set in a single pass over the nodes */
+static void _index_leaves(kdtree *tree) {
+  struct self_search *self = &tree->self;
+  const struct space *left, *right;
+  struct space *cell;
+  size_t node, i, d, idx, axis, offset, count, limit = 0;
+  double gap, widest = 0.0;
+
+  if (!tree->options.self_search) {
+    _free_self(tree);
+    return;
+  }
+  for (i = 0; i < tree->count; i++) {
+    idx = _point_index(&tree->points, i);
+    if (idx >= limit) limit = idx + 1;
+  }
+  self->leaf = realloc(self->leaf, sizeof(size_t) * limit);
+  self->cell = realloc(self->cell, sizeof(struct space) * tree->max_nodes);
+  assert(self->leaf != NULL);
+  assert(self->cell != NULL);
+  free(self->parent);
+  self->parent = NULL;
+  if (tree->layout == KDTREE_LAYOUT_POINTER) {
+    self->parent = malloc(sizeof(size_t) * tree->max_nodes);
+    assert(self->parent != NULL);
+  }
+  self->index_limit = limit;
+  for (i = 0; i < limit; i++) self->leaf[i] = KDTREE_END;
+
+  for (d = 0; d < NDIMS; d++) {
+    self->cell[0].dim[d].min = -DBL_MAX;
+    self->cell[0].dim[d].max = DBL_MAX;
+  }
+  for (node = 0; node < tree->max_nodes; node++) {
+    if (_is_leaf_node(tree, node)) {
+      _node_points(tree, node, &offset, &count);
+      for (i = offset; i < offset + count; i++) {
+        self->leaf[_point_index(&tree->points, i)] = node;
+      }
+      continue;
+    }
+    left = &tree->node_bounds[_left_child(tree, node)];
+    right = &tree->node_bounds[_right_child(tree, node)];
+    for (d = 0, axis = 0; d < NDIMS; d++) {
+      gap = right->dim[d].min - left->dim[d].max;
+      if (d == 0 || gap > widest) {
+        widest = gap;
+        axis = d;
+      }
+    }
+    cell = &self->cell[_left_child(tree, node)];
+    *cell = self->cell[node];
+    if (right->dim[axis].min < cell->dim[axis].max) {
+      cell->dim[axis].max = right->dim[axis].min;
+    }
+    cell = &self->cell[_right_child(tree, node)];
+    *cell = self->cell[node];
+    if (left->dim[axis].max > cell->dim[axis].min) {
+      cell->dim[axis].min = left->dim[axis].max;
+    }
+    if (self->parent) {
+      self->parent[_left_child(tree, node)] = node;
+      self->parent[_right_child(tree, node)] = node;
+    }
+  }
+}
+
+/* free what is kept for kdtree_search_point() */
+static void _free_self(kdtree *tree) {
+  free(tree->self.leaf);
+  free(tree->self.parent);
+  free(tree->self.cell);
+  memset(&tree->self, 0, sizeof(struct self_search));
+}
+
+/* returns true if points have been inserted or removed since the tree was
+ * last built */
+inline static int _has_pending(const kdtree *tree) {
+  return (tree->pending.inserted_count > 0) ||
+         (tree->pending.removed_count > 0);
+}
+
+/* discard pending changes, keeping the insert buffer for reuse */
+static void _clear_pending(kdtree *tree) {
+  struct pending_changes *pending = &tree->pending;
+  pending->inserted_count = 0;
+  pending->removed_count = 0;
+  free(pending->removed);
+  free(pending->position);
+  pending->removed = NULL;
+  pending->position = NULL;
+  pending->index_limit = 0;
+  pending->sparse = 0;
+}
+
+/* discard pending changes and free all memory held for them */
+static void _free_pending(kdtree *tree) {
+  struct pending_changes *pending = &tree->pending;
+  size_t d;
+  _clear_pending(tree);
+  for (d = 0; d < NDIMS; d++) {
+    free(pending->inserted.coord[d]);
+    pending->inserted.coord[d] = NULL;
+  }
+  free(pending->inserted.idx);
+  free(pending->removed_idx);
+  pending->inserted.idx = NULL;
+  pending->removed_idx = NULL;
+  pending->inserted_capacity = 0;
+  pending->removed_capacity = 0;
+}
+
+/* rebuild the tree once more changes are pending than it tolerates (see
+ * kdtree_insert()) */
+static void _check_pending(kdtree *tree) {
+  const size_t count = tree->pending.inserted_count +
+                       tree->pending.removed_count;
+  double limit = tree->options.update_fraction * (double)tree->count;
+  if (limit < KDTREE_INSERT_BUFFER_SIZE) limit = KDTREE_INSERT_BUFFER_SIZE;
+  if ((double)count > limit) kdtree_flush(tree);
+}
+
+/* map each index in the tree to its position in tree order, and allocate a
+ * flag for each index to mark it as removed */
+static void _map_positions(kdtree *tree) {
+  struct pending_changes *pending = &tree->pending;
+  size_t i, idx, limit = 0;
+
+  for (i = 0; i < tree->count; i++) {
+    idx = _point_index(&tree->points, i);
+    if (idx >= limit) limit = idx + 1;
+  }
+  pending->position = malloc(sizeof(size_t) * limit);
+  pending->removed = calloc(limit, 1);
+  assert(pending->position != NULL);
+  assert(pending->removed != NULL);
+  for (i = 0; i < limit; i++) pending->position[i] = KDTREE_END;
+  for (i = 0; i < tree->count; i++) {
+    pending->position[_point_index(&tree->points, i)] = i;
+  }
+  pending->index_limit = limit;
+}
+
+/* set run to the points inserted since the tree was built */
+inline static void _inserted_run(const kdtree *tree, struct point_run *run) {
+  size_t d;
+  for (d = 0; d < NDIMS; d++) {
+    run->coord[d] = tree->pending.inserted.coord[d];
+  }
+  run->idx = tree->pending.inserted.idx;
+  run->count = tree->pending.inserted_count;
+}
+
+/* remove the points of the tree that have been flagged as removed from the
+ * results of a search, from position from of the iterator onwards */
+inline static void _drop_removed(const kdtree *tree, kdtree_iterator *iter,
+                                 size_t from) {
+  const unsigned char *removed = tree->pending.removed;
+  size_t i, d, n = from;
+
+  for (i = from; i < iter->size; i++) {
+    if (removed[iter->data[i]]) continue;
+    iter->data[n] = iter->data[i];
+    if (iter->with_distance) iter->distance[n] = iter->distance[i];
+    for (d = 0; iter->with_image && d < NDIMS; d++) {
+      iter->image[(NDIMS * n) + d] = iter->image[(NDIMS * i) + d];
+    }
+    n++;
+  }
+  iter->size = n;
+}
+
+/* Compute the permutation that puts count points in Morton order: order[i]
+ * is the position of the i-th point along the curve. The coordinates of the
+ * point at position i are x[i], y[i] and z[i], or at perm[i] if perm is
+ * given (as for index-only trees). The codes are
+ * sorted by an LSD radix sort of RADIX_BITS digits. Each pass histograms the
+ * digit over a block of entries per thread, and then scatters each block to
+ * its offsets in the output. As the sort is stable, the result does not
+ * depend on the number of threads. Passes where all codes have the same
+ * digit are skipped, which is common for the top digits */
+static void _morton_sort(const double *x, const double *y, const double *z,
+                         const uint32_t *perm, size_t count, size_t threads,
+                         size_t *order) {
+  struct radix_task *tasks;
+  struct morton_entry *in, *out;
+  const double *coord[NDIMS];
+  pthread_t *handles;
+  double min[NDIMS], scale[NDIMS], max, value;
+  size_t i, t, d, bin, shift, offset, total;
+
+  coord[DIM_X] = x;
+  coord[DIM_Y] = y;
+  coord[DIM_Z] = z;
+  for (d = 0; d < NDIMS; d++) {
+    max = -DBL_MAX;
+    min[d] = DBL_MAX;
+    for (i = 0; i < count; i++) {
+      value = coord[d][perm ? perm[i] : i];
+      if (value < min[d]) min[d] = value;
+      if (value > max) max = value;
+    }
+    scale[d] = (max > min[d]) ? MORTON_MAX / (max - min[d]) : 0.0;
+  }
+
+  if (threads > count) threads = count;
+  if (threads == 0) threads = 1;
+  in = malloc(sizeof(struct morton_entry) * (2 * count + 1));
+  tasks = malloc(sizeof(struct radix_task) * threads);
+  handles = malloc(sizeof(pthread_t) * threads);
+  assert(in != NULL && tasks != NULL && handles != NULL);
+  out = in + count;
+  for (t = 0; t < threads; t++) {
+    for (d = 0; d < NDIMS; d++) tasks[t].coord[d] = coord[d];
+    tasks[t].perm = perm;
+    tasks[t].min = min;
+    tasks[t].scale = scale;
+    tasks[t].in = in;
+    tasks[t].out = out;
+    tasks[t].from = count * t / threads;
+    tasks[t].to = count * (t + 1) / threads;
+    tasks[t].phase = RADIX_CODES;
+  }
+  _run_tasks(_radix_task, tasks, sizeof(struct radix_task), handles, threads);
+
+  for (shift = 0; shift < NDIMS * 21; shift += RADIX_BITS) {
+    for (t = 0; t < threads; t++) {
+      tasks[t].shift = shift;
+      tasks[t].phase = RADIX_HISTOGRAM;
+    }
+    _run_tasks(_radix_task, tasks, sizeof(struct radix_task), handles,
+               threads);
+
+    /* turn counts into the offset of each block of each digit */
+    for (bin = 0, offset = 0; bin < RADIX_BINS; bin++) {
+      for (t = 0, total = 0; t < threads; t++) {
+        total += tasks[t].histogram[bin];
+      }
+      if (total == count) break; /* every code has this digit */
+      for (t = 0; t < threads; t++) {
+        total = tasks[t].histogram[bin];
+        tasks[t].histogram[bin] = offset;
+        offset += total;
+      }
+    }
+    if (bin < RADIX_BINS) continue;
+    for (t = 0; t < threads; t++) tasks[t].phase = RADIX_SCATTER;
+    _run_tasks(_radix_task, tasks, sizeof(struct radix_task), handles,
+               threads);
+    for (t = 0; t < threads; t++) {
+      tasks[t].in = out;
+      tasks[t].out = in;
+    }
+    out = in;
+    in = tasks[0].in;
+  }
+
+  for (i = 0; i < count; i++) order[i] = in[i].position;
+  free((in < out) ? in : out);
+  free(tasks);
+  free(handles);
+}
+
+/* run one phase of _morton_sort() over the entries of a task */
+static void* _radix_task(void *arg) {
+  struct radix_task *task = (struct radix_task*)arg;
+  size_t i, j, d, bin;
+  uint64_t code, q;
+
+  switch (task->phase) {
+  case RADIX_CODES:
+    for (i = task->from; i < task->to; i++) {
+      code = 0;
+      j = task->perm ? task->perm[i] : i;
+      for (d = 0; d < NDIMS; d++) {
+        q = (uint64_t)((task->coord[d][j] - task->min[d]) * task->scale[d]);
+        code |= _morton_spread(q) << d;
+      }
+      task->in[i].code = code;
+      task->in[i].position = i;
+    }
+    break;
+  case RADIX_HISTOGRAM:
+    memset(task->histogram, 0, sizeof(task->histogram));
+    for (i = task->from; i < task->to; i++) {
+      task->histogram[(task->in[i].code >> task->shift) & (RADIX_BINS - 1)]++;
+    }
+    break;
+  case RADIX_SCATTER:
+    for (i = task->from; i < task->to; i++) {
+      bin = (task->in[i].code >> task->shift) & (RADIX_BINS - 1);
+      task->out[task->histogram[bin]++] = task->in[i];
+    }
+    break;
+  }
+  return NULL;
+}
+
+/* Copy the tree->count points of source into the tree in Morton order, for
+ * trees built with KDTREE_BUILD_MORTON */
+static void _morton_arrange(kdtree *tree, const struct point_data *source) {
+  const size_t count = tree->count;
+  size_t threads = _resolve_num_threads(tree->options.num_threads);
+  size_t *order;
+
+  if (count < tree->options.parallel_cutoff) threads = 1;
+  order = malloc(sizeof(size_t) * (count + 1));
+  assert(order != NULL);
+  _morton_sort(source->coord[DIM_X], source->coord[DIM_Y],
+               source->coord[DIM_Z], source->perm, count, threads, order);
+  _gather_points(tree, source, order);
+  free(order);
+}
+
+/* Copy the tree->count points of source into the tree, where order[i] is the
+ * position in source of the point to put at i. source is either the
+ * caller's coordinates (with neither idx nor perm), or the tree's own points
+ * when flushing, which are first copied aside as they are overwritten */
+static void _gather_points(kdtree *tree, const struct point_data *source,
+                           const size_t *order) {
+  const size_t count = tree->count;
+  size_t *idx = NULL, i, d;
+  uint32_t *perm = NULL;
+  double *coord = NULL;
+  const double *from;
+
+  if (tree->index_only) {
+    if (source->perm) {
+      perm = malloc(sizeof(uint32_t) * count);
+      assert(perm != NULL);
+      memcpy(perm, source->perm, sizeof(uint32_t) * count);
+    }
+    for (i = 0; i < count; i++) {
+      tree->points.perm[i] = perm ? perm[order[i]] : (uint32_t)order[i];
+    }
+  } else {
+    if (source->idx) {
+      coord = malloc(sizeof(double) * count);
+      idx = malloc(sizeof(size_t) * count);
+      assert(coord != NULL && idx != NULL);
+      memcpy(idx, source->idx, sizeof(size_t) * count);
+    }
+    for (d = 0; d < NDIMS; d++) {
+      from = source->coord[d];
+      if (coord) {
+        memcpy(coord, from, sizeof(double) * count);
+        from = coord;
+      }
+      for (i = 0; i < count; i++) tree->points.coord[d][i] = from[order[i]];
+    }
+    for (i = 0; i < count; i++) {
+      tree->points.idx[i] = idx ? idx[order[i]] : order[i];
+    }
+  }
+  free(perm);
+  free(coord);
+  free(idx);
+}
+
+/* Decide whether to index the points of source with a grid rather than a
+ * tree (see options.index), and if so lay the grid out over their bounding
+ * box. Otherwise any grid memory held by the tree is freed */
+static void _plan_grid(kdtree *tree, const struct point_data *source) {
+  struct grid *grid = &tree->grid;
+  double min[NDIMS], max[NDIMS], value;
+  size_t i, d;
+
+  if (tree->options.index != KDTREE_INDEX_GRID &&
+      !(tree->options.index == KDTREE_INDEX_AUTO &&
+        _uniform_density(source, tree->count))) {
+    free(grid->leaf);
+    memset(grid, 0, sizeof(struct grid));
+    return;
+  }
+  for (d = 0; d < NDIMS; d++) {
+    min[d] = DBL_MAX;
+    max[d] = -DBL_MAX;
+    for (i = 0; i < tree->count; i++) {
+      value = _point_coord(source, d, i);
+      if (value < min[d]) min[d] = value;
+      if (value > max[d]) max[d] = value;
+    }
+  }
+  _grid_layout(grid, min, max, tree->count, (double)tree->options.leaf_size,
+               tree->options.grid_cell_size);
+  if (grid->cells > grid->capacity) {
+    free(grid->leaf);
+    grid->capacity = _grow_capacity(grid->capacity, grid->cells);
+    grid->leaf = malloc(sizeof(size_t) * grid->capacity);
+    assert(grid->leaf != NULL);
+  }
+}
+
+/* Returns true if the density of count points looks uniform enough to index
+ * them with a grid (for KDTREE_INDEX_AUTO). KDTREE_GRID_SAMPLE of them,
+ * spread evenly through the arrays, are counted in cells expected to hold 8
+ * each. Uniformly scattered points give counts with a squared coefficient of
+ * variation of about 1/8, while clustered points, which a grid serves badly,
+ * give far more. Fewer points than the sample are always left to a tree */
+static int _uniform_density(const struct point_data *points, size_t count) {
+  struct grid sample;
+  double min[NDIMS], max[NDIMS], value, mean, squares = 0.0;
+  size_t *cell_count, i, j, d, c;
+
+  if (count < KDTREE_GRID_SAMPLE) return 0;
+  for (d = 0; d < NDIMS; d++) {
+    min[d] = DBL_MAX;
+    max[d] = -DBL_MAX;
+    for (j = 0; j < KDTREE_GRID_SAMPLE; j++) {
+      i = (size_t)((double)j * count / KDTREE_GRID_SAMPLE);
+      value = _point_coord(points, d, i);
+      if (value < min[d]) min[d] = value;
+      if (value > max[d]) max[d] = value;
+    }
+  }
+  _grid_layout(&sample, min, max, KDTREE_GRID_SAMPLE, 8.0, 0.0);
+  cell_count = calloc(sample.cells, sizeof(size_t));
+  assert(cell_count != NULL);
+  for (j = 0; j < KDTREE_GRID_SAMPLE; j++) {
+    i = (size_t)((double)j * count / KDTREE_GRID_SAMPLE);
+    cell_count[_grid_point_cell(&sample, points, i)]++;
+  }
+  for (c = 0; c < sample.cells; c++) {
+    squares += (double)cell_count[c] * (double)cell_count[c];
+  }
+  free(cell_count);
+  mean = (double)KDTREE_GRID_SAMPLE / (double)sample.cells;
+  return (squares / sample.cells) / (mean * mean) - 1.0 <=
+         KDTREE_GRID_MAX_VARIATION;
+}
+
+/* Lay out a grid over the box from min to max, for count points. Cells are
+ * at least cell_size wide if it is given (> 0), and otherwise roughly cubes
+ * holding about per_cell points each. Axes along which the box is thinner
+ * than a cell get a single cell, and each axis is divided evenly, so cells
+ * tile the box exactly. The grid is limited to 8 cells per point, so a cell
+ * size that is too small for the box is increased */
+static void _grid_layout(struct grid *grid, const double min[],
+                         const double max[], size_t count, double per_cell,
+                         double cell_size) {
+  double extent[NDIMS], side = cell_size, volume, cells;
+  int active[NDIMS], changed;
+  size_t d, n;
+
+  for (d = 0; d < NDIMS; d++) {
+    extent[d] = max[d] - min[d];
+    active[d] = (extent[d] > 0.0);
+  }
+  if (side <= 0.0) {
+    /* find the side of count / per_cell cubes filling the axes that are
+     * wider than a cube */
+    do {
+      volume = 1.0;
+      for (d = 0, n = 0; d < NDIMS; d++) {
+        if (active[d]) volume *= extent[d];
+        n += active[d];
+      }
+      side = (n > 0) ? _root(volume * per_cell / (double)count, n) : 1.0;
+      for (d = 0, changed = 0; d < NDIMS; d++) {
+        if (active[d] && extent[d] < side) {
+          active[d] = 0;
+          changed = 1;
+        }
+      }
+    } while (changed);
+  }
+  for (;;) {
+    for (d = 0, cells = 1.0; d < NDIMS; d++) {
+      grid->dims[d] = 1;
+      if (extent[d] >= 2.0 * side) grid->dims[d] = (size_t)(extent[d] / side);
+      cells *= (double)grid->dims[d];
+    }
+    if (cells <= 8.0 * (double)count) break;
+    side *= 2.0;
+  }
+  for (d = 0; d < NDIMS; d++) {
+    grid->origin[d] = min[d];
+    grid->inverse_size[d] = (extent[d] > 0.0) ?
+                            (double)grid->dims[d] / extent[d] : 0.0;
+  }
+  grid->cells = grid->dims[DIM_X] * grid->dims[DIM_Y] * grid->dims[DIM_Z];
+}
+
+/* returns the n-th root of a positive value by Newton's method, which
+ * approaches it from above (avoiding a dependency on libm) */
+static double _root(double value, size_t n) {
+  double root = (value > 1.0) ? value : 1.0, next, power;
+  size_t i, step;
+  for (step = 0; step < 1000; step++) {
+    for (i = 1, power = 1.0; i < n; i++) power *= root;
+    next = (((double)(n - 1) * root) + (value / power)) / (double)n;
+    if (!(next < root)) break;
+    root = next;
+  }
+  return root;
+}
+
+/* returns the cell along axis d of a grid holding the given coordinate. Those
+ * outside the grid are clamped to its first or last cell */
+inline static size_t _grid_index(const struct grid *grid, size_t d,
+                                 double value) {
+  const double q = (value - grid->origin[d]) * grid->inverse_size[d];
+  if (!(q > 0.0)) return 0;
+  if (q >= (double)(grid->dims[d] - 1)) return grid->dims[d] - 1;
+  return (size_t)q;
+}
+
+/* returns the cell of a grid holding the point at position i of points */
+inline static size_t _grid_point_cell(const struct grid *grid,
+                                      const struct point_data *points,
+                                      size_t i) {
+  return (((_grid_index(grid, DIM_Z, _point_coord(points, DIM_Z, i)) *
+            grid->dims[DIM_Y]) +
+           _grid_index(grid, DIM_Y, _point_coord(points, DIM_Y, i))) *
+          grid->dims[DIM_X]) +
+         _grid_index(grid, DIM_X, _point_coord(points, DIM_X, i));
+}
+
+/* Copy the tree->count points of source into the tree in cell order, by a
+ * counting sort on their cells (so points within a cell keep their order).
+ * On return, grid.leaf holds the end of the points of each cell for
+ * _build_grid() */
+static void _grid_arrange(kdtree *tree, const struct point_data *source) {
+  struct grid *grid = &tree->grid;
+  const size_t count = tree->count;
+  size_t *cell, *order, i, c, n, total = 0;
+
+  cell = malloc(sizeof(size_t) * count);
+  order = malloc(sizeof(size_t) * count);
+  assert(cell != NULL && order != NULL);
+  memset(grid->leaf, 0, sizeof(size_t) * grid->cells);
+  for (i = 0; i < count; i++) {
+    cell[i] = _grid_point_cell(grid, source, i);
+    grid->leaf[cell[i]]++;
+  }
+  for (c = 0; c < grid->cells; c++) {
+    n = grid->leaf[c];
+    grid->leaf[c] = total;
+    total += n;
+  }
+  for (i = 0; i < count; i++) order[grid->leaf[cell[i]]++] = i;
+  _gather_points(tree, source, order);
+  free(cell);
+  free(order);
+}
+
+/* Build the nodes over a grid whose points have been put in cell order by
+ * _grid_arrange(). Each non-empty cell is a leaf, and the cells are split
+ * evenly between the children of each branch, giving a balanced tree in the
+ * pointer layout. grid.leaf is then set to the leaf of each cell */
+static void _build_grid(kdtree *tree) {
+  struct grid *grid = &tree->grid;
+  size_t *cell, *first, c, k = 0, start = 0;
+
+  cell = malloc(sizeof(size_t) * (tree->count + 1));
+  first = malloc(sizeof(size_t) * (tree->count + 1));
+  assert(cell != NULL && first != NULL);
+  for (c = 0; c < grid->cells; c++) {
+    if (grid->leaf[c] > start) {
+      cell[k] = c;
+      first[k++] = start;
+    }
+    start = grid->leaf[c];
+    grid->leaf[c] = KDTREE_END;
+  }
+  first[k] = tree->count;
+  tree->max_nodes = (2 * k) - 1;
+  _build_grid_nodes(tree, cell, first, 0, k, 0);
+  free(cell);
+  free(first);
+}
+
+/* build the node over the non-empty cells from up to to of a grid, given the
+ * cell and first point of each */
+static void _build_grid_nodes(kdtree *tree, const size_t *cell,
+                              const size_t *first, size_t from, size_t to,
+                              size_t node) {
+  struct tree_node *data = &tree->node_data[node];
+  const size_t middle = from + ((to - from + 1) / 2);
+
+  data->idx = first[from];
+  data->count = first[to] - first[from];
+  if (to - from == 1) {
+    data->left = 0;
+    data->right = 0;
+    tree->grid.leaf[cell[from]] = node;
+    _leaf_bounds(tree, node);
+    return;
+  }
+  data->left = node + 1;
+  data->right = node + (2 * (middle - from));
+  _build_grid_nodes(tree, cell, first, from, middle, data->left);
+  _build_grid_nodes(tree, cell, first, middle, to, data->right);
+  _branch_bounds(tree, node);
 }
 
 /* allocate and initialise a new iterator object */
@@ -454,6 +4752,13 @@ inline static kdtree_iterator* _iterator_new(void) {
   iter->capacity = KDTREE_ITERATOR_INITIAL_SIZE;
   iter->data = malloc(sizeof(size_t) * iter->capacity);
   assert(iter->data != NULL);
+  iter->distance = NULL;
+  iter->with_distance = 0;
+  iter->image = NULL;
+  iter->with_image = 0;
+#ifdef KDTREE_STATS
+  memset(&iter->stats, 0, sizeof(kdtree_search_stats));
+#endif
   
   return iter;
 }
@@ -463,6 +4768,76 @@ inline static void _iterator_reset(kdtree_iterator *iter) {
   assert(iter != NULL);
   iter->size = 0;
   iter->current = 0;
+#ifdef KDTREE_STATS
+  memset(&iter->stats, 0, sizeof(kdtree_search_stats));
+#endif
+}
+
+/* make sure there is space for another count values in the iterator */
+inline static void _iterator_reserve(kdtree_iterator *iter, size_t count) {
+  if (iter->size + count > iter->capacity) {
+    assert(KDTREE_ITERATOR_GROWTH_RATIO > 1.0);
+    while (iter->size + count > iter->capacity) {
+      iter->capacity *= KDTREE_ITERATOR_GROWTH_RATIO;
+    }
+    STAT_ADD(iter, reallocations, 1);
+    iter->data = realloc(iter->data, sizeof(size_t) * iter->capacity);
+    assert(iter->data != NULL);
+    if (iter->distance) {
+      iter->distance = realloc(iter->distance, sizeof(double) * iter->capacity);
+      assert(iter->distance != NULL);
+    }
+    if (iter->image) {
+      iter->image = realloc(iter->image,
+                            sizeof(int) * NDIMS * iter->capacity);
+      assert(iter->image != NULL);
+    }
+  }
+}
+
+/* Either create a new iterator or reset the existing one referenced by
+ * iter_ptr. If with_distance is set, memory for distances is provided. */
+inline static kdtree_iterator* _iterator_prepare(kdtree_iterator **iter_ptr,
+                                                 int with_distance) {
+  kdtree_iterator *iter = *iter_ptr;
+  if (iter != NULL) _iterator_reset(iter);
+  else {
+    iter = _iterator_new();
+    *iter_ptr = iter; /* write back new ptr to obj */
+  }
+
+  iter->with_distance = with_distance;
+  iter->with_image = 0;
+  if (with_distance && iter->distance == NULL) {
+    iter->distance = malloc(sizeof(double) * iter->capacity);
+    assert(iter->distance != NULL);
+  }
+  return iter;
+}
+
+/* provide memory for the periodic image of each entry in the iterator */
+inline static void _iterator_want_images(kdtree_iterator *iter) {
+  iter->with_image = 1;
+  if (iter->image == NULL) {
+    iter->image = malloc(sizeof(int) * NDIMS * iter->capacity);
+    assert(iter->image != NULL);
+  }
+}
+
+/* make sure there is space for another count pairs */
+inline static void _pairs_reserve(kdtree_pairs *pairs, size_t count) {
+  if (pairs->size + count > pairs->capacity) {
+    while (pairs->size + count > pairs->capacity) {
+      pairs->capacity *= KDTREE_ITERATOR_GROWTH_RATIO;
+    }
+    pairs->first = realloc(pairs->first, sizeof(size_t) * pairs->capacity);
+    pairs->second = realloc(pairs->second, sizeof(size_t) * pairs->capacity);
+    pairs->distance = realloc(pairs->distance,
+                              sizeof(double) * pairs->capacity);
+    assert(pairs->first != NULL);
+    assert(pairs->second != NULL);
+    assert(pairs->distance != NULL);
+  }
 }
 
 /* add a new value into the iterator. Resize memory if full */
@@ -470,7 +4845,220 @@ inline static void _iterator_push(kdtree_iterator *iter, size_t value) {
   if (iter->size == iter->capacity) { /* full. need to grow capacity */
     assert(KDTREE_ITERATOR_GROWTH_RATIO > 1.0);
     iter->capacity *= KDTREE_ITERATOR_GROWTH_RATIO;
+    STAT_ADD(iter, reallocations, 1);
     iter->data = realloc(iter->data, sizeof(size_t) * iter->capacity);
+    if (iter->distance) {
+      iter->distance = realloc(iter->distance, sizeof(double) * iter->capacity);
+    }
+    if (iter->image) {
+      iter->image = realloc(iter->image,
+                            sizeof(int) * NDIMS * iter->capacity);
+    }
   }
   iter->data[iter->size++] = value;
 }
+
+/* add count points from offset in tree order to a result set, leaving out
+ * any that have been removed */
+inline static void _set_add(const kdtree *tree, kdtree_result_set *set,
+                            size_t offset, size_t count) {
+  const unsigned char *removed = tree->pending.removed;
+  size_t i, idx;
+
+  if (set->mode == KDTREE_SET_BITMAP) {
+    for (i = offset; i < offset + count; i++) {
+      idx = _point_index(&tree->points, i);
+      if (removed && removed[idx]) continue;
+      set->bits[idx / 64] |= (uint64_t)1 << (idx % 64);
+      set->size++;
+    }
+  } else if (removed) {
+    for (i = offset; i < offset + count; i++) {
+      if (!removed[_point_index(&tree->points, i)]) _set_add_run(set, i, 1);
+    }
+  } else {
+    _set_add_run(set, offset, count);
+  }
+}
+
+/* add a run of count positions from offset to a result set. Runs that
+ * continue the last run are merged into it */
+inline static void _set_add_run(kdtree_result_set *set, size_t offset,
+                                size_t count) {
+  const size_t last = set->runs - 1;
+
+  set->size += count;
+  if (set->runs > 0 && set->run_offset[last] + set->run_count[last] == offset) {
+    set->run_count[last] += count;
+    return;
+  }
+  _set_reserve(set, set->runs + 1);
+  set->run_offset[set->runs] = offset;
+  set->run_count[set->runs] = count;
+  set->runs++;
+}
+
+/* make sure a result set has memory for count words or runs */
+inline static void _set_reserve(kdtree_result_set *set, size_t count) {
+  if (count <= set->capacity) return;
+  if (set->capacity == 0) set->capacity = KDTREE_ITERATOR_INITIAL_SIZE;
+  while (count > set->capacity) {
+    set->capacity *= KDTREE_ITERATOR_GROWTH_RATIO;
+  }
+  if (set->mode == KDTREE_SET_BITMAP) {
+    free(set->bits); /* cleared before use, so need not be kept */
+    set->bits = malloc(sizeof(uint64_t) * set->capacity);
+    assert(set->bits != NULL);
+  } else {
+    set->run_offset = realloc(set->run_offset,
+                              sizeof(size_t) * set->capacity);
+    set->run_count = realloc(set->run_count, sizeof(size_t) * set->capacity);
+    assert(set->run_offset != NULL && set->run_count != NULL);
+  }
+}
+
+/* returns the position of the lowest set bit of a non-zero word, using a
+ * de Bruijn sequence to look it up from the isolated bit */
+inline static size_t _lowest_bit(uint64_t word) {
+  static const unsigned char position[64] = {
+     0,  1, 48,  2, 57, 49, 28,  3, 61, 58, 50, 42, 38, 29, 17,  4,
+    62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12,  5,
+    63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+    46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19,  9, 13,  8,  7,  6
+  };
+  assert(word != 0);
+  return position[((word & (~word + 1)) * 0x03f79d71b4cb0a89ULL) >> 58];
+}
+
+#ifdef KDTREE_STATS
+/* returns a monotonic time in seconds, for timing phases of the build */
+static double _seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ((double)ts.tv_nsec * 1e-9);
+}
+
+/* add the counters of stats to total */
+static void _stats_accumulate(kdtree_search_stats *total,
+                              const kdtree_search_stats *stats) {
+  total->queries += stats->queries;
+  total->nodes_visited += stats->nodes_visited;
+  total->intersection_tests += stats->intersection_tests;
+  total->enclosed_subtrees += stats->enclosed_subtrees;
+  total->leaves_tested += stats->leaves_tested;
+  total->points_tested += stats->points_tested;
+  total->points_accepted += stats->points_accepted;
+  total->reallocations += stats->reallocations;
+}
+#endif
+
+/* get the data and size in bytes of each section of the file written by
+ * kdtree_save(). Absent sections have a size of 0 */
+static void _file_sections(const kdtree *tree, const void *data[],
+                           uint64_t size[]) {
+  size_t i;
+  for (i = 0; i < NUM_SECTIONS; i++) {
+    data[i] = NULL;
+    size[i] = 0;
+  }
+  for (i = 0; i < NDIMS; i++) {
+    data[SECTION_X + i] = tree->points.coord[i];
+    size[SECTION_X + i] = sizeof(double) * tree->count;
+  }
+  if (tree->index_only) {
+    data[SECTION_INDEX] = tree->points.perm;
+    size[SECTION_INDEX] = sizeof(uint32_t) * tree->count;
+  } else {
+    data[SECTION_INDEX] = tree->points.idx;
+    size[SECTION_INDEX] = sizeof(size_t) * tree->count;
+  }
+  if (tree->layout == KDTREE_LAYOUT_POINTER) {
+    data[SECTION_NODES] = tree->node_data;
+    size[SECTION_NODES] = sizeof(struct tree_node) * tree->max_nodes;
+  }
+  data[SECTION_BOUNDS] = tree->node_bounds;
+  size[SECTION_BOUNDS] = sizeof(struct space) * tree->max_nodes;
+  if (tree->node_sums) {
+    data[SECTION_SUMS] = tree->node_sums;
+    size[SECTION_SUMS] = sizeof(struct node_sums) * tree->max_nodes;
+  }
+  if (tree->node_sums && tree->weight) {
+    data[SECTION_WEIGHT] = tree->weight;
+    size[SECTION_WEIGHT] = sizeof(double) * tree->count;
+  }
+}
+
+/* returns true if header describes a tree that this host can map, within a
+ * file of file_size bytes. The shape of the tree is checked against that
+ * implied by its count and leaf size, but the contents of nodes are not */
+static int _valid_header(const struct file_header *header, size_t file_size) {
+  static struct node_sums present; /* marks node_sums as present in shape */
+  kdtree shape;
+  const void *data[NUM_SECTIONS];
+  uint64_t size[NUM_SECTIONS];
+  size_t i, max_nodes;
+
+  if (memcmp(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 ||
+      header->version != KDTREE_FILE_VERSION ||
+      header->byte_order != FILE_BYTE_ORDER ||
+      header->size_t_bytes != sizeof(size_t) ||
+      header->file_size != file_size ||
+      header->count < 2 || header->count > SIZE_MAX / sizeof(double) ||
+      header->leaf_size == 0 || header->leaf_size > SIZE_MAX ||
+      (header->weighted && !header->aggregate) ||
+      (header->layout != KDTREE_LAYOUT_POINTER &&
+       header->layout != KDTREE_LAYOUT_IMPLICIT)) {
+    return 0;
+  }
+  if (header->layout == KDTREE_LAYOUT_IMPLICIT) {
+    if (header->leaf_depth != _leaf_depth((size_t)header->count,
+                                          (size_t)header->leaf_size)) {
+      return 0;
+    }
+    max_nodes = ((size_t)2 << header->leaf_depth) - 1;
+  } else {
+    max_nodes = (_count_leaves((size_t)header->count,
+                               (size_t)header->leaf_size) * 2) - 1;
+  }
+  if (header->max_nodes != max_nodes) return 0;
+
+  /* every section must be present with the expected size, and in the file */
+  memset(&shape, 0, sizeof(shape));
+  shape.count = (size_t)header->count;
+  shape.max_nodes = max_nodes;
+  shape.layout = header->layout;
+  shape.index_only = (header->index_only != 0);
+  shape.node_sums = header->aggregate ? &present : NULL;
+  shape.weight = header->weighted ? &present.weight : NULL;
+  _file_sections(&shape, data, size);
+  for (i = 0; i < NUM_SECTIONS; i++) {
+    if (header->size[i] != size[i]) return 0;
+    if (size[i] == 0) continue;
+    if (header->offset[i] % FILE_ALIGNMENT != 0 ||
+        header->offset[i] < sizeof(struct file_header) ||
+        header->offset[i] > file_size ||
+        size[i] > file_size - header->offset[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* release the file mapped by kdtree_load(), leaving the tree empty */
+static void _unmap(kdtree *tree) {
+  size_t d;
+  if (tree->mapping == NULL) return;
+  munmap(tree->mapping, tree->mapping_size);
+  tree->mapping = NULL;
+  tree->mapping_size = 0;
+  for (d = 0; d < NDIMS; d++) tree->points.coord[d] = NULL;
+  tree->points.idx = NULL;
+  tree->points.perm = NULL;
+  tree->node_data = NULL;
+  tree->node_bounds = NULL;
+  tree->node_sums = NULL;
+  tree->count = 0;
+  tree->max_nodes = 0;
+  tree->capacity = 0;
+  tree->node_capacity = 0;
+}
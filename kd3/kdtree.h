@@ -8,7 +8,7 @@
  * \endcode
  */
 #include <stdlib.h> /* size_t */
-#include <stdint.h> /* SIZE_MAX */
+#include <stdint.h> /* SIZE_MAX, uint32_t */
 
 /* initial size for internal memory of iterator */
 #define KDTREE_ITERATOR_INITIAL_SIZE 50
@@ -16,6 +16,56 @@
 /* ratio to grow memory when iterator is full */
 #define KDTREE_ITERATOR_GROWTH_RATIO 2
 
+/* ratio to grow memory for points and nodes when a tree outgrows it */
+#define KDTREE_CAPACITY_GROWTH_RATIO 1.5
+
+/* pending inserts and removals tolerated by any tree before it is rebuilt */
+#define KDTREE_INSERT_BUFFER_SIZE 64
+
+/* default fraction of points that may be pending inserts and removals */
+#define KDTREE_UPDATE_FRACTION 0.05
+
+/* subtrees with fewer points than this are always built serially */
+#define KDTREE_PARALLEL_CUTOFF 10000
+
+/* number of points gathered at a time when scanning index-only trees */
+#define KDTREE_GATHER_SIZE 64
+
+/* number of queries handed to a thread at a time by batch searches */
+#define KDTREE_BATCH_BLOCK_SIZE 256
+
+/* default maximum number of points held by a leaf node */
+#define KDTREE_LEAF_SIZE 8
+
+/* default growth in tree cost tolerated by kdtree_refit() before rebuilding */
+#define KDTREE_REFIT_TOLERANCE 0.25
+
+/* how nodes of the tree are stored (see kdtree_options.layout) */
+#define KDTREE_LAYOUT_POINTER  0 /* nodes in pre-order, linked by pointers */
+#define KDTREE_LAYOUT_IMPLICIT 1 /* perfect tree in level order, no links */
+
+/* how points are partitioned between nodes (see kdtree_options.build_method) */
+#define KDTREE_BUILD_MEDIAN 0 /* select the median along each axis in turn */
+#define KDTREE_BUILD_MORTON 1 /* radix sort along a Morton curve */
+
+/* spatial index built by kdtree_build() (see kdtree_options.index) */
+#define KDTREE_INDEX_TREE 0 /* k-d tree */
+#define KDTREE_INDEX_GRID 1 /* uniform grid of cells (cell list) */
+#define KDTREE_INDEX_AUTO 2 /* grid if the density of points looks uniform */
+
+/* points sampled by KDTREE_INDEX_AUTO to estimate the density, which must
+ * vary between cells by no more than KDTREE_GRID_MAX_VARIATION (the squared
+ * coefficient of variation of their counts) for a grid to be used */
+#define KDTREE_GRID_SAMPLE 4096
+#define KDTREE_GRID_MAX_VARIATION 0.5
+
+/* how kdtree_search_space_set() holds the points found */
+#define KDTREE_SET_BITMAP 0 /* a bit per index, iterated in index order */
+#define KDTREE_SET_RUNS   1 /* ranges of positions in tree order */
+
+/* version of the file format written by kdtree_save() */
+#define KDTREE_FILE_VERSION 1
+
 /* control value to indicate the end of iteration */
 #ifndef SIZE_MAX
   #define KDTREE_END ((size_t)-1)
@@ -23,18 +73,17 @@
   #define KDTREE_END SIZE_MAX
 #endif
 
-struct data_point {
-  double x;
-  double y;
-  double z;
-  size_t idx; /* index of original data point */
-};
-
-struct tree_node {
-  struct tree_node *left;
-  struct tree_node *right;
-  double split;
-  size_t idx;
+/* points of the tree, in tree order.
+ *
+ * Coordinates are normally copied, with each axis stored as a separate array
+ * so that the points within a leaf bucket are contiguous. Trees built with
+ * options.index_only instead keep only a 32-bit permutation, and coord refers
+ * to the caller's own arrays (in their original order).
+ */
+struct point_data {
+  double *coord[3]; /* x, y and z coordinates */
+  size_t *idx;      /* index of original data point (NULL if index_only) */
+  uint32_t *perm;   /* index of original data point (index_only trees) */
 };
 
 struct boundaries {
@@ -46,32 +95,358 @@ struct space {
   struct boundaries dim[3];
 };
 
+/* nodes of trees built with KDTREE_LAYOUT_POINTER. The bounds of each node
+ * are held separately in kdtree.node_bounds. Children are referred to by
+ * their position in the node arrays rather than by pointer, so that nodes
+ * can be saved and mapped back from disk as they are */
+struct tree_node {
+  size_t left;         /* position of the left child (0 for leaves) */
+  size_t right;        /* position of the right child (0 for leaves) */
+  size_t idx;          /* offset of the first point covered by this node */
+  size_t count;        /* number of points covered by this node */
+};
+
+
+/* points inserted into or removed from the tree since it was last built
+ * (see kdtree_insert()). Inserted points are held unsorted, and scanned by
+ * every search. Points removed from the tree are flagged by their index and
+ * skipped by searches */
+struct pending_changes {
+  struct point_data inserted;  /* coordinates and indices of inserted points */
+  size_t inserted_count;
+  size_t inserted_capacity;
+  unsigned char *removed;      /* flag for each index in the tree */
+  size_t *position;            /* tree order position of each index */
+  size_t index_limit;          /* entries in removed and position */
+  size_t *removed_idx;         /* indices flagged in removed */
+  size_t removed_count;
+  size_t removed_capacity;
+  int sparse;                  /* indices are not all below the count */
+};
+
+/* kept by trees built with options.self_search for kdtree_search_point().
+ * No point outside a node lies strictly within the cell of the node, so a
+ * search box strictly within the cell only needs to search below the node */
+struct self_search {
+  size_t *leaf;                /* leaf holding each index (or KDTREE_END) */
+  size_t index_limit;          /* entries in leaf */
+  size_t *parent;              /* parent of each node (pointer layout only) */
+  struct space *cell;          /* cell of each node */
+};
+
+/* uniform grid of cells (a cell list) built instead of a k-d tree with
+ * KDTREE_INDEX_GRID. Points are held in cell order, and the non-empty cells
+ * are the leaves of a balanced tree of nodes in the pointer layout, which
+ * searches other than kdtree_search() and kdtree_search_space() traverse */
+struct grid {
+  double origin[3];            /* lowest corner of the grid */
+  double inverse_size[3];      /* reciprocal of the side of cells */
+  size_t dims[3];              /* cells along each axis */
+  size_t cells;                /* total cells, 0 if built as a tree */
+  size_t *leaf;                /* leaf node of each cell (or KDTREE_END) */
+  size_t capacity;             /* cells that leaf is allocated for */
+};
+
+/* sums of the points covered by a node, kept if options.aggregate is set */
+struct node_sums {
+  double sum[3];       /* sum of x, y and z coordinates */
+  double weight;       /* sum of weights */
+};
+
+/* traversal counters, collected by kdtree_search(), kdtree_search_space(),
+ * kdtree_search_radius(), kdtree_search_nearest() and the batch searches if
+ * KDTREE_STATS is defined (consistently, wherever kdtree.h is included).
+ * Without it the counters and the code that updates them are compiled out */
+typedef struct {
+  size_t queries;            /* number of searches */
+  size_t nodes_visited;      /* nodes reached by the traversal */
+  size_t intersection_tests; /* tests of node bounds against the query */
+  size_t enclosed_subtrees;  /* subtrees reported without testing points */
+  size_t leaves_tested;      /* leaves whose points were tested */
+  size_t points_tested;      /* points tested against the query */
+  size_t points_accepted;    /* tested points that were within the query */
+  size_t reallocations;      /* growth of iterator memory */
+} kdtree_search_stats;
+
+/* time in seconds spent in each phase of the last kdtree_build() */
+typedef struct {
+  double allocate;     /* (re)allocating memory for points and nodes */
+  double copy;         /* copying in coordinates and indices */
+  double construct;    /* partitioning points and computing node bounds */
+  double cost;         /* computing the cost of the tree */
+  double total;
+} kdtree_build_stats;
+
+/* statistics held by the tree (KDTREE_STATS only) */
+typedef struct {
+  kdtree_search_stats search; /* totals over all searches since last reset */
+  kdtree_build_stats build;   /* phases of the last build */
+} kdtree_stats;
 
+/* options that control how a tree is built. Initialise with
+ * kdtree_options_init() before changing individual values */
 typedef struct {
+  size_t num_threads;     /* threads used by kdtree_build(). 0 = all cores */
+  size_t parallel_cutoff; /* min points in a subtree to build it on a new thread */
+  size_t leaf_size;       /* max points in a leaf node (bucket) */
+  double refit_tolerance; /* growth in cost before kdtree_refit() rebuilds */
+  int layout;             /* KDTREE_LAYOUT_POINTER or KDTREE_LAYOUT_IMPLICIT */
+  int index_only;         /* read coordinates from caller's arrays */
+  int aggregate;          /* keep sums of each subtree for aggregate queries */
+  const double *weight;   /* weight of each point for aggregates (NULL = 1) */
+  double period[3];       /* periodic box length of each axis (0 = none) */
+  int period_images;      /* record the image of each periodic result */
+  double update_fraction; /* pending inserts/removals before a rebuild */
+  int build_method;       /* KDTREE_BUILD_MEDIAN or KDTREE_BUILD_MORTON */
+  int self_search;        /* keep the leaf of each point for searches from it */
+  int index;              /* KDTREE_INDEX_TREE, _GRID or _AUTO */
+  double grid_cell_size;  /* min side of grid cells (0 = leaf_size points) */
+} kdtree_options;
+
+typedef struct {
+  kdtree_options options;
   size_t count;
   size_t max_nodes;
-  size_t next_node;
-  struct data_point *points;
-  struct tree_node *node_data;
-  struct tree_node *root;
+  size_t capacity;             /* points that memory is allocated for */
+  size_t node_capacity;        /* nodes that memory is allocated for */
+  int layout;                  /* layout the tree was built with */
+  int index_only;              /* set if built with options.index_only */
+  size_t leaf_depth;           /* depth of all leaves (implicit layout) */
+  struct point_data points;
+  struct tree_node *node_data; /* nodes (pointer layout), NULL otherwise */
+  struct space *node_bounds;   /* bounding box of each node */
+  struct node_sums *node_sums; /* sums of each node, if options.aggregate */
+  const double *weight;        /* weights used for node_sums */
+  struct pending_changes pending; /* inserts and removals since build */
+  struct self_search self;     /* if options.self_search */
+  struct grid grid;            /* if built as a grid (see options.index) */
+  double build_cost;  /* cost of the tree when it was last built */
+  double cost;        /* cost of the tree after it was last refit */
+  void *mapping;      /* file mapped by kdtree_load(), NULL if built */
+  size_t mapping_size;
+#ifdef KDTREE_STATS
+  kdtree_stats stats; /* not updated atomically, see kdtree_stats_reset() */
+#endif
 } kdtree;
 
 typedef struct {
   size_t *data;
+  double *distance;  /* squared distances, if with_distance is set */
+  int with_distance; /* set by radius and nearest neighbour searches */
+  int *image;        /* periodic image of each result (3 ints per entry) */
+  int with_image;    /* set by periodic searches if options.period_images */
   size_t capacity;
   size_t size;
   size_t current;
+#ifdef KDTREE_STATS
+  kdtree_search_stats stats; /* counters for the last search */
+#endif
 } kdtree_iterator;
 
+/* results of batch searches in compressed sparse row (CSR) form. The
+ * neighbours of query i are index[offset[i]] ... index[offset[i + 1] - 1] */
+typedef struct {
+  size_t count;      /* number of queries */
+  size_t *offset;    /* start of each row in index (count + 1 entries) */
+  size_t *index;     /* indices of neighbours */
+  double *distance;  /* squared distances, if with_distance is set */
+  int with_distance;
+  size_t capacity;   /* memory allocated for index and distance */
+} kdtree_neighbours;
+
+/* points found by kdtree_search_space_set(), without an entry per point.
+ * A bitmap has bit i % 64 of bits[i / 64] set if the point with index i was
+ * found. Runs are ranges of positions in tree order (see struct point_data),
+ * from run_offset[r] up to run_offset[r] + run_count[r], and refer to the
+ * tree until it is next changed */
+typedef struct {
+  int mode;               /* KDTREE_SET_BITMAP or KDTREE_SET_RUNS */
+  const void *tree;       /* tree searched, for runs */
+  uint64_t *bits;
+  size_t words;           /* words of bits in use */
+  size_t *run_offset;
+  size_t *run_count;
+  size_t runs;            /* runs in use */
+  size_t size;            /* number of points found */
+  size_t capacity;        /* words or runs allocated */
+  size_t current;         /* next index (bitmap) or position in run */
+  size_t current_run;
+} kdtree_result_set;
+
+/* results of aggregate queries */
+typedef struct {
+  size_t count;      /* number of points found */
+  double sum[3];     /* sum of their x, y and z coordinates */
+  double weight;     /* sum of their weights (count, if no weights given) */
+} kdtree_aggregate;
+
+/* pairs of points found by kdtree_self_join() */
+typedef struct {
+  size_t *first;     /* index of the first point of each pair */
+  size_t *second;    /* index of the second point (first < second) */
+  double *distance;  /* squared distance between the points */
+  size_t size;
+  size_t capacity;
+} kdtree_pairs;
+
+/* a pair of trees, one published to readers while the other is rebuilt in
+ * the background (see kdtree_buffer_build()) */
+typedef struct kdtree_buffer kdtree_buffer;
+
+/* called with each point found by kdtree_visit_radius() and
+ * kdtree_visit_space() */
+typedef void (*kdtree_visitor)(void *data, size_t idx, double distance_squared);
+
+/* called with the points of each leaf visited by
+ * kdtree_visit_radius_leaves(), which are those from offset up to
+ * offset + count in tree->points */
+typedef void (*kdtree_leaf_visitor)(void *data, const kdtree *tree,
+                                    size_t offset, size_t count);
+
+void kdtree_options_init(kdtree_options *options);
+kdtree* kdtree_create(const kdtree_options *options);
 void kdtree_build(double *x, double *y, double *z, size_t count, kdtree **tree);
+int kdtree_refit(double *x, double *y, double *z, size_t count,
+                 kdtree **tree_ptr);
+void kdtree_insert(kdtree *tree, size_t idx, double x, double y, double z);
+void kdtree_remove(kdtree *tree, size_t idx);
+void kdtree_flush(kdtree *tree);
+int kdtree_save(const kdtree *tree, const char *path);
+kdtree* kdtree_load(const char *path);
 void kdtree_delete(kdtree **tree_ptr);
+kdtree_buffer* kdtree_buffer_create(const kdtree_options *options);
+int kdtree_buffer_build(kdtree_buffer *buffer, const double *x,
+                        const double *y, const double *z, size_t count);
+int kdtree_buffer_poll(kdtree_buffer *buffer);
+void kdtree_buffer_wait(kdtree_buffer *buffer);
+int kdtree_buffer_publish(kdtree_buffer *buffer);
+kdtree* kdtree_buffer_acquire(kdtree_buffer *buffer);
+void kdtree_buffer_release(kdtree_buffer *buffer, kdtree *tree);
+void kdtree_buffer_delete(kdtree_buffer **buffer_ptr);
+#ifdef KDTREE_STATS
+void kdtree_stats_reset(kdtree *tree);
+#endif
 void kdtree_search(kdtree *tree, kdtree_iterator **iter_ptr,
                    double x, double y, double z, double apothem);
+void kdtree_search_point(kdtree *tree, kdtree_iterator **iter_ptr,
+                         size_t idx, double apothem);
 void kdtree_search_space(kdtree *tree, kdtree_iterator **iter_ptr,
                          double x_min, double x_max,
                          double y_min, double y_max,
                          double z_min, double z_max);
+void kdtree_search_radius(kdtree *tree, kdtree_iterator **iter_ptr,
+                          double x, double y, double z, double radius);
+void kdtree_search_radius_batch(kdtree *tree, kdtree_neighbours **nbr_ptr,
+                                const double *x, const double *y,
+                                const double *z, size_t count,
+                                double radius, int with_distance);
+void kdtree_search_radius_all(kdtree *tree, kdtree_neighbours **nbr_ptr,
+                              double radius, int with_distance);
+void kdtree_search_nearest(kdtree *tree, kdtree_iterator **iter_ptr,
+                           double x, double y, double z, size_t k);
+void kdtree_search_nearest_batch(kdtree *tree, kdtree_neighbours **nbr_ptr,
+                                 const double *x, const double *y,
+                                 const double *z, size_t count,
+                                 size_t k, int with_distance);
+void kdtree_neighbours_delete(kdtree_neighbours **nbr_ptr);
+void kdtree_visit_radius(kdtree *tree, double x, double y, double z,
+                         double radius, kdtree_visitor visit, void *data);
+void kdtree_visit_radius_leaves(kdtree *tree, double x, double y, double z,
+                                double radius, kdtree_leaf_visitor visit,
+                                void *data);
+void kdtree_visit_space(kdtree *tree, double x_min, double x_max,
+                        double y_min, double y_max,
+                        double z_min, double z_max,
+                        kdtree_visitor visit, void *data);
+size_t kdtree_count_space(kdtree *tree, double x_min, double x_max,
+                          double y_min, double y_max,
+                          double z_min, double z_max);
+size_t kdtree_count_radius(kdtree *tree, double x, double y, double z,
+                           double radius);
+void kdtree_aggregate_space(kdtree *tree, kdtree_aggregate *result,
+                            double x_min, double x_max,
+                            double y_min, double y_max,
+                            double z_min, double z_max);
+void kdtree_aggregate_radius(kdtree *tree, kdtree_aggregate *result,
+                             double x, double y, double z, double radius);
+void kdtree_self_join(kdtree *tree, kdtree_pairs **pairs_ptr, double radius);
+void kdtree_pairs_delete(kdtree_pairs **pairs_ptr);
+void kdtree_get_order(const kdtree *tree, size_t *order);
+void kdtree_morton_order(const double *x, const double *y, const double *z,
+                         size_t count, size_t *order);
+void kdtree_apply_order(const size_t *order, size_t count,
+                        void *data, size_t size, void *out);
 size_t kdtree_iterator_get_next(kdtree_iterator *iter);
+size_t kdtree_iterator_get_next_with_image(kdtree_iterator *iter,
+                                           double *distance_squared,
+                                           int image[3]);
+size_t kdtree_iterator_get_next_with_distance(kdtree_iterator *iter,
+                                              double *distance_squared);
 void kdtree_iterator_rewind(kdtree_iterator *iter);
 void kdtree_iterator_sort(kdtree_iterator *iter);
 void kdtree_iterator_delete(kdtree_iterator **iter_ptr);
+void kdtree_search_space_set(kdtree *tree, kdtree_result_set **set_ptr,
+                             int mode, double x_min, double x_max,
+                             double y_min, double y_max,
+                             double z_min, double z_max);
+int kdtree_result_set_contains(const kdtree_result_set *set, size_t idx);
+size_t kdtree_result_set_get_next(kdtree_result_set *set);
+void kdtree_result_set_rewind(kdtree_result_set *set);
+void kdtree_result_set_delete(kdtree_result_set **set_ptr);
+
+/* Define a function
+ *
+ *   static void name(kdtree *tree, double x, double y, double z,
+ *                    double radius, void *data);
+ *
+ * which calls kernel(data, idx, distance_squared) for each point within
+ * radius of x, y, z, as kdtree_visit_radius() does. Since kernel is called
+ * directly from the scan of each leaf, it may be a macro or an inline
+ * function that the compiler can fuse into the scan. Points removed since
+ * the tree was built are skipped, and inserted points scanned afterwards.
+ */
+#define KDTREE_DEFINE_RADIUS_VISITOR(name, kernel)                            \
+  struct name##_args { void *data; double x, y, z, radius_squared; };         \
+  static void name##_leaf(void *arg_, const kdtree *tree_,                    \
+                          size_t offset_, size_t count_) {                    \
+    const struct name##_args *a_ = (const struct name##_args*)arg_;           \
+    const double *x_ = tree_->points.coord[0];                                \
+    const double *y_ = tree_->points.coord[1];                                \
+    const double *z_ = tree_->points.coord[2];                                \
+    const uint32_t *perm_ = tree_->points.perm;                               \
+    const unsigned char *removed_ = tree_->pending.removed;                   \
+    size_t i_, j_, k_;                                                        \
+    double dx_, dy_, dz_, d2_;                                                \
+    for (i_ = offset_; i_ < offset_ + count_; i_++) {                         \
+      j_ = perm_ ? perm_[i_] : i_;                                            \
+      dx_ = x_[j_] - a_->x;                                                   \
+      dy_ = y_[j_] - a_->y;                                                   \
+      dz_ = z_[j_] - a_->z;                                                   \
+      d2_ = (dx_ * dx_) + (dy_ * dy_) + (dz_ * dz_);                          \
+      if (d2_ <= a_->radius_squared) {                                        \
+        k_ = perm_ ? j_ : tree_->points.idx[i_];                              \
+        if (!removed_ || !removed_[k_]) kernel(a_->data, k_, d2_);            \
+      }                                                                       \
+    }                                                                         \
+  }                                                                           \
+  static void name(kdtree *tree_, double qx_, double qy_, double qz_,         \
+                   double radius_, void *data_) {                             \
+    const struct point_data *in_ = &tree_->pending.inserted;                  \
+    struct name##_args a_;                                                    \
+    size_t i_;                                                                \
+    double dx_, dy_, dz_, d2_;                                                \
+    a_.data = data_;                                                          \
+    a_.x = qx_;                                                               \
+    a_.y = qy_;                                                               \
+    a_.z = qz_;                                                               \
+    a_.radius_squared = radius_ * radius_;                                    \
+    kdtree_visit_radius_leaves(tree_, qx_, qy_, qz_, radius_, name##_leaf,    \
+                               &a_);                                          \
+    for (i_ = 0; i_ < tree_->pending.inserted_count; i_++) {                  \
+      dx_ = in_->coord[0][i_] - qx_;                                          \
+      dy_ = in_->coord[1][i_] - qy_;                                          \
+      dz_ = in_->coord[2][i_] - qz_;                                          \
+      d2_ = (dx_ * dx_) + (dy_ * dy_) + (dz_ * dz_);                          \
+      if (d2_ <= a_.radius_squared) kernel(data_, in_->idx[i_], d2_);         \
+    }                                                                         \
+  }
@@ -0,0 +1,427 @@
+/* Header-only C++ front-end to the k-d tree, specialised at compile time.
+ *
+ * kd3::tree<Scalar, Dims, Index, LeafSize> builds the same balanced tree as
+ * kdtree_build() with KDTREE_LAYOUT_IMPLICIT: a perfect binary tree stored
+ * in level order, split at the median along each axis in turn, whose node
+ * ranges are computed from their position so that only the bounding box of
+ * each node is stored. Here the number of dimensions, the coordinate type
+ * (float or double), the type used for point indices and the leaf size are
+ * all template parameters. Loops over axes therefore have a constant trip
+ * count and are unrolled, and float trees move half the data of double ones.
+ *
+ *   kd3::tree<float, 2> tree;
+ *   const float *coord[2] = { x, y };
+ *   std::vector<std::uint32_t> found;
+ *   tree.build(coord, count);
+ *   tree.search_radius(centre, radius, found);
+ *
+ * Results are indices into the arrays the tree was built from. Unlike the C
+ * API the tree always copies the coordinates, and searches write to standard
+ * vectors (cleared first, so their memory is reused across searches).
+ */
+#ifndef KDTREE_HPP
+#define KDTREE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace kd3 {
+
+template <typename Scalar, std::size_t Dims, typename Index = std::uint32_t,
+          std::size_t LeafSize = 8>
+class tree {
+ public:
+  typedef Scalar scalar_type;
+  typedef Index index_type;
+  static const std::size_t dims = Dims;
+  static const std::size_t leaf_size = LeafSize;
+
+  /* axis-aligned box, with min[d] <= max[d] along each axis */
+  struct box {
+    Scalar min[Dims];
+    Scalar max[Dims];
+  };
+
+  tree() : count_(0), leaf_depth_(0) {}
+
+  /* Build the tree over count points, whose coordinates along axis d are
+   * coord[d][0] ... coord[d][count - 1]. Memory is reused when rebuilding.
+   */
+  void build(const Scalar *const coord[Dims], std::size_t count) {
+    std::size_t d, i;
+
+    assert(count > 1);
+    assert(count - 1 <= static_cast<std::size_t>(
+                            std::numeric_limits<Index>::max()));
+    count_ = count;
+    leaf_depth_ = 0;
+    while (((count - 1) >> leaf_depth_) + 1 > LeafSize) leaf_depth_++;
+
+    for (d = 0; d < Dims; d++) {
+      coord_[d].assign(coord[d], coord[d] + count);
+    }
+    idx_.resize(count);
+    for (i = 0; i < count; i++) idx_[i] = static_cast<Index>(i);
+    bounds_.resize((static_cast<std::size_t>(2) << leaf_depth_) - 1);
+    build_node(0, 0);
+  }
+
+  /* returns the number of points in the tree */
+  std::size_t size() const { return count_; }
+
+  /* find the points within space (including its boundary) */
+  void search_space(const box &space, std::vector<Index> &result) const {
+    std::size_t stack[max_depth];
+    std::size_t top = 0, node = 0, offset, count;
+
+    result.clear();
+    for (;;) {
+      const box &bounds = bounds_[node];
+      if (intersects(space, bounds)) {
+        node_points(node, offset, count);
+        if (encloses(space, bounds)) {
+          result.insert(result.end(), idx_.begin() + offset,
+                        idx_.begin() + offset + count);
+        } else if (is_leaf(node)) {
+          filter_space(space, offset, count, result);
+        } else {
+          assert(top < max_depth);
+          stack[top++] = 2 * node + 2;
+          node = 2 * node + 1;
+          continue;
+        }
+      }
+      if (top == 0) break;
+      node = stack[--top];
+    }
+  }
+
+  /* find the points within radius of centre, and (if distance is not NULL)
+   * the squared distance of each from it */
+  void search_radius(const Scalar centre[Dims], Scalar radius,
+                     std::vector<Index> &result,
+                     std::vector<Scalar> *distance = 0) const {
+    std::size_t stack[max_depth];
+    std::size_t top = 0, node = 0, offset, count;
+    const Scalar radius_squared = radius * radius;
+
+    assert(radius >= 0);
+    result.clear();
+    if (distance) distance->clear();
+    for (;;) {
+      if (distance_to(centre, bounds_[node]) <= radius_squared) {
+        if (is_leaf(node)) {
+          node_points(node, offset, count);
+          filter_radius(centre, radius_squared, offset, count, result,
+                        distance);
+        } else {
+          assert(top < max_depth);
+          stack[top++] = 2 * node + 2;
+          node = 2 * node + 1;
+          continue;
+        }
+      }
+      if (top == 0) break;
+      node = stack[--top];
+    }
+  }
+
+  /* find the k points nearest to centre, nearest-first, along with their
+   * squared distances if distance is not NULL. If the tree holds fewer than
+   * k points, all of them are found. As with kdtree_search_nearest(), the
+   * nearer child of each branch is visited first, and subtrees further than
+   * the kth nearest point found so far are skipped */
+  void search_nearest(const Scalar centre[Dims], std::size_t k,
+                      std::vector<Index> &result,
+                      std::vector<Scalar> *distance = 0) const {
+    std::pair<std::size_t, Scalar> stack[max_depth];
+    std::vector<std::pair<Scalar, Index> > heap; /* max-heap on distance */
+    std::size_t top = 0, node = 0, near, far, offset, count, i;
+    Scalar limit = std::numeric_limits<Scalar>::max(), d2, near_distance,
+           far_distance;
+
+    result.clear();
+    if (distance) distance->clear();
+    if (k > count_) k = count_;
+    if (k == 0) return;
+    heap.reserve(k);
+
+    for (;;) {
+      if (is_leaf(node)) {
+        node_points(node, offset, count);
+        for (i = offset; i < offset + count; i++) {
+          d2 = distance_to(centre, i);
+          if (d2 > limit) continue;
+          if (heap.size() < k) {
+            heap.push_back(std::make_pair(d2, idx_[i]));
+            std::push_heap(heap.begin(), heap.end());
+          } else if (d2 < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = std::make_pair(d2, idx_[i]);
+            std::push_heap(heap.begin(), heap.end());
+          }
+          if (heap.size() == k) limit = heap.front().first;
+        }
+      } else {
+        near = 2 * node + 1;
+        far = near + 1;
+        near_distance = distance_to(centre, bounds_[near]);
+        far_distance = distance_to(centre, bounds_[far]);
+        if (far_distance < near_distance) {
+          std::swap(near, far);
+          std::swap(near_distance, far_distance);
+        }
+        if (near_distance <= limit) {
+          if (far_distance <= limit) {
+            assert(top < max_depth);
+            stack[top++] = std::make_pair(far, far_distance);
+          }
+          node = near;
+          continue;
+        }
+      }
+
+      /* resume from the next pending subtree that could still be in range */
+      while (top > 0 && stack[top - 1].second > limit) top--;
+      if (top == 0) break;
+      node = stack[--top].first;
+    }
+
+    std::sort_heap(heap.begin(), heap.end());
+    for (i = 0; i < heap.size(); i++) {
+      result.push_back(heap[i].second);
+      if (distance) distance->push_back(heap[i].first);
+    }
+  }
+
+  /* call visit(idx, distance_squared) for each point within radius of
+   * centre, in no particular order. The visitor is inlined into the scan of
+   * each leaf */
+  template <typename Visitor>
+  void visit_radius(const Scalar centre[Dims], Scalar radius,
+                    Visitor visit) const {
+    std::size_t stack[max_depth];
+    std::size_t top = 0, node = 0, offset, count, i;
+    const Scalar radius_squared = radius * radius;
+    Scalar d2;
+
+    assert(radius >= 0);
+    for (;;) {
+      if (distance_to(centre, bounds_[node]) <= radius_squared) {
+        if (is_leaf(node)) {
+          node_points(node, offset, count);
+          for (i = offset; i < offset + count; i++) {
+            d2 = distance_to(centre, i);
+            if (d2 <= radius_squared) visit(idx_[i], d2);
+          }
+        } else {
+          assert(top < max_depth);
+          stack[top++] = 2 * node + 2;
+          node = 2 * node + 1;
+          continue;
+        }
+      }
+      if (top == 0) break;
+      node = stack[--top];
+    }
+  }
+
+ private:
+  /* maximum depth of the tree (see MAX_DEPTH in kdtree.c) */
+  static const std::size_t max_depth = 64;
+
+  /* returns the offset of the first point covered by the node at position
+   * within depth, i.e. floor(position * count / 2^depth) (see
+   * _split_point() in kdtree.c) */
+  std::size_t split_point(std::size_t depth, std::size_t position) const {
+    const std::size_t mask = (static_cast<std::size_t>(1) << depth) - 1;
+    return (position * (count_ >> depth)) +
+           static_cast<std::size_t>(
+               (static_cast<unsigned long long>(position) * (count_ & mask)) >>
+               depth);
+  }
+
+  /* set offset and count to the range of points covered by node */
+  void node_points(std::size_t node, std::size_t &offset,
+                   std::size_t &count) const {
+    std::size_t depth = 0, position = node + 1;
+    while ((position >> (depth + 1)) != 0) depth++;
+    position -= static_cast<std::size_t>(1) << depth;
+    offset = split_point(depth, position);
+    count = split_point(depth, position + 1) - offset;
+  }
+
+  bool is_leaf(std::size_t node) const {
+    return node + 1 >= (static_cast<std::size_t>(1) << leaf_depth_);
+  }
+
+  /* partition the points of node around the median along its axis, then
+   * build its children, or compute its bounds if it is a leaf */
+  void build_node(std::size_t node, std::size_t depth) {
+    std::size_t offset, count, d, left = 2 * node + 1;
+
+    node_points(node, offset, count);
+    if (depth == leaf_depth_) {
+      box &bounds = bounds_[node];
+      for (d = 0; d < Dims; d++) {
+        bounds.min[d] = std::numeric_limits<Scalar>::max();
+        bounds.max[d] = -std::numeric_limits<Scalar>::max();
+        for (std::size_t i = offset; i < offset + count; i++) {
+          bounds.min[d] = std::min(bounds.min[d], coord_[d][i]);
+          bounds.max[d] = std::max(bounds.max[d], coord_[d][i]);
+        }
+      }
+      return;
+    }
+
+    if (count > 1) {
+      select(depth % Dims, static_cast<std::ptrdiff_t>(offset),
+             static_cast<std::ptrdiff_t>(offset + count - 1),
+             static_cast<std::ptrdiff_t>(
+                 split_point(depth + 1, 2 * (node + 1 -
+                     (static_cast<std::size_t>(1) << depth)) + 1) - 1));
+    }
+    build_node(left, depth + 1);
+    build_node(left + 1, depth + 1);
+    for (d = 0; d < Dims; d++) {
+      bounds_[node].min[d] = std::min(bounds_[left].min[d],
+                                      bounds_[left + 1].min[d]);
+      bounds_[node].max[d] = std::max(bounds_[left].max[d],
+                                      bounds_[left + 1].max[d]);
+    }
+  }
+
+  /* Hoare's FIND along axis, as select_on_axis() in kdtree.c. On return,
+   * position k holds the point that would be there were [from, to] sorted */
+  void select(std::size_t axis, std::ptrdiff_t from, std::ptrdiff_t to,
+              std::ptrdiff_t k) {
+    Scalar *const key = &coord_[axis][0];
+    std::ptrdiff_t i, j;
+    std::size_t d;
+    Scalar a, b, c, pivot;
+
+    while (from < to) {
+      a = key[from];
+      b = key[k];
+      c = key[to];
+      pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a))
+                      : ((a < c) ? a : ((b < c) ? c : b));
+      i = from;
+      j = to;
+      do {
+        while (key[i] < pivot) i++;
+        while (pivot < key[j]) j--;
+        if (i <= j) {
+          for (d = 0; d < Dims; d++) std::swap(coord_[d][i], coord_[d][j]);
+          std::swap(idx_[i], idx_[j]);
+          i++;
+          j--;
+        }
+      } while (i <= j);
+      if (j < k) from = i;
+      if (k < i) to = j;
+    }
+  }
+
+  static bool intersects(const box &space, const box &bounds) {
+    bool result = true;
+    for (std::size_t d = 0; d < Dims; d++) {
+      result &= (space.min[d] <= bounds.max[d]) &
+                (space.max[d] >= bounds.min[d]);
+    }
+    return result;
+  }
+
+  static bool encloses(const box &space, const box &bounds) {
+    bool result = true;
+    for (std::size_t d = 0; d < Dims; d++) {
+      result &= (bounds.min[d] >= space.min[d]) &
+                (bounds.max[d] <= space.max[d]);
+    }
+    return result;
+  }
+
+  /* returns the squared distance from centre to the nearest point of
+   * bounds (0 if centre is within them) */
+  static Scalar distance_to(const Scalar centre[Dims], const box &bounds) {
+    Scalar total = 0, below, above;
+    for (std::size_t d = 0; d < Dims; d++) {
+      below = std::max(bounds.min[d] - centre[d], Scalar(0));
+      above = std::max(centre[d] - bounds.max[d], Scalar(0));
+      total += (below * below) + (above * above);
+    }
+    return total;
+  }
+
+  /* returns the squared distance from centre to the point at position i in
+   * tree order */
+  Scalar distance_to(const Scalar centre[Dims], std::size_t i) const {
+    Scalar total = 0, delta;
+    for (std::size_t d = 0; d < Dims; d++) {
+      delta = coord_[d][i] - centre[d];
+      total += delta * delta;
+    }
+    return total;
+  }
+
+  /* append the points of a leaf within space. As with _filter_run() in
+   * kdtree.c, every point is written but only those that pass are kept, so
+   * the scan is free of branches */
+  void filter_space(const box &space, std::size_t offset, std::size_t count,
+                    std::vector<Index> &result) const {
+    std::size_t i, d, n = result.size();
+    bool inside;
+
+    result.resize(n + count);
+    for (i = offset; i < offset + count; i++) {
+      inside = true;
+      for (d = 0; d < Dims; d++) {
+        inside &= (coord_[d][i] >= space.min[d]) &
+                  (coord_[d][i] <= space.max[d]);
+      }
+      result[n] = idx_[i];
+      n += inside;
+    }
+    result.resize(n);
+  }
+
+  /* append the points of a leaf within range, as filter_space() */
+  void filter_radius(const Scalar centre[Dims], Scalar radius_squared,
+                     std::size_t offset, std::size_t count,
+                     std::vector<Index> &result,
+                     std::vector<Scalar> *distance) const {
+    std::size_t i, n = result.size();
+    Scalar d2;
+
+    result.resize(n + count);
+    if (distance) distance->resize(n + count);
+    for (i = offset; i < offset + count; i++) {
+      d2 = distance_to(centre, i);
+      result[n] = idx_[i];
+      if (distance) (*distance)[n] = d2;
+      n += (d2 <= radius_squared);
+    }
+    result.resize(n);
+    if (distance) distance->resize(n);
+  }
+
+  std::size_t count_;
+  std::size_t leaf_depth_;
+  std::vector<Scalar> coord_[Dims]; /* coordinates, in tree order */
+  std::vector<Index> idx_;          /* original index, in tree order */
+  std::vector<box> bounds_;         /* bounding box of each node */
+};
+
+/* a tree matching a C tree built with KDTREE_LAYOUT_IMPLICIT, and a compact
+ * one for 2D float data */
+typedef tree<double, 3, std::size_t> tree3d;
+typedef tree<float, 2, std::uint32_t> tree2f;
+
+} /* namespace kd3 */
+
+#endif /* KDTREE_HPP */
@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <float.h>
 #include <stdio.h>
+#include <string.h>
 #include "kd3/kdtree.h"
 
 double *x, *y, *z;
@@ -50,12 +52,310 @@ static void validate(kdtree_iterator *iter, size_t count, const size_t v[]) {
   free(content);
 }
 
-int main(void) {
-  kdtree *tree = NULL;
+/* expect iterator (sorted) to hold idx with the given squared distance */
+static void validate_distance(kdtree_iterator *iter, size_t idx,
+                              double distance_squared) {
+  size_t i;
+  double d;
+  kdtree_iterator_rewind(iter);
+  while ((i = kdtree_iterator_get_next_with_distance(iter, &d)) != KDTREE_END) {
+    if (i == idx) {
+      assert(d == distance_squared);
+      return;
+    }
+  }
+  assert(0); /* idx not found */
+}
+
+/* row of a batch search should hold the points found by a single search of
+ * the same radius around X, Y, Z, with their distances */
+static void compare_row(kdtree *tree, const kdtree_neighbours *nbr,
+                        size_t row, double X, double Y, double Z,
+                        double radius) {
   kdtree_iterator *iter = NULL;
+  size_t j, k;
+  double d;
   
-  initialise_points();
-  kdtree_build(x, y, z, 11, &tree);
+  kdtree_search_radius(tree, &iter, X, Y, Z, radius);
+  assert(row < nbr->count);
+  assert(nbr->offset[row + 1] - nbr->offset[row] == iter->size);
+  for (k = nbr->offset[row]; k < nbr->offset[row + 1]; k++) {
+    kdtree_iterator_rewind(iter);
+    do {
+      j = kdtree_iterator_get_next_with_distance(iter, &d);
+      assert(j != KDTREE_END);
+    } while (j != nbr->index[k]);
+    assert(!nbr->with_distance || d == nbr->distance[k]);
+  }
+  kdtree_iterator_delete(&iter);
+}
+
+/* batch searches should give the same results as individual searches */
+static void test_batch_search(kdtree *tree, double radius) {
+  kdtree_iterator *iter = NULL;
+  kdtree_neighbours *nbr = NULL;
+  size_t i, j, k;
+  double d;
+  
+  kdtree_search_radius_all(tree, &nbr, radius, 1);
+  assert(nbr->count == 11);
+  for (i = 0; i < 11; i++) {
+    kdtree_search_radius(tree, &iter, x[i], y[i], z[i], radius);
+    assert(nbr->offset[i + 1] - nbr->offset[i] == iter->size);
+    for (k = nbr->offset[i]; k < nbr->offset[i + 1]; k++) {
+      kdtree_iterator_rewind(iter);
+      while ((j = kdtree_iterator_get_next_with_distance(iter, &d)) != nbr->index[k]) {
+        assert(j != KDTREE_END);
+      }
+      assert(d == nbr->distance[k]);
+    }
+  }
+  
+  /* arbitrary query points, reusing the neighbours object */
+  kdtree_search_radius_batch(tree, &nbr, x + 3, y + 3, z + 3, 4, radius, 0);
+  assert(nbr->count == 4);
+  assert(nbr->with_distance == 0);
+  for (i = 0; i < 4; i++) {
+    kdtree_search_radius(tree, &iter, x[i + 3], y[i + 3], z[i + 3], radius);
+    assert(nbr->offset[i + 1] - nbr->offset[i] == iter->size);
+  }
+  
+  kdtree_neighbours_delete(&nbr);
+  kdtree_iterator_delete(&iter);
+}
+
+/* nearest neighbours should be returned nearest-first, and no point left out
+ * should be nearer than the last one returned */
+static void test_nearest(kdtree *tree, double X, double Y, double Z, size_t k) {
+  kdtree_iterator *iter = NULL;
+  kdtree_neighbours *nbr = NULL;
+  size_t i, j, n, expected = (k < 11) ? k : 11;
+  double d, last = 0.0;
+  int found[11] = { 0 };
+  
+  kdtree_search_nearest(tree, &iter, X, Y, Z, k);
+  assert(iter->size == expected);
+  for (n = 0; (j = kdtree_iterator_get_next_with_distance(iter, &d)) != KDTREE_END; n++) {
+    assert(d == (x[j] - X) * (x[j] - X) + (y[j] - Y) * (y[j] - Y) +
+                (z[j] - Z) * (z[j] - Z));
+    assert(d >= last);
+    assert(!found[j]);
+    found[j] = 1;
+    last = d;
+  }
+  for (i = 0; i < 11; i++) {
+    d = (x[i] - X) * (x[i] - X) + (y[i] - Y) * (y[i] - Y) +
+        (z[i] - Z) * (z[i] - Z);
+    assert(found[i] || d >= last);
+  }
+  
+  /* batch search with one query gives the same results */
+  kdtree_search_nearest_batch(tree, &nbr, &X, &Y, &Z, 1, k, 1);
+  assert(nbr->count == 1);
+  assert(nbr->offset[1] == expected);
+  for (i = 0; i < expected; i++) {
+    assert(nbr->index[i] == iter->data[i]);
+    assert(nbr->distance[i] == iter->distance[i]);
+  }
+  
+  kdtree_neighbours_delete(&nbr);
+  kdtree_iterator_delete(&iter);
+}
+
+/* batches of several blocks are shared out between threads, and each row
+ * should still match a single search. Morton builds on several threads
+ * should put the points in the same order as kdtree_morton_order() */
+static void test_threaded_batch(int layout, int build_method) {
+  const size_t count = 2 * KDTREE_BATCH_BLOCK_SIZE + 100, k = 5;
+  kdtree_options options;
+  kdtree *tree;
+  kdtree_iterator *iter = NULL;
+  kdtree_neighbours *nbr = NULL;
+  double *coord[3];
+  size_t *order, *expected, i, j, d;
+  
+  /* points scattered over the unit cube */
+  for (d = 0; d < 3; d++) coord[d] = malloc(sizeof(double) * count);
+  for (i = 0; i < count; i++) {
+    coord[0][i] = (double)(i * 7919 % 1009) / 1009.0;
+    coord[1][i] = (double)(i * 3923 % 1013) / 1013.0;
+    coord[2][i] = (double)(i * 6151 % 1019) / 1019.0;
+  }
+  
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = 4;
+  options.num_threads = 4;
+  options.parallel_cutoff = 1;
+  options.build_method = build_method;
+  tree = kdtree_create(&options);
+  kdtree_build(coord[0], coord[1], coord[2], count, &tree);
+  
+  if (build_method == KDTREE_BUILD_MORTON) {
+    order = malloc(sizeof(size_t) * count);
+    expected = malloc(sizeof(size_t) * count);
+    kdtree_get_order(tree, order);
+    kdtree_morton_order(coord[0], coord[1], coord[2], count, expected);
+    for (i = 0; i < count; i++) assert(order[i] == expected[i]);
+    free(order);
+    free(expected);
+  }
+  
+  kdtree_search_radius_all(tree, &nbr, 0.1, 1);
+  assert(nbr->count == count);
+  for (i = 0; i < count; i++) {
+    compare_row(tree, nbr, i, coord[0][i], coord[1][i], coord[2][i], 0.1);
+  }
+  
+  /* queries between the points */
+  kdtree_search_radius_batch(tree, &nbr, coord[1], coord[2], coord[0],
+                             count, 0.15, 0);
+  assert(nbr->count == count);
+  for (i = 0; i < count; i++) {
+    compare_row(tree, nbr, i, coord[1][i], coord[2][i], coord[0][i], 0.15);
+  }
+  
+  kdtree_search_nearest_batch(tree, &nbr, coord[1], coord[2], coord[0],
+                              count, k, 1);
+  assert(nbr->count == count);
+  for (i = 0; i < count; i++) {
+    kdtree_search_nearest(tree, &iter, coord[1][i], coord[2][i],
+                          coord[0][i], k);
+    assert(nbr->offset[i + 1] - nbr->offset[i] == k);
+    for (j = 0; j < k; j++) {
+      assert(nbr->index[nbr->offset[i] + j] == iter->data[j]);
+      assert(nbr->distance[nbr->offset[i] + j] == iter->distance[j]);
+    }
+  }
+  
+  kdtree_neighbours_delete(&nbr);
+  kdtree_iterator_delete(&iter);
+  kdtree_delete(&tree);
+  for (d = 0; d < 3; d++) free(coord[d]);
+}
+
+/* totals of the points passed to a visitor */
+struct totals {
+  size_t count;
+  size_t sum_idx;
+  double sum_distance;
+};
+
+static void add_to_totals(void *data, size_t idx, double distance_squared) {
+  struct totals *totals = (struct totals*)data;
+  totals->count++;
+  totals->sum_idx += idx;
+  totals->sum_distance += distance_squared;
+}
+
+/* the same visitor, inlined into the scan of each leaf */
+#define ADD_TO_TOTALS(data, idx, distance_squared) \
+  add_to_totals(data, idx, distance_squared)
+KDTREE_DEFINE_RADIUS_VISITOR(visit_totals_inline, ADD_TO_TOTALS)
+
+/* visitors should be passed the same points as searches find */
+static void test_visit(kdtree *tree, double X, double Y, double Z,
+                       double radius) {
+  kdtree_iterator *iter = NULL;
+  struct totals expected = { 0, 0, 0.0 }, found = { 0, 0, 0.0 },
+                inlined = { 0, 0, 0.0 }, box = { 0, 0, 0.0 };
+  size_t i;
+  double d;
+  
+  kdtree_search_radius(tree, &iter, X, Y, Z, radius);
+  while ((i = kdtree_iterator_get_next_with_distance(iter, &d)) != KDTREE_END) {
+    add_to_totals(&expected, i, d);
+  }
+  kdtree_visit_radius(tree, X, Y, Z, radius, add_to_totals, &found);
+  visit_totals_inline(tree, X, Y, Z, radius, &inlined);
+  assert(found.count == expected.count && inlined.count == expected.count);
+  assert(found.sum_idx == expected.sum_idx);
+  assert(inlined.sum_idx == expected.sum_idx);
+  assert(found.sum_distance == expected.sum_distance);
+  assert(inlined.sum_distance == expected.sum_distance);
+  
+  kdtree_search(tree, &iter, X, Y, Z, radius);
+  expected.count = expected.sum_idx = 0;
+  while ((i = kdtree_iterator_get_next(iter)) != KDTREE_END) {
+    add_to_totals(&expected, i, 0.0);
+  }
+  kdtree_visit_space(tree, X - radius, X + radius, Y - radius, Y + radius,
+                     Z - radius, Z + radius, add_to_totals, &box);
+  assert(box.count == expected.count);
+  assert(box.sum_idx == expected.sum_idx);
+  
+  kdtree_iterator_delete(&iter);
+}
+
+/* counts and aggregates should agree with the points found by searching. If
+ * the tree was built with weights, they are expected to equal the index */
+static void test_aggregate(kdtree *tree, double X, double Y, double Z,
+                           double radius) {
+  kdtree_iterator *iter = NULL;
+  kdtree_aggregate result;
+  double sum[3], weight;
+  size_t i, count, d;
+  
+  for (d = 0; d < 2; d++) {
+    if (d == 0) {
+      kdtree_search_radius(tree, &iter, X, Y, Z, radius);
+      assert(kdtree_count_radius(tree, X, Y, Z, radius) == iter->size);
+    } else {
+      kdtree_search(tree, &iter, X, Y, Z, radius);
+      assert(kdtree_count_space(tree, X - radius, X + radius, Y - radius,
+                                Y + radius, Z - radius, Z + radius) ==
+             iter->size);
+    }
+    if (tree->node_sums == NULL) continue;
+    
+    count = 0;
+    sum[0] = sum[1] = sum[2] = weight = 0.0;
+    while ((i = kdtree_iterator_get_next(iter)) != KDTREE_END) {
+      count++;
+      sum[0] += x[i]; sum[1] += y[i]; sum[2] += z[i];
+      weight += tree->weight ? (double)i : 1.0;
+    }
+    if (d == 0) {
+      kdtree_aggregate_radius(tree, &result, X, Y, Z, radius);
+    } else {
+      kdtree_aggregate_space(tree, &result, X - radius, X + radius,
+                             Y - radius, Y + radius, Z - radius, Z + radius);
+    }
+    assert(result.count == count);
+    assert(result.sum[0] == sum[0] && result.sum[1] == sum[1]);
+    assert(result.sum[2] == sum[2] && result.weight == weight);
+  }
+  kdtree_iterator_delete(&iter);
+}
+
+/* self join should report each pair within range exactly once */
+static void test_self_join(kdtree *tree, double radius, size_t expected) {
+  kdtree_pairs *pairs = NULL;
+  size_t i, j, k, found;
+  double d;
+  
+  kdtree_self_join(tree, &pairs, radius);
+  assert(pairs->size == expected);
+  for (i = 0; i < 11; i++) {
+    for (j = i + 1; j < 11; j++) {
+      d = (x[i] - x[j]) * (x[i] - x[j]) + (y[i] - y[j]) * (y[i] - y[j]) +
+          (z[i] - z[j]) * (z[i] - z[j]);
+      found = 0;
+      for (k = 0; k < pairs->size; k++) {
+        if (pairs->first[k] == i && pairs->second[k] == j) {
+          assert(pairs->distance[k] == d);
+          found++;
+        }
+      }
+      assert(found == (d <= radius * radius));
+    }
+  }
+  kdtree_pairs_delete(&pairs);
+}
+
+/* run the standard set of searches against a tree built from the test points */
+static void test_search(kdtree *tree) {
+  kdtree_iterator *iter = NULL;
   
   /* match none */
   kdtree_search(tree, &iter, -10, 0, 0, 9.999);
@@ -90,9 +390,807 @@ int main(void) {
   const size_t e5[] = { 0, 1, 2, 5, 6, 9, 10 };
   validate(iter, 7, e5);
   
+  /* spherical searches. corners are sqrt(0.75) from the centre */
+  kdtree_search_radius(tree, &iter, 0.5, 0.5, 0.5, 0.86);
+  const size_t e6[] = { 0, 1, 2 };
+  validate(iter, 3, e6);
+  kdtree_search_radius(tree, &iter, 0.5, 0.5, 0.5, 0.87);
+  validate(iter, 11, e2);
+  
+  /* distances are returned with each point */
+  kdtree_search_radius(tree, &iter, 0.0, 0.0, 0.0, 1.0);
+  const size_t e7[] = { 0, 1, 2, 3, 4, 6, 7 };
+  validate(iter, 7, e7);
+  kdtree_iterator_sort(iter);
+  validate_distance(iter, 0, 0.75);
+  validate_distance(iter, 3, 0.0);
+  validate_distance(iter, 4, 1.0);
+  validate_distance(iter, 7, 1.0);
+  
+  kdtree_iterator_delete(&iter);
+  
+  test_batch_search(tree, 0.5);
+  test_batch_search(tree, 1.0);
+  
+  test_nearest(tree, 0.1, 0.1, 0.1, 1);
+  test_nearest(tree, 0.5, 0.5, 0.5, 4);
+  test_nearest(tree, 0.9, 0.2, 0.6, 5);
+  test_nearest(tree, -1.0, 2.0, 0.5, 11);
+  test_nearest(tree, 0.5, 0.5, 0.5, 20); /* more than there are points */
+  
+  test_visit(tree, 0.5, 0.5, 0.5, 0.86);
+  test_visit(tree, 0.5, 0.5, 0.5, 0.87);
+  test_visit(tree, 0.0, 0.0, 0.0, 1.0);
+  test_visit(tree, 0.9, 0.2, 0.6, 0.5);
+  
+  test_aggregate(tree, 0.5, 0.5, 0.5, 0.86);
+  test_aggregate(tree, 0.5, 0.5, 0.5, 0.87);
+  test_aggregate(tree, 0.0, 0.0, 0.0, 1.0);
+  test_aggregate(tree, 0.5, 0.5, 0.5, 10.0);
+  
+  test_self_join(tree, 0.5, 3);
+  test_self_join(tree, 1.0, 39);
+  test_self_join(tree, 2.0, 55);
+}
+
+/* a tree built using multiple threads should match the serial one */
+static void test_parallel_build(const kdtree *serial) {
+  size_t i;
+  kdtree_options options;
+  kdtree *tree;
+  
+  options = serial->options;
+  options.num_threads = 4;
+  options.parallel_cutoff = 2; /* force threading for small test data */
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  
+  assert(tree->max_nodes == serial->max_nodes);
+  for (i = 0; i < tree->count; i++) {
+    if (tree->index_only) {
+      assert(tree->points.perm[i] == serial->points.perm[i]);
+    } else {
+      assert(tree->points.idx[i] == serial->points.idx[i]);
+    }
+  }
+  for (i = 0; i < tree->max_nodes; i++) {
+    if (tree->layout == KDTREE_LAYOUT_POINTER) {
+      assert(tree->node_data[i].left == serial->node_data[i].left);
+      assert(tree->node_data[i].right == serial->node_data[i].right);
+      assert(tree->node_data[i].idx == serial->node_data[i].idx);
+      assert(tree->node_data[i].count == serial->node_data[i].count);
+    }
+    assert(memcmp(&tree->node_bounds[i], &serial->node_bounds[i],
+                  sizeof(struct space)) == 0);
+  }
+  test_search(tree);
+  kdtree_delete(&tree);
+}
+
+/* build and search trees with the given layout and leaf size */
+static void test_leaf_size(int layout, size_t leaf_size,
+                           size_t expected_nodes) {
+  kdtree_options options;
+  kdtree *tree;
+  
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = leaf_size;
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  assert(tree->max_nodes == expected_nodes);
+  test_search(tree);
+  test_parallel_build(tree);
+  kdtree_delete(&tree);
+}
+
+/* reorder per-point arrays into tree order and Morton order */
+static void test_order(kdtree *tree) {
+  size_t order[11], i;
+  double reordered[11], in_place[11];
+  int seen[11] = { 0 };
+  
+  kdtree_get_order(tree, order);
+  for (i = 0; i < 11; i++) {
+    assert(order[i] < 11 && !seen[order[i]]);
+    seen[order[i]] = 1;
+    in_place[i] = x[i] + (10 * y[i]) + (100 * z[i]);
+  }
+  
+  /* out of place and in place give the same result */
+  kdtree_apply_order(order, 11, in_place, sizeof(double), reordered);
+  kdtree_apply_order(order, 11, in_place, sizeof(double), NULL);
+  for (i = 0; i < 11; i++) {
+    assert(reordered[i] == x[order[i]] + (10 * y[order[i]]) + (100 * z[order[i]]));
+    assert(in_place[i] == reordered[i]);
+  }
+  
+  /* the Morton curve starts at the lowest corner and ends at the highest */
+  kdtree_morton_order(x, y, z, 11, order);
+  assert(order[0] == 3);
+  assert(order[10] == 9);
+  memset(seen, 0, sizeof(seen));
+  for (i = 0; i < 11; i++) {
+    assert(!seen[order[i]]);
+    seen[order[i]] = 1;
+  }
+}
+
+/* index-only trees refer to the caller's coordinates instead of copying them */
+static void test_index_only(int layout, size_t leaf_size) {
+  kdtree_options options;
+  kdtree *tree;
+  
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = leaf_size;
+  options.index_only = 1;
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  assert(tree->points.coord[0] == x);
+  assert(tree->points.idx == NULL);
+  test_search(tree);
+  test_parallel_build(tree);
+  test_order(tree);
+  kdtree_delete(&tree);
+}
+
+/* trees built with the aggregate option keep weighted sums of each node */
+static void test_aggregate_build(int layout, int index_only) {
+  kdtree_options options;
+  kdtree *tree;
+  double weight[11];
+  size_t i;
+  
+  for (i = 0; i < 11; i++) weight[i] = (double)i;
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = 2;
+  options.index_only = index_only;
+  options.aggregate = 1;
+  options.weight = weight;
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  assert(tree->node_sums[0].weight == 55.0);
+  assert(tree->node_sums[0].sum[0] == 5.5);
+  test_search(tree);
+  kdtree_delete(&tree);
+}
+
+/* a saved tree should load from its file and give the same results. Files
+ * that are missing or not trees are rejected */
+static void test_save_load(int layout, int index_only) {
+  const char *path = "run_test.kdtree";
+  kdtree_options options;
+  kdtree *tree, *loaded;
+  FILE *file;
+  
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = 2;
+  options.index_only = index_only;
+  options.aggregate = 1;
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  assert(kdtree_save(tree, path) == 0);
+  
+  loaded = kdtree_load(path);
+  assert(loaded != NULL && loaded->mapping != NULL);
+  assert(loaded->count == 11 && loaded->max_nodes == tree->max_nodes);
+  assert(loaded->points.coord[0] != x); /* coordinates held by the file */
+  test_search(loaded);
+  
+  /* rebuilding replaces the mapping with memory owned by the tree */
+  kdtree_build(x, y, z, 11, &loaded);
+  assert(loaded->mapping == NULL);
+  test_search(loaded);
+  kdtree_delete(&loaded);
+  
+  assert(kdtree_load("no such file") == NULL);
+  file = fopen(path, "wb");
+  fputs("not a tree", file);
+  fclose(file);
+  assert(kdtree_load(path) == NULL);
+  remove(path);
+  kdtree_delete(&tree);
+}
+
+/* with a period of 1 on each axis, the corners of the unit cube are all
+ * images of the same point. Each should be found once, along with the image
+ * nearest to the query */
+static void test_periodic(kdtree *tree) {
+  kdtree_iterator *iter = NULL;
+  kdtree_neighbours *nbr = NULL;
+  const size_t corners[] = { 3, 4, 5, 6, 7, 8, 9, 10 };
+  size_t i;
+  int image[3];
+  double d;
+  
+  tree->options.period[0] = 1.0;
+  tree->options.period[1] = 1.0;
+  tree->options.period[2] = 1.0;
+  tree->options.period_images = 1;
+  
+  kdtree_search_radius(tree, &iter, 0.05, 0.0, 0.0, 0.1);
+  while ((i = kdtree_iterator_get_next_with_image(iter, &d, image))
+         != KDTREE_END) {
+    assert(x[i] + image[0] == 0.0);
+    assert(y[i] + image[1] == 0.0 && z[i] + image[2] == 0.0);
+    assert(d > 0.0024 && d < 0.0026);
+  }
+  kdtree_iterator_rewind(iter);
+  validate(iter, 8, corners);
+  
+  kdtree_search(tree, &iter, 0.95, 0.95, 0.95, 0.1);
+  while ((i = kdtree_iterator_get_next_with_image(iter, NULL, image))
+         != KDTREE_END) {
+    assert(x[i] + image[0] == 1.0);
+    assert(y[i] + image[1] == 1.0 && z[i] + image[2] == 1.0);
+  }
+  kdtree_iterator_rewind(iter);
+  validate(iter, 8, corners);
+  
+  /* each corner neighbours the other seven, but not itself twice */
+  kdtree_search_radius_all(tree, &nbr, 0.1, 0);
+  for (i = 3; i < 11; i++) assert(nbr->offset[i + 1] - nbr->offset[i] == 8);
+  assert(nbr->offset[3] == 9); /* centre points only see each other */
+  
+  tree->options.period[0] = 0.0;
+  tree->options.period[1] = 0.0;
+  tree->options.period[2] = 0.0;
+  tree->options.period_images = 0;
+  kdtree_neighbours_delete(&nbr);
+  kdtree_iterator_delete(&iter);
+}
+
+#ifdef KDTREE_STATS
+/* counters should account for the points found by each search */
+static void test_stats(kdtree *tree) {
+  kdtree_iterator *iter = NULL;
+  kdtree_neighbours *nbr = NULL;
+  
+  kdtree_stats_reset(tree);
+  kdtree_search(tree, &iter, 0.5, 0.5, 0.5, 10.0); /* whole tree enclosed */
+  assert(iter->stats.queries == 1);
+  assert(iter->stats.nodes_visited == 1);
+  assert(iter->stats.enclosed_subtrees == 1);
+  assert(iter->stats.points_tested == 0);
+  
+  kdtree_search_radius(tree, &iter, 0.5, 0.5, 0.5, 0.87);
+  assert(iter->stats.queries == 1);
+  assert(iter->stats.points_accepted == iter->size);
+  assert(iter->stats.points_tested >= iter->size);
+  assert(iter->stats.intersection_tests >= iter->stats.leaves_tested);
+  
+  kdtree_search_radius_all(tree, &nbr, 0.5, 0);
+  assert(tree->stats.search.queries == 13);
+  assert(tree->stats.search.enclosed_subtrees == 1);
+  assert(tree->stats.build.total >= tree->stats.build.construct);
+  
+  kdtree_neighbours_delete(&nbr);
+  kdtree_iterator_delete(&iter);
+}
+#endif
+
+/* refit tree after moving points. Searches should reflect new positions */
+static void test_refit(int layout, int index_only) {
+  kdtree *tree = NULL;
+  kdtree_iterator *iter = NULL;
+  kdtree_options options;
+  size_t i, j;
+  double *x0 = x, *y0 = y, *z0 = z;
+  double xs[11], ys[11], zs[11];
+  
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = 1;
+  options.index_only = index_only;
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  
+  /* small moves are refit */
+  for (i = 0; i < 11; i++) {
+    xs[i] = x[i] + 0.01;
+    ys[i] = y[i] - 0.01;
+    zs[i] = z[i];
+  }
+  assert(kdtree_refit(xs, ys, zs, 11, &tree) == 0);
+  x = xs; y = ys; z = zs;
+  kdtree_search(tree, &iter, 0.01, -0.01, 0, 0.005);
+  const size_t e1[] = { 3 };
+  validate(iter, 1, e1);
+  kdtree_search(tree, &iter, 0, 0, 0, 0.005);
+  validate(iter, 0, e1);
+  test_batch_search(tree, 1.0);
+  test_self_join(tree, 1.0, 39);
+  
+  /* swapping points around degrades the tree, and triggers a rebuild.
+   * Reversing the points happens to improve the cost of the implicit tree,
+   * so it is given a different permutation */
+  const size_t reversed[] = { 2, 6, 8, 9, 10 }, shuffled[] = { 0, 1, 2, 3, 6 };
+  const size_t *e2 = layout == KDTREE_LAYOUT_POINTER ? reversed : shuffled;
+  for (i = 0; i < 11; i++) {
+    j = layout == KDTREE_LAYOUT_POINTER ? 10 - i : (i * 4) % 11;
+    xs[i] = x0[j];
+    ys[i] = y0[j];
+    zs[i] = z0[j];
+  }
+  tree->options.refit_tolerance = 1e9; /* searches correct without rebuild */
+  assert(kdtree_refit(xs, ys, zs, 11, &tree) == 0);
+  kdtree_search_space(tree, &iter, 0.5, 1.5, 0.0, 0.5, -1.0, 1.0);
+  validate(iter, 5, e2);
+  tree->options.refit_tolerance = 0.0; /* rebuild on any loss of quality */
+  assert(kdtree_refit(xs, ys, zs, 11, &tree) == 1);
+  kdtree_search_space(tree, &iter, 0.5, 1.5, 0.0, 0.5, -1.0, 1.0);
+  validate(iter, 5, e2);
+  
+  x = x0; y = y0; z = z0;
+  kdtree_iterator_delete(&iter);
+  kdtree_delete(&tree);
+}
+
+/* inserted and removed points should be found (or not) by searches straight
+ * away, and the tree rebuilt with them once enough changes are pending */
+static void test_insert_remove(int layout) {
+  kdtree_options options;
+  kdtree *tree;
+  kdtree_iterator *iter = NULL;
+  kdtree_neighbours *nbr = NULL;
+  kdtree_pairs *pairs = NULL;
+  double *coord;
+  size_t i, j, k;
+  
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = 2;
+  options.aggregate = 1;
+  tree = kdtree_create(&options);
+  
+  /* build without the corners of the back face, then insert them */
+  kdtree_build(x, y, z, 7, &tree);
+  for (i = 7; i < 11; i++) kdtree_insert(tree, i, x[i], y[i], z[i]);
+  assert(tree->count == 7 && tree->pending.inserted_count == 4);
+  test_nearest(tree, 0.5, 0.5, 0.5, 4);
+  test_nearest(tree, -1.0, 2.0, 0.5, 11);
+  test_visit(tree, 0.5, 0.5, 0.5, 0.87);
+  test_aggregate(tree, 0.0, 0.0, 0.0, 1.0);
+  test_aggregate(tree, 0.5, 0.5, 0.5, 10.0);
+  test_search(tree); /* searches leave the inserts pending */
+  assert(tree->count == 7 && tree->pending.inserted_count == 4);
+  kdtree_flush(tree);
+  assert(tree->count == 11 && tree->pending.inserted_count == 0);
+  
+  /* removed points are skipped, whether still in the buffer or not */
+  kdtree_insert(tree, 11, 0.25, 0.25, 0.25);
+  kdtree_remove(tree, 11);
+  kdtree_remove(tree, 3);
+  kdtree_remove(tree, 9);
+  kdtree_search(tree, &iter, 0.5, 0.5, 0.5, 0.5);
+  const size_t e1[] = { 0, 1, 2, 4, 5, 6, 7, 8, 10 };
+  validate(iter, 9, e1);
+  assert(kdtree_count_radius(tree, 0.0, 0.0, 0.0, 1.0) == 6);
+  test_visit(tree, 0.5, 0.5, 0.5, 0.87);
+  kdtree_self_join(tree, &pairs, 1.0);
+  for (i = 0, j = 0; i < 11; i++) {
+    for (k = i + 1; k < 11; k++) {
+      if (i == 3 || i == 9 || k == 3 || k == 9) continue;
+      j += ((x[i] - x[k]) * (x[i] - x[k]) + (y[i] - y[k]) * (y[i] - y[k]) +
+            (z[i] - z[k]) * (z[i] - z[k]) <= 1.0);
+    }
+  }
+  assert(pairs->size == j);
+  for (i = 0; i < pairs->size; i++) {
+    assert(pairs->first[i] != 3 && pairs->first[i] != 9);
+    assert(pairs->second[i] != 3 && pairs->second[i] != 9);
+  }
+  
+  /* rows of removed points, and of unused indices, are empty */
+  kdtree_insert(tree, 15, 0.25, 0.25, 0.25);
+  kdtree_search_radius_all(tree, &nbr, 0.9, 1);
+  assert(nbr->count == 16);
+  for (i = 0; i < 15; i++) {
+    if (i == 3 || i == 9 || i >= 11) {
+      assert(nbr->offset[i + 1] == nbr->offset[i]);
+    } else {
+      compare_row(tree, nbr, i, x[i], y[i], z[i], 0.9);
+    }
+  }
+  compare_row(tree, nbr, 15, 0.25, 0.25, 0.25, 0.9);
+  kdtree_remove(tree, 15);
+  assert(tree->pending.removed_count == 2); /* not rebuilt */
+  kdtree_insert(tree, 3, x[3], y[3], z[3]);
+  kdtree_insert(tree, 9, x[9], y[9], z[9]);
+  test_nearest(tree, 0.1, 0.1, 0.1, 1);
+  test_visit(tree, 0.0, 0.0, 0.0, 1.0);
+  test_aggregate(tree, 0.5, 0.5, 0.5, 0.86);
+  test_self_join(tree, 1.0, 39); /* points 3 and 9 reinserted */
+  test_search(tree);
+  
+  /* rebuilding with fewer points reuses the memory of the tree */
+  coord = tree->points.coord[0];
+  kdtree_build(x, y, z, 7, &tree);
+  assert(tree->points.coord[0] == coord && tree->capacity == 11);
+  kdtree_build(x, y, z, 11, &tree);
+  assert(tree->points.coord[0] == coord);
+  
+  /* changes are applied once there are more than the tree tolerates */
+  tree->options.update_fraction = 0.0;
+  for (i = 0; i <= KDTREE_INSERT_BUFFER_SIZE; i++) {
+    kdtree_insert(tree, 11 + i, 100.0 + i, 0.0, 0.0);
+  }
+  assert(tree->count == 12 + KDTREE_INSERT_BUFFER_SIZE);
+  assert(tree->pending.inserted_count == 0);
+  for (i = 0; i <= KDTREE_INSERT_BUFFER_SIZE; i++) kdtree_remove(tree, 11 + i);
+  assert(tree->count == 11 && tree->pending.removed_count == 0);
+  test_search(tree);
+  
+  kdtree_pairs_delete(&pairs);
+  kdtree_neighbours_delete(&nbr);
+  kdtree_iterator_delete(&iter);
+  kdtree_delete(&tree);
+}
+
+/* trees built along a Morton curve hold their points in Morton order, and
+ * find the same points as median trees */
+static void test_morton_build(int layout, int index_only) {
+  size_t order[11], expected[11], i;
+  kdtree_options options;
+  kdtree *tree;
+  
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = 2;
+  options.index_only = index_only;
+  options.build_method = KDTREE_BUILD_MORTON;
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  kdtree_get_order(tree, order);
+  kdtree_morton_order(x, y, z, 11, expected);
+  for (i = 0; i < 11; i++) assert(order[i] == expected[i]);
+  test_search(tree);
+  test_parallel_build(tree);
+  
+  /* flushing puts moved points back in Morton order */
+  if (!index_only) {
+    kdtree_remove(tree, 3);
+    kdtree_insert(tree, 3, x[3], y[3], z[3]);
+    kdtree_flush(tree);
+    kdtree_get_order(tree, order);
+    for (i = 0; i < 11; i++) assert(order[i] == expected[i]);
+    test_search(tree);
+  }
+  kdtree_delete(&tree);
+}
+
+/* searches from a point find the same points as searches at its
+ * coordinates, whichever node they start from */
+static void compare_search_point(kdtree *tree, size_t idx, double X,
+                                 double Y, double Z, double apothem) {
+  kdtree_iterator *iter = NULL, *expected = NULL;
+  
+  kdtree_search_point(tree, &iter, idx, apothem);
+  kdtree_search(tree, &expected, X, Y, Z, apothem);
+  qsort(expected->data, expected->size, sizeof(size_t), cmp);
+  validate(iter, expected->size, expected->data);
+  kdtree_iterator_delete(&iter);
+  kdtree_iterator_delete(&expected);
+}
+
+static void test_search_point(int layout, int build_method) {
+  const double apothem[] = { 0.0, 0.1, 0.5, 0.6, 2.0 };
+  kdtree_options options;
+  kdtree *tree;
+  size_t i, j;
+  
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.leaf_size = 1;
+  options.build_method = build_method;
+  options.self_search = 1;
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  assert(tree->self.leaf != NULL);
+  for (i = 0; i < 11; i++) {
+    for (j = 0; j < 5; j++) {
+      compare_search_point(tree, i, x[i], y[i], z[i], apothem[j]);
+    }
+  }
+  
+  /* moved points are searched from their new position */
+  kdtree_remove(tree, 4);
+  kdtree_insert(tree, 4, 0.5, 0.5, 0.9);
+  kdtree_remove(tree, 8);
+  for (j = 0; j < 5; j++) {
+    compare_search_point(tree, 4, 0.5, 0.5, 0.9, apothem[j]);
+    compare_search_point(tree, 0, x[0], y[0], z[0], apothem[j]);
+    compare_search_point(tree, 9, x[9], y[9], z[9], apothem[j]);
+  }
+  
+  /* and after the tree is rebuilt with them */
+  kdtree_flush(tree);
+  for (j = 0; j < 5; j++) {
+    compare_search_point(tree, 4, 0.5, 0.5, 0.9, apothem[j]);
+    compare_search_point(tree, 0, x[0], y[0], z[0], apothem[j]);
+  }
+  kdtree_delete(&tree);
+}
+
+/* grids answer searches like trees do, whatever size their cells are; the
+ * automatic choice takes a grid only for many evenly spread points */
+static void test_grid(double cell_size, int index_only) {
+  const size_t side = 20, count = side * side * side;
+  kdtree_options options;
+  kdtree *tree;
+  double *coord[3];
+  size_t i, d;
+  
+  kdtree_options_init(&options);
+  options.index = KDTREE_INDEX_GRID;
+  options.grid_cell_size = cell_size;
+  options.index_only = index_only;
+  tree = kdtree_create(&options);
+  kdtree_build(x, y, z, 11, &tree);
+  assert(tree->grid.cells > 0 && tree->layout == KDTREE_LAYOUT_POINTER);
+  test_search(tree);
+  assert(kdtree_refit(x, y, z, 11, &tree) == 1);
+  assert(tree->grid.cells > 0);
+  test_search(tree);
+  
+  if (!index_only) {
+    kdtree_remove(tree, 3);
+    kdtree_insert(tree, 3, x[3], y[3], z[3]);
+    test_search(tree);
+    kdtree_flush(tree);
+    assert(tree->grid.cells > 0);
+    test_search(tree);
+  }
+  kdtree_delete(&tree);
+  
+  /* a lattice is as even as points get, until it is squeezed into a
+   * corner */
+  for (d = 0; d < 3; d++) coord[d] = malloc(sizeof(double) * count);
+  for (i = 0; i < count; i++) {
+    coord[0][i] = (double)(i % side);
+    coord[1][i] = (double)(i / side % side);
+    coord[2][i] = (double)(i / side / side);
+  }
+  options.index = KDTREE_INDEX_AUTO;
+  tree = kdtree_create(&options);
+  kdtree_build(coord[0], coord[1], coord[2], 11, &tree);
+  assert(tree->grid.cells == 0);
+  kdtree_build(coord[0], coord[1], coord[2], count, &tree);
+  assert(tree->grid.cells > 0);
+  assert(kdtree_count_radius(tree, 10.0, 10.0, 10.0, 1.0) == 7);
+  for (i = 0; i < count; i++) {
+    for (d = 0; d < 3; d++) {
+      if (i % 16) coord[d][i] = coord[d][i] * coord[d][i] * 1e-6;
+    }
+  }
+  kdtree_build(coord[0], coord[1], coord[2], count, &tree);
+  assert(tree->grid.cells == 0);
+  kdtree_delete(&tree);
+  for (d = 0; d < 3; d++) free(coord[d]);
+}
+
+/* readers go on searching the published tree while the other is rebuilt
+ * from a snapshot, and until they release it after the swap */
+static void test_buffer(int index_only) {
+  kdtree_options options;
+  kdtree_buffer *buffer;
+  kdtree *old, *tree;
+  double xs[11], ys[11], zs[11];
+  size_t i;
+  
+  kdtree_options_init(&options);
+  options.index_only = index_only;
+  options.leaf_size = 2;
+  buffer = kdtree_buffer_create(&options);
+  assert(kdtree_buffer_acquire(buffer) == NULL);
+  assert(kdtree_buffer_publish(buffer) == 0);
+  
+  for (i = 0; i < 11; i++) { xs[i] = x[i]; ys[i] = y[i]; zs[i] = z[i]; }
+  assert(kdtree_buffer_build(buffer, xs, ys, zs, 11) == 0);
+  for (i = 0; i < 11; i++) xs[i] += 10.0; /* move during the build */
+  kdtree_buffer_wait(buffer);
+  assert(kdtree_buffer_poll(buffer));
+  assert(kdtree_buffer_acquire(buffer) == NULL); /* not yet published */
+  assert(kdtree_buffer_publish(buffer) == 1);
+  old = kdtree_buffer_acquire(buffer);
+  assert(old != NULL);
+  test_search(old);
+  
+  /* rebuild from the moved points, one build at a time */
+  assert(kdtree_buffer_build(buffer, xs, ys, zs, 11) == 0);
+  assert(kdtree_buffer_build(buffer, x, y, z, 11) == -1);
+  for (i = 0; i < 11; i++) xs[i] = 0.0;
+  test_search(old);
+  assert(kdtree_buffer_publish(buffer) == 1);
+  tree = kdtree_buffer_acquire(buffer);
+  assert(tree != old);
+  assert(kdtree_count_radius(tree, 10.5, 0.5, 0.5, 0.01) == 3);
+  test_search(old);
+  kdtree_buffer_release(buffer, old);
+  kdtree_buffer_release(buffer, tree);
+  
+  /* the released tree is the next to be rebuilt */
+  assert(kdtree_buffer_build(buffer, x, y, z, 11) == 0);
+  assert(kdtree_buffer_publish(buffer) == 1);
+  tree = kdtree_buffer_acquire(buffer);
+  assert(tree == old);
+  test_search(tree);
+  kdtree_buffer_release(buffer, tree);
+  kdtree_buffer_delete(&buffer);
+  assert(buffer == NULL);
+}
+
+static int cmp_size(const void *v1, const void *v2) {
+  const size_t a = *((const size_t*)v1);
+  const size_t b = *((const size_t*)v2);
+  return ((a > b) ? 1 : ((a < b) ? -1 : 0));
+}
+
+/* result sets hold the same points as iterators, bitmaps in index order and
+ * runs in tree order */
+static void compare_result_set(kdtree *tree, double x_min, double x_max,
+                               double y_min, double y_max,
+                               double z_min, double z_max) {
+  kdtree_iterator *iter = NULL;
+  kdtree_result_set *set = NULL;
+  size_t i, idx, first = KDTREE_END, *found;
+  int mode;
+  
+  kdtree_search_space(tree, &iter, x_min, x_max, y_min, y_max, z_min, z_max);
+  kdtree_iterator_sort(iter);
+  found = malloc(sizeof(size_t) * (iter->size + 1));
+  
+  for (mode = KDTREE_SET_BITMAP; mode <= KDTREE_SET_RUNS; mode++) {
+    kdtree_search_space_set(tree, &set, mode, x_min, x_max, y_min, y_max,
+                            z_min, z_max);
+    assert(set->size == iter->size);
+    for (i = 0; (idx = kdtree_result_set_get_next(set)) != KDTREE_END; i++) {
+      assert(i < set->size);
+      found[i] = idx;
+      if (i == 0) first = idx;
+    }
+    assert(i == set->size);
+    if (mode == KDTREE_SET_BITMAP) {
+      for (i = 0; i < set->size; i++) {
+        assert(i == 0 || found[i] > found[i - 1]);
+        assert(kdtree_result_set_contains(set, found[i]));
+      }
+      assert(!kdtree_result_set_contains(set, (size_t)1 << 40));
+    } else {
+      qsort(found, set->size, sizeof(size_t), cmp_size);
+    }
+    for (i = 0; i < set->size; i++) assert(found[i] == iter->data[i]);
+    
+    kdtree_result_set_rewind(set);
+    assert(kdtree_result_set_get_next(set) == first);
+  }
+  
+  kdtree_result_set_delete(&set);
+  assert(set == NULL);
+  kdtree_iterator_delete(&iter);
+  free(found);
+}
+
+/* the points of enclosed subtrees, and of a whole tree, are one run */
+static void test_result_set(int layout, int index_only) {
+  const size_t count = 1000;
+  kdtree_options options;
+  kdtree_result_set *set = NULL;
+  kdtree *tree;
+  double *coord[3];
+  size_t i, d;
+  
+  for (d = 0; d < 3; d++) coord[d] = malloc(sizeof(double) * (count + 1));
+  for (i = 0; i < count; i++) {
+    coord[0][i] = (double)(i % 10);
+    coord[1][i] = (double)(i / 10 % 10);
+    coord[2][i] = (double)(i / 100) + 0.01 * (double)(i % 7);
+  }
+  kdtree_options_init(&options);
+  options.layout = layout;
+  options.index_only = index_only;
+  tree = kdtree_create(&options);
+  kdtree_build(coord[0], coord[1], coord[2], count, &tree);
+  
+  compare_result_set(tree, -1.0, 10.0, -1.0, 10.0, -DBL_MAX, DBL_MAX);
+  compare_result_set(tree, 2.5, 7.5, -1.0, 4.0, 1.0, 6.05);
+  compare_result_set(tree, 3.0, 3.0, 3.0, 3.0, 3.0, 3.0);
+  compare_result_set(tree, 20.0, 30.0, 0.0, 1.0, 0.0, 1.0);
+  kdtree_search_space_set(tree, &set, KDTREE_SET_RUNS, -1.0, 10.0, -1.0,
+                          10.0, -DBL_MAX, DBL_MAX);
+  assert(set->size == count && set->runs == 1);
+  
+  /* pending changes are seen without a rebuild, and indices beyond the
+   * count covered */
+  if (!index_only) {
+    kdtree_remove(tree, 0);
+    kdtree_insert(tree, 5000, 4.5, 4.5, 4.5);
+    compare_result_set(tree, 4.0, 5.0, 4.0, 5.0, 4.0, 5.0);
+    compare_result_set(tree, -1.0, 1.0, -1.0, 1.0, -1.0, 1.0);
+    compare_result_set(tree, -1.0, 10.0, -1.0, 10.0, -1.0, 10.0);
+    assert(tree->pending.inserted_count == 1);
+    kdtree_search_space_set(tree, &set, KDTREE_SET_BITMAP, 4.0, 5.0, 4.0,
+                            5.0, 4.0, 5.0);
+    assert(kdtree_result_set_contains(set, 5000));
+  }
+  
+  kdtree_result_set_delete(&set);
+  kdtree_delete(&tree);
+  for (d = 0; d < 3; d++) free(coord[d]);
+}
+
+int main(void) {
+  kdtree *tree = NULL;
+  
+  initialise_points();
+  kdtree_build(x, y, z, 11, &tree);
+  test_search(tree);
+  
+  /* rebuild using the same object */
+  kdtree_build(x, y, z, 11, &tree);
+  test_search(tree);
+  
+  test_parallel_build(tree);
+  test_order(tree);
+  test_periodic(tree);
+#ifdef KDTREE_STATS
+  test_stats(tree);
+#endif
+  
+  test_leaf_size(KDTREE_LAYOUT_POINTER, 1, 21);
+  test_leaf_size(KDTREE_LAYOUT_POINTER, 2, 13);
+  test_leaf_size(KDTREE_LAYOUT_POINTER, 3, 7);
+  test_leaf_size(KDTREE_LAYOUT_POINTER, 11, 1);
+  
+  /* implicit trees are perfect, with leaves of at most leaf_size points */
+  test_leaf_size(KDTREE_LAYOUT_IMPLICIT, 1, 31);
+  test_leaf_size(KDTREE_LAYOUT_IMPLICIT, 2, 15);
+  test_leaf_size(KDTREE_LAYOUT_IMPLICIT, 3, 7);
+  test_leaf_size(KDTREE_LAYOUT_IMPLICIT, 11, 1);
+  
+  test_index_only(KDTREE_LAYOUT_POINTER, 1);
+  test_index_only(KDTREE_LAYOUT_POINTER, 8);
+  test_index_only(KDTREE_LAYOUT_IMPLICIT, 2);
+  
+  test_aggregate_build(KDTREE_LAYOUT_POINTER, 0);
+  test_aggregate_build(KDTREE_LAYOUT_IMPLICIT, 1);
+  
+  test_save_load(KDTREE_LAYOUT_POINTER, 0);
+  test_save_load(KDTREE_LAYOUT_IMPLICIT, 1);
+  
+  test_refit(KDTREE_LAYOUT_POINTER, 0);
+  test_refit(KDTREE_LAYOUT_IMPLICIT, 0);
+  test_refit(KDTREE_LAYOUT_POINTER, 1);
+  test_refit(KDTREE_LAYOUT_IMPLICIT, 1);
+  
+  test_insert_remove(KDTREE_LAYOUT_POINTER);
+  test_insert_remove(KDTREE_LAYOUT_IMPLICIT);
+  
+  test_morton_build(KDTREE_LAYOUT_POINTER, 0);
+  test_morton_build(KDTREE_LAYOUT_IMPLICIT, 1);
+  
+  test_search_point(KDTREE_LAYOUT_POINTER, KDTREE_BUILD_MEDIAN);
+  test_search_point(KDTREE_LAYOUT_IMPLICIT, KDTREE_BUILD_MEDIAN);
+  test_search_point(KDTREE_LAYOUT_POINTER, KDTREE_BUILD_MORTON);
+  
+  test_grid(0.0, 0);
+  test_grid(0.3, 0);
+  test_grid(2.0, 1);
+  
+  test_buffer(0);
+  test_buffer(1);
+  
+  test_result_set(KDTREE_LAYOUT_POINTER, 0);
+  test_result_set(KDTREE_LAYOUT_IMPLICIT, 1);
+  
+  test_threaded_batch(KDTREE_LAYOUT_POINTER, KDTREE_BUILD_MEDIAN);
+  test_threaded_batch(KDTREE_LAYOUT_IMPLICIT, KDTREE_BUILD_MORTON);
+  
   printf("\n ---- ALL TESTS PASSED ---- \n");
   /* clean up */
-  kdtree_iterator_delete(&iter);
   kdtree_delete(&tree);
   free(x); free(y); free(z);
   return 0;
@@ -0,0 +1,226 @@
+/* Tests of the C++ front-end (kd3/kdtree.hpp), against brute force and
+ * against the C tree */
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "kd3/kdtree.hpp"
+extern "C" {
+#include "kd3/kdtree.h"
+}
+
+static double uniform(void) {
+  return std::rand() / (double)RAND_MAX;
+}
+
+/* squared distance of point i from centre */
+template <typename Tree>
+static typename Tree::scalar_type
+distance(const std::vector<typename Tree::scalar_type> coord[],
+         const typename Tree::scalar_type centre[], std::size_t i) {
+  typename Tree::scalar_type total = 0, delta;
+  for (std::size_t d = 0; d < Tree::dims; d++) {
+    delta = coord[d][i] - centre[d];
+    total += delta * delta;
+  }
+  return total;
+}
+
+/* counts points visited by visit_radius() */
+template <typename Scalar, typename Index>
+struct count_visitor {
+  std::size_t *count;
+  Scalar radius_squared;
+  void operator()(Index idx, Scalar d2) const {
+    (void)idx;
+    (void)d2;
+    assert(d2 <= radius_squared);
+    (*count)++;
+  }
+};
+
+/* searches of a tree over count random points (some of them duplicates)
+ * should find exactly the points that brute force does */
+template <typename Tree>
+static void test_tree(std::size_t count) {
+  typedef typename Tree::scalar_type Scalar;
+  typedef typename Tree::index_type Index;
+  std::vector<Scalar> coord[Tree::dims];
+  const Scalar *pointers[Tree::dims];
+  std::vector<Index> found, expected;
+  std::vector<Scalar> found_distance;
+  typename Tree::box space;
+  Scalar centre[Tree::dims], radius, furthest;
+  std::size_t d, i, q, k, visited;
+  Tree tree;
+
+  for (d = 0; d < Tree::dims; d++) {
+    coord[d].resize(count);
+    for (i = 0; i < count; i++) {
+      coord[d][i] = (Scalar)((i % 7 == 0) ? 0.5 : uniform());
+    }
+    pointers[d] = &coord[d][0];
+  }
+  tree.build(pointers, count);
+  assert(tree.size() == count);
+
+  for (q = 0; q < 50; q++) {
+    for (d = 0; d < Tree::dims; d++) {
+      centre[d] = (Scalar)uniform();
+      space.min[d] = centre[d] - (Scalar)(0.3 * uniform());
+      space.max[d] = centre[d] + (Scalar)(0.3 * uniform());
+    }
+    radius = (Scalar)(0.3 * uniform());
+
+    /* box */
+    tree.search_space(space, found);
+    expected.clear();
+    for (i = 0; i < count; i++) {
+      bool inside = true;
+      for (d = 0; d < Tree::dims; d++) {
+        inside = inside && coord[d][i] >= space.min[d] &&
+                 coord[d][i] <= space.max[d];
+      }
+      if (inside) expected.push_back((Index)i);
+    }
+    std::sort(found.begin(), found.end());
+    assert(found == expected);
+
+    /* sphere, with distances */
+    tree.search_radius(centre, radius, found, &found_distance);
+    assert(found.size() == found_distance.size());
+    for (i = 0; i < found.size(); i++) {
+      assert(found_distance[i] == distance<Tree>(coord, centre, found[i]));
+    }
+    expected.clear();
+    for (i = 0; i < count; i++) {
+      if (distance<Tree>(coord, centre, i) <= radius * radius) {
+        expected.push_back((Index)i);
+      }
+    }
+    std::sort(found.begin(), found.end());
+    assert(found == expected);
+
+    /* visitor */
+    count_visitor<Scalar, Index> visitor;
+    visited = 0;
+    visitor.count = &visited;
+    visitor.radius_squared = radius * radius;
+    tree.visit_radius(centre, radius, visitor);
+    assert(visited == expected.size());
+
+    /* nearest, where no point left out is nearer than the last found */
+    k = 1 + q;
+    tree.search_nearest(centre, k, found, &found_distance);
+    assert(found.size() == std::min(k, count));
+    for (i = 1; i < found.size(); i++) {
+      assert(found_distance[i - 1] <= found_distance[i]);
+    }
+    furthest = found_distance.back();
+    for (i = 0, visited = 0; i < count; i++) {
+      if (distance<Tree>(coord, centre, i) < furthest) visited++;
+    }
+    assert(visited < found.size());
+  }
+}
+
+/* returns the indices (and squared distances if distance is not NULL) left
+ * in a C iterator */
+static std::vector<std::size_t> drain(kdtree_iterator *iter,
+                                      std::vector<double> *distance) {
+  std::vector<std::size_t> result;
+  std::size_t idx;
+  double d2;
+
+  if (distance) distance->clear();
+  while (true) {
+    idx = distance ? kdtree_iterator_get_next_with_distance(iter, &d2)
+                   : kdtree_iterator_get_next(iter);
+    if (idx == KDTREE_END) break;
+    result.push_back(idx);
+    if (distance) distance->push_back(d2);
+  }
+  return result;
+}
+
+/* kd3::tree3d and a C tree with KDTREE_LAYOUT_IMPLICIT, built on the same
+ * points, should find the same points for the same searches */
+static void test_c_parity(std::size_t count) {
+  std::vector<double> coord[3], c_distance, found_distance;
+  const double *pointers[3];
+  std::vector<std::size_t> found, expected;
+  kd3::tree3d::box space;
+  kdtree_options options;
+  kdtree_iterator *iter = NULL;
+  kdtree *c_tree;
+  kd3::tree3d tree;
+  double centre[3], radius;
+  std::size_t d, i, q, k;
+
+  for (d = 0; d < 3; d++) {
+    coord[d].resize(count);
+    for (i = 0; i < count; i++) coord[d][i] = uniform();
+    pointers[d] = &coord[d][0];
+  }
+  tree.build(pointers, count);
+  kdtree_options_init(&options);
+  options.layout = KDTREE_LAYOUT_IMPLICIT;
+  options.leaf_size = kd3::tree3d::leaf_size;
+  c_tree = kdtree_create(&options);
+  kdtree_build(&coord[0][0], &coord[1][0], &coord[2][0], count, &c_tree);
+
+  for (q = 0; q < 50; q++) {
+    for (d = 0; d < 3; d++) {
+      centre[d] = uniform();
+      space.min[d] = centre[d] - 0.3 * uniform();
+      space.max[d] = centre[d] + 0.3 * uniform();
+    }
+    radius = 0.3 * uniform();
+
+    /* box */
+    tree.search_space(space, found);
+    kdtree_search_space(c_tree, &iter, space.min[0], space.max[0],
+                        space.min[1], space.max[1], space.min[2],
+                        space.max[2]);
+    expected = drain(iter, NULL);
+    std::sort(found.begin(), found.end());
+    std::sort(expected.begin(), expected.end());
+    assert(found == expected);
+
+    /* sphere */
+    tree.search_radius(centre, radius, found);
+    kdtree_search_radius(c_tree, &iter, centre[0], centre[1], centre[2],
+                         radius);
+    expected = drain(iter, NULL);
+    std::sort(found.begin(), found.end());
+    std::sort(expected.begin(), expected.end());
+    assert(found == expected);
+
+    /* nearest, in the same order and at the same distances */
+    k = 1 + q;
+    tree.search_nearest(centre, k, found, &found_distance);
+    kdtree_search_nearest(c_tree, &iter, centre[0], centre[1], centre[2],
+                          k);
+    expected = drain(iter, &c_distance);
+    assert(found == expected);
+    assert(found_distance == c_distance);
+  }
+
+  kdtree_iterator_delete(&iter);
+  kdtree_delete(&c_tree);
+}
+
+int main(void) {
+  test_tree<kd3::tree3d>(1000);
+  test_tree<kd3::tree3d>(2);
+  test_tree<kd3::tree2f>(1000);
+  test_tree<kd3::tree<float, 3, std::uint32_t, 1> >(37);
+  test_tree<kd3::tree<double, 2, std::uint64_t, 16> >(5000);
+  test_tree<kd3::tree<double, 4> >(300);
+  test_c_parity(1000);
+  test_c_parity(3);
+
+  std::printf("\n ---- ALL C++ TESTS PASSED ---- \n");
+  return 0;
+}